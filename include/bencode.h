@@ -1,9 +1,11 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 #include <stdexcept>
 #include <cstddef>
+#include <cstdint>
 
 // Forward declare BValue
 class BValue;
@@ -72,6 +74,9 @@ public:
 };
 
 // ----- Decoder API -----
+// All decoders accept only canonical BEP 3 bencode: no leading zeros in
+// integers or string lengths, no "-0", integers within 64 bits, and
+// dictionary keys in strictly increasing byte order (so no duplicates).
 BValue decodeValue(const std::string& data, size_t& pos);
 long long decodeInt(const std::string& data, size_t& pos);
 std::string decodeString(const std::string& data, size_t& pos);
@@ -87,3 +92,86 @@ void skipBencodeValue(const std::string& data, size_t& pos);
 //
 // Throws runtime_error on malformed bencode or if not found.
 std::pair<size_t, size_t> findInfoValueRange(const std::string& data);
+
+// ----- Validation and tape -----
+// Stage one of decoding: a single pass that checks the canonical form
+// above. bencodeValidate only checks; BencodeTape also records every value,
+// without copying any string bytes, and decodeValue builds its BValue tree
+// from that record. BencodeReader does not use a tape: it (and so ParseFile)
+// re-scans digits and delimiters with scanInt/scanLength after validation.
+// ParseFile validates without recording, because a tape for a large torrent
+// costs more to build (16 bytes per value) than those re-scans.
+
+const size_t BENCODE_MAX_DEPTH = 256;   // nested lists/dicts
+
+// Check the value starting at data[pos] without allocating. On success
+// returns nullptr and moves pos past the value; otherwise returns the
+// reason and leaves pos at the offending byte.
+const char *bencodeValidate(const char *data, size_t size, size_t &pos);
+
+// One entry per value plus one closing entry per list/dict, in document
+// order. Offsets are 32-bit, so inputs are limited to 4 GiB.
+struct BencodeTapeEntry {
+    BType type;            // NONE closes the most recent open LIST/DICT
+    uint32_t offset;       // strings: first content byte; others: the 'i', 'l', 'd' or 'e'
+    union {
+        long long int_val; // INT
+        uint32_t length;   // STRING
+        uint32_t match;    // LIST/DICT: index of the closing entry; NONE: index of the opener
+    };
+};
+
+class BencodeTape {
+public:
+    // Validate the value at data[pos] and record it, replacing any previous
+    // contents. Returns the offset just past the value. Throws
+    // runtime_error on malformed or non-canonical input. `data` must
+    // outlive the tape.
+    size_t build(const char *data, size_t size, size_t pos = 0);
+
+    size_t size() const { return tape_.size(); }
+    const BencodeTapeEntry &operator[](size_t i) const { return tape_[i]; }
+    std::string_view string(size_t i) const { return std::string_view(data_ + tape_[i].offset, tape_[i].length); }
+    // Index of the entry after value i and all of its children.
+    size_t next(size_t i) const {
+        BType t = tape_[i].type;
+        return (t == BType::LIST || t == BType::DICT) ? tape_[i].match + 1 : i + 1;
+    }
+    BValue toValue(size_t i = 0) const;
+
+private:
+    const char *data_ = nullptr;
+    std::vector<BencodeTapeEntry> tape_;
+};
+
+// ----- Streaming decoder -----
+// Pull-style reader over a bencoded buffer. Values are consumed in order
+// without building BValue trees; strings come back as views into the
+// buffer, so the buffer must outlive them.
+//
+//   r.enterDict();
+//   while (r.more()) { std::string_view key = r.readString(); ... }
+class BencodeReader {
+public:
+    BencodeReader(const char *data, size_t size, size_t pos = 0) : data_(data), size_(size), pos_(pos) {}
+
+    size_t position() const { return pos_; }
+    BType peek() const;                // type of the next value, NONE at 'e'
+
+    long long readInt();
+    std::string_view readString();
+    void enterList();
+    void enterDict();
+    // True if the current list/dict has another element; at its 'e',
+    // consumes it and returns false.
+    bool more();
+    // Skip one value of any type. Returns its raw bytes.
+    std::string_view skip();
+
+private:
+    [[noreturn]] void fail(const char *what) const;
+
+    const char *data_;
+    size_t size_;
+    size_t pos_;
+};
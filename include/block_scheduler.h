@@ -0,0 +1,166 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "peer_wire.h"
+#include "storage.h"
+
+// Block-level request scheduling for one torrent across its peers.
+//
+// Each peer's request queue is sized from its bandwidth-delay product: the
+// measured delivery rate times the smallest request-to-block time seen, with
+// headroom so the queue can grow until the link, not the queue, is the
+// limit. A peer that delivers nothing for `snub_timeout` while holding
+// requests is snubbed: its blocks are released to other peers (its requests
+// stay valid if the data turns up after all) and it is kept to one request.
+// Once every missing block is requested, endgame mode lets idle peers ask
+// for blocks others already hold; the first copy to arrive wins and the rest
+// are returned for cancel messages.
+//
+// Pieces are chosen rarest first (random among equals), finishing started
+// pieces before opening new ones. Time is in seconds on any monotonic clock.
+
+const size_t BLOCK_QUEUE_MIN = 2;
+const size_t BLOCK_QUEUE_START = 4;      // before a peer has been measured
+const size_t BLOCK_QUEUE_MAX = 500;
+const double BLOCK_QUEUE_HEADROOM = 2.0; // queue = headroom * rate * rtt / block size
+
+class BlockRequest {
+public:
+    uint32_t piece = 0;
+    uint32_t begin = 0;
+    uint32_t length = 0;
+
+    bool operator==(const BlockRequest &o) const { return piece == o.piece && begin == o.begin; }
+};
+
+class BlockSchedulerOptions {
+public:
+    size_t fixed_depth = 0;      // requests per peer; 0 sizes the queue from the BDP
+    double snub_timeout = 10.0;
+    bool endgame = true;
+    unsigned seed = 1;           // tie-breaking among equally rare pieces
+};
+
+class BlockScheduler {
+public:
+    BlockScheduler(const FileStorage &storage, std::vector<uint8_t> piece_priorities = {},
+                   BlockSchedulerOptions opts = BlockSchedulerOptions());
+
+    size_t addPeer();
+    // Outstanding requests go back to the pool.
+    void removePeer(size_t peer);
+    void setBitfield(size_t peer, const std::vector<bool> &have);
+    void peerHas(size_t peer, size_t piece);
+    // A choke discards the peer's pending requests (BEP 3).
+    void setChoked(size_t peer, bool choked);
+    // Whether the peer has a piece we still need
+    bool interesting(size_t peer) const;
+
+    // Requests to send to the peer now, topping its queue up to queueDepth().
+    std::vector<BlockRequest> requestsFor(size_t peer, double now);
+    // False for a block nobody needs any more. Other peers that were asked
+    // for the same block (endgame) are appended to `cancel`, and their
+    // requests are dropped.
+    bool blockReceived(size_t peer, const BlockRequest &block, double now,
+                       std::vector<std::pair<size_t, BlockRequest>> &cancel);
+    // The peer will not serve this request (e.g. it cancelled it itself).
+    void requestRejected(size_t peer, const BlockRequest &block);
+
+    bool pieceComplete(size_t piece) const;   // every block received
+    void pieceVerified(size_t piece);
+    void pieceFailed(size_t piece);           // hash mismatch: fetch it again
+    void markHave(size_t piece) { pieceVerified(piece); }
+    bool havePiece(size_t piece) const { return pieces_[piece].have; }
+
+    // Partly downloaded pieces, for fast-resume: one bit per block, most
+    // significant bit first like BITFIELD. receivedBlocks() is empty for a
+    // piece that is not started; restoreBlocks() marks blocks already in
+    // storage as received (ignored for pieces we have or do not want).
+    const std::vector<size_t> &partialPieces() const { return partial_; }
+    std::vector<uint8_t> receivedBlocks(size_t piece) const;
+    void restoreBlocks(size_t piece, const std::vector<uint8_t> &mask);
+
+    // Snub detection and rate decay; call periodically.
+    void tick(double now);
+
+    bool finished() const { return remaining_ == 0; }
+    bool inEndgame() const { return endgame_; }
+    size_t piecesRemaining() const { return remaining_; }
+
+    size_t queueDepth(size_t peer) const;
+    size_t outstanding(size_t peer) const { return peers_[peer].outstanding.size(); }
+    double peerRate(size_t peer) const { return peers_[peer].rate; }
+    double peerRtt(size_t peer) const { return peers_[peer].min_rtt; }
+    bool snubbed(size_t peer) const { return peers_[peer].snubbed; }
+
+    size_t blocksInPiece(size_t piece) const;
+    uint32_t blockLength(size_t piece, size_t block) const;
+
+    // Counters for benchmarks
+    size_t reassignedBlocks() const { return reassigned_; }
+    size_t endgameRequests() const { return endgame_requests_; }
+    size_t cancelsSent() const { return cancels_; }
+    size_t duplicateBlocks() const { return duplicates_; }
+
+private:
+    enum BlockState : uint8_t { BLOCK_FREE, BLOCK_REQUESTED, BLOCK_RECEIVED };
+
+    class PieceState {
+    public:
+        std::vector<uint8_t> blocks;   // BlockState per block; allocated when the piece is started
+        uint32_t requested = 0;        // blocks in BLOCK_REQUESTED
+        uint32_t received = 0;
+        bool have = false;
+        bool started = false;
+    };
+
+    class Pending {
+    public:
+        BlockRequest block;
+        double sent;
+    };
+
+    class PeerState {
+    public:
+        std::vector<bool> have;
+        bool connected = true;
+        bool choked = true;
+        bool snubbed = false;
+        double rate = 0;        // bytes/s, exponentially decayed
+        double rate_time = 0;
+        double min_rtt = 0;     // seconds, 0 until measured
+        double last_block = 0;
+        std::vector<Pending> outstanding;
+    };
+
+    bool wanted(size_t piece) const { return !pieces_[piece].have && (prio_.empty() || prio_[piece] != 0); }
+    void startPiece(size_t piece);
+    void setBlock(size_t piece, size_t block, BlockState state);
+    // Release a block a peer no longer serves, unless another peer also has it requested
+    void releaseBlock(size_t peer, const BlockRequest &block);
+    bool requestedByOther(size_t peer, const BlockRequest &block) const;
+    size_t pickPiece(size_t peer);
+    void request(size_t peer, size_t piece, size_t block, double now, std::vector<BlockRequest> &out);
+
+    const FileStorage &storage_;
+    std::vector<uint8_t> prio_;
+    BlockSchedulerOptions opts_;
+    std::vector<PieceState> pieces_;
+    std::vector<uint32_t> piece_size_;
+    std::vector<uint32_t> availability_;
+    std::vector<size_t> partial_;   // started, unverified pieces, oldest first
+    std::vector<PeerState> peers_;
+    size_t remaining_ = 0;          // wanted pieces not yet verified
+    size_t unstarted_ = 0;          // of those, pieces with no block state yet
+    bool endgame_ = false;
+    std::mt19937 rng_;
+
+    size_t reassigned_ = 0;
+    size_t endgame_requests_ = 0;
+    size_t cancels_ = 0;
+    size_t duplicates_ = 0;
+};
@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+class CreateOptions {
+public:
+    int64_t piece_length = 256 * 1024;
+    std::string announce;
+    std::string comment;
+    std::string created_by = "PeerStorm";
+    bool v2 = false;          // hybrid torrent: add file tree, piece layers and pad files
+    unsigned threads = 0;     // hashing workers, 0 = hardware concurrency
+};
+
+// Build a .torrent for a file or directory and return its bencoded bytes.
+// Files are ordered by path components (the BEP 52 file tree order) so the
+// output is deterministic. One thread reads large sequential chunks while the
+// workers hash the chunks already read.
+std::string CreateTorrent(const std::string &path, const CreateOptions &opts);
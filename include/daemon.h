@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "bencode.h"
+
+// Session daemon: keeps torrents parsed and registered in memory and serves
+// requests on a Unix domain socket, so repeated commands skip process
+// startup and re-parsing.
+//
+// Wire format, both directions: a 4-byte big-endian length followed by one
+// bencoded dictionary. Every request carries "op" and may carry an integer
+// "id", which is echoed back. Responses have "ok" (1/0) and, on failure,
+// "error".
+//
+//   add       "path" (.torrent, absolute) or "magnet", optional "save path"
+//             -> "info-hash" (20 bytes), "name", "existed"
+//   remove    "info-hash"
+//   status    optional "info-hash" -> "torrents": list of dicts with
+//             "info-hash", "name", "size", "pieces", "have" (-1 until
+//             verified), "save path"
+//   verify    "info-hash", optional "save path" -> "have", "pieces",
+//             "rechecked", "resume"
+//   stats     optional "format" ("table" or "prometheus") -> "text"
+//   shutdown
+//
+// Clients may pipeline: the daemon handles every complete request it has
+// received before writing, and sends the responses in one write, in order.
+// A verify runs on a worker thread, so other connections are served while
+// it reads pieces back. Later requests on its own connection wait for it,
+// which keeps responses in order. While it runs, removing that torrent fails
+// with "verify in progress".
+
+const size_t DAEMON_MAX_FRAME = 64 * 1024 * 1024;
+
+// $PEERSTORM_SOCKET, else $XDG_RUNTIME_DIR/peerstorm.sock, else
+// /tmp/peerstorm-<uid>.sock.
+std::string DefaultDaemonSocket();
+
+class DaemonOptions {
+public:
+    std::string socket_path;
+    std::string resume_dir = ".peerstorm/resume";
+};
+
+// Serve until a shutdown request. Throws runtime_error if the socket cannot
+// be set up (including when another daemon already owns it).
+void RunDaemon(const DaemonOptions &opts);
+
+class DaemonClient {
+public:
+    // Throws runtime_error when no daemon is listening on socket_path.
+    explicit DaemonClient(const std::string &socket_path);
+    ~DaemonClient();
+    DaemonClient(const DaemonClient &) = delete;
+    DaemonClient &operator=(const DaemonClient &) = delete;
+
+    // Queue a request; nothing is written until flush() or receive().
+    void send(const BDict &request);
+    void flush();
+    // Next response, in request order.
+    BDict receive();
+    BDict call(const BDict &request) { send(request); return receive(); }
+
+private:
+    int fd_ = -1;
+    std::string out_;
+    std::string in_;
+    size_t in_pos_ = 0;
+};
@@ -0,0 +1,120 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "parser.h"
+#include "piece_store.h"
+#include "storage.h"
+
+// Cross-torrent deduplication: finds files of one torrent that already exist
+// on disk under another, by content rather than by name.
+//
+// A file's content key is a SHA-1 over its length and either
+//   v1: the piece length, the offset of the first piece that starts inside
+//       the file, and the hashes of the pieces lying entirely inside it, or
+//   v2: its pieces root.
+// Hybrid files get both keys. Two v1 files only match when their pieces line
+// up the same way (same piece length and offset into the file), which holds
+// for single-file torrents, first files and pad-aligned files. A v1 key does
+// not cover the bytes before the first or after the last whole piece, so
+// data taken from the index is always hash-checked against the new torrent.
+
+class DedupKey {
+public:
+    std::array<uint8_t, 20> bytes{};
+
+    bool operator==(const DedupKey &o) const { return bytes == o.bytes; }
+};
+
+// Content keys of one file; empty for pad files and for v1 files that hold
+// no whole piece (and have no v2 root).
+std::vector<DedupKey> DedupFileKeys(const TorrentMetadata &meta, const FileStorage &storage, size_t file_index);
+
+class DedupLocation {
+public:
+    std::string path;                     // the file on disk
+    uint64_t length = 0;
+    std::array<uint8_t, 20> info_hash{};  // torrent it was imported from
+    uint32_t file_index = 0;
+};
+
+// Persistent key -> locations map. Entries are spread over shards, each with
+// its own reader-writer lock, so imports on many threads and lookups can run
+// at the same time.
+//
+// File layout: "PSDI", version, entry count, then per entry the key, info
+// hash, file index, length and path, integers little-endian. save() writes a
+// new file and renames it over the old one.
+class DedupIndex {
+public:
+    // Loads `path` if it exists; throws runtime_error if it is not an index.
+    explicit DedupIndex(std::string path);
+
+    // Index every non-pad file of a torrent stored under root_dir. Returns
+    // the number of keys added; files already indexed for this torrent are
+    // skipped. Thread-safe.
+    size_t addTorrent(const TorrentMetadata &meta, const FileStorage &storage, const std::string &root_dir);
+    std::vector<DedupLocation> find(const DedupKey &key) const;   // thread-safe
+
+    void save() const;
+    size_t size() const;   // keys
+    const std::string &path() const { return path_; }
+
+private:
+    static const size_t SHARDS = 64;
+
+    class KeyHash {
+    public:
+        size_t operator()(const DedupKey &k) const;
+    };
+
+    class Shard {
+    public:
+        mutable std::shared_mutex m;
+        std::unordered_map<DedupKey, std::vector<DedupLocation>, KeyHash> map;
+    };
+
+    Shard &shardFor(const DedupKey &key) const { return shards_[key.bytes[19] % SHARDS]; }
+    bool insert(const DedupKey &key, DedupLocation loc);
+    void load();
+
+    std::string path_;
+    mutable Shard shards_[SHARDS];
+};
+
+class DedupImportResult {
+public:
+    size_t torrents = 0;
+    size_t keys = 0;
+    std::vector<std::pair<std::string, std::string>> errors;   // torrent path, message
+};
+
+// Parse and index torrents stored under root_dir on `threads` workers
+// (0 = hardware concurrency).
+DedupImportResult ImportTorrents(DedupIndex &index, const std::vector<std::string> &torrent_paths,
+                                 const std::string &root_dir, unsigned threads = 0);
+
+class DedupFillResult {
+public:
+    size_t files_present = 0;     // already on disk with the right size; left alone
+    size_t files_cloned = 0;      // reflinked: shares blocks with the source
+    size_t files_copied = 0;
+    uint64_t bytes = 0;           // cloned or copied
+    std::vector<size_t> verified; // pieces touching a filled file that now check out
+    size_t failed = 0;            // pieces touching a filled file that do not
+};
+
+// Put files of `meta` that are missing under the store's root in place from
+// local copies the index knows about: a reflink (FICLONE) where the
+// filesystem supports it, else a plain copy. Files the store skips are left
+// alone. Then hash-check every wanted piece touching a filled file; edge
+// pieces are read through the store, so bytes in its part file count. Pieces
+// that fail, e.g. edge pieces whose other files are not here yet, are left
+// for the network.
+DedupFillResult FillFromIndex(const DedupIndex &index, const TorrentMetadata &meta, const FileStorage &storage,
+                              PieceStore &store, unsigned threads = 0);
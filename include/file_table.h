@@ -0,0 +1,97 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// BEP 47 file attributes, stored as bit flags instead of the "attr" string
+enum FileFlags : uint8_t {
+    FILE_PAD = 1,         // 'p'
+    FILE_EXECUTABLE = 2,  // 'x'
+    FILE_HIDDEN = 4,      // 'h'
+    FILE_SYMLINK = 8      // 'l'
+};
+
+uint8_t fileFlagsFromAttr(std::string_view attr);
+
+// Compact file list of a torrent. Every distinct path component is stored
+// once in a string pool; directories form a tree of (parent, name) indices
+// and files point at their directory. Per-file data lives in parallel
+// columns, so a file costs a few dozen bytes instead of a vector of strings.
+// v2 pieces roots and piece layers are kept in side tables that are only
+// allocated for v2 torrents.
+class FileTable {
+public:
+    static constexpr uint32_t ROOT_DIR = 0;
+
+    FileTable();
+
+    // --- building ---
+    uint32_t directory(uint32_t parent, std::string_view name);   // find or create
+    size_t addFile(uint32_t dir, std::string_view name, int64_t length, uint8_t flags = 0);
+    void setPiecesRoot(size_t i, const uint8_t *root);              // 32 bytes
+    void setPieceLayer(size_t i, const uint8_t *layer, size_t bytes);
+
+    // Lookups that never create anything. Return NOT_FOUND when absent.
+    static constexpr uint32_t NOT_FOUND = 0xFFFFFFFFu;
+    uint32_t findDirectory(uint32_t parent, std::string_view name) const;
+    uint32_t findFile(uint32_t dir, std::string_view name) const;
+
+    // Drop the lookup maps used while building. They are rebuilt on demand.
+    void finalize();
+
+    // --- access ---
+    size_t size() const { return lengths_.size(); }
+    bool empty() const { return lengths_.empty(); }
+    int64_t length(size_t i) const { return lengths_[i]; }
+    uint64_t offset(size_t i) const { return offsets_[i]; }    // start in the concatenated v1 stream
+    uint8_t flags(size_t i) const { return flags_[i]; }
+    bool isPad(size_t i) const { return (flags_[i] & FILE_PAD) != 0; }
+    std::string_view name(size_t i) const { return component(file_name_[i]); }
+    std::vector<std::string> path(size_t i) const;
+    std::string joinedPath(size_t i, char sep = '/') const;
+
+    const uint8_t *piecesRoot(size_t i) const;     // nullptr unless the file has one
+    const uint8_t *pieceLayer(size_t i) const;     // nullptr unless the file has one
+    size_t pieceLayerSize(size_t i) const;         // bytes
+
+    size_t memoryUsage() const;
+
+private:
+    uint32_t intern(std::string_view s);
+    uint32_t findComponent(std::string_view s) const;
+    std::string_view component(uint32_t id) const {
+        return std::string_view(pool_.data() + comp_offset_[id], comp_offset_[id + 1] - comp_offset_[id]);
+    }
+    void buildIndex() const;
+
+    // interned components: component k is pool_[comp_offset_[k] .. comp_offset_[k + 1])
+    std::string pool_;
+    std::vector<uint32_t> comp_offset_;
+
+    // directory tree
+    std::vector<uint32_t> dir_parent_;
+    std::vector<uint32_t> dir_name_;
+
+    // file columns
+    std::vector<uint32_t> file_dir_;
+    std::vector<uint32_t> file_name_;
+    std::vector<int64_t> lengths_;
+    std::vector<uint64_t> offsets_;
+    std::vector<uint8_t> flags_;
+
+    // v2 side tables
+    std::vector<uint32_t> root_index_;      // per file, NOT_FOUND when no root
+    std::vector<uint8_t> roots_;            // 32 bytes per root
+    std::vector<uint64_t> layer_offset_;    // per root, into layers_
+    std::vector<uint32_t> layer_size_;      // per root, bytes
+    std::vector<uint8_t> layers_;
+
+    // build-time lookup maps, keyed by hash; collisions probe the next key
+    mutable std::unordered_map<uint64_t, uint32_t> comp_index_;
+    mutable std::unordered_map<uint64_t, uint32_t> dir_index_;    // (parent, component) -> dir
+    mutable std::unordered_map<uint64_t, uint32_t> file_index_;   // (dir, component) -> file
+    mutable bool indexed_ = true;
+};
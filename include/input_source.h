@@ -0,0 +1,49 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+enum InputMode {
+    INPUT_AUTO,   // map regular files of at least INPUT_MMAP_THRESHOLD bytes, read the rest
+    INPUT_MMAP,   // map regular files; pipes and terminals are still read
+    INPUT_READ    // always read into memory
+};
+
+// Below this size, one read() costs less than setting up and faulting in a mapping.
+const size_t INPUT_MMAP_THRESHOLD = 256 * 1024;
+
+// The whole contents of a file or stream, opened once and kept in memory
+// for the decoder: either a read-only private mapping (advised sequential,
+// since the parser reads it front to back: a validation pass, then an
+// extraction pass) or a buffer filled by plain reads. The bytes stay valid
+// for the lifetime of the object.
+class InputSource {
+public:
+    InputSource() = default;
+    ~InputSource();
+    InputSource(InputSource &&other) noexcept;
+    InputSource &operator=(InputSource &&other) noexcept;
+    InputSource(const InputSource &) = delete;
+    InputSource &operator=(const InputSource &) = delete;
+
+    // "-" reads standard input. Throws runtime_error if the path cannot be
+    // opened or read.
+    static InputSource open(const std::string &path, InputMode mode = INPUT_AUTO);
+    // Read an already open descriptor (pipe, socket, stdin) to EOF. The
+    // descriptor is not closed.
+    static InputSource readFd(int fd);
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+    bool mapped() const { return mapped_; }
+
+private:
+    void release();
+
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::string buffer_;
+#ifdef _WIN32
+    void *mapping_ = nullptr;   // file mapping HANDLE
+#endif
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "magnet_parser.h"
+#include "torrent_index.h"
+
+// A string stored in MagnetBatch::pool
+class PoolString {
+public:
+    uint32_t offset = 0;
+    uint32_t length = 0;
+};
+
+// Columnar result of ParseMagnetBatch. Every string of every link is a slice
+// of one shared pool; the trackers of link i are
+// trackers[tracker_begin[i] .. tracker_begin[i + 1]), web seeds likewise.
+// Repeated tracker and web seed URLs are stored in the pool once.
+class MagnetBatch {
+public:
+    std::vector<InfoHash> info_hashes;
+    std::vector<PoolString> display_names;
+    std::vector<int64_t> file_sizes;           // -1 when xl is absent
+    std::vector<uint32_t> tracker_begin{0};
+    std::vector<PoolString> trackers;
+    std::vector<uint32_t> web_seed_begin{0};
+    std::vector<PoolString> web_seeds;
+    std::string pool;
+    std::vector<size_t> rejected_lines;        // 0-based input lines that were not valid magnet links
+
+    size_t size() const { return info_hashes.size(); }
+    std::string_view view(PoolString s) const { return std::string_view(pool.data() + s.offset, s.length); }
+
+    // Empty the batch but keep every buffer, so parsing the next chunk of a
+    // feed into the same batch does not allocate.
+    void clear();
+
+    // Materialise link i in the per-link representation ParseMagnet returns.
+    MagnetData toMagnetData(size_t i) const;
+
+private:
+    friend size_t ParseMagnetBatch(const char *data, size_t len, MagnetBatch &out);
+
+    bool parseLine(const char *p, const char *end);
+    PoolString intern(size_t start);
+
+    std::unordered_map<uint64_t, PoolString> interned_;   // URL hash -> pooled copy
+    std::vector<uint64_t> line_interned_;                 // new interned_ keys of the current line
+};
+
+// Parse a buffer of newline-separated magnet links and append them to `out`.
+// Invalid lines are skipped and listed in out.rejected_lines. Unknown
+// parameters are ignored. Returns the number of links appended. Throws
+// runtime_error, before appending the line, if a line could push the pool
+// past 4 GiB.
+size_t ParseMagnetBatch(const char *data, size_t len, MagnetBatch &out);
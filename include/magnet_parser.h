@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <stdexcept>
 
 
 class  MagnetData {
@@ -22,14 +23,29 @@ public:
 
 // ================= Helper Functions ====================
 
+// 256-entry lookup tables, built at compile time. 0xFF marks invalid input.
+struct MagnetDecodeTables {
+    uint8_t hex[256];
+    uint8_t base32[256];
+    constexpr MagnetDecodeTables() : hex(), base32() {
+        for (int i = 0; i < 256; i++) { hex[i] = 0xFF; base32[i] = 0xFF; }
+        for (int i = 0; i < 10; i++) hex['0' + i] = (uint8_t)i;
+        for (int i = 0; i < 6; i++) { hex['a' + i] = (uint8_t)(10 + i); hex['A' + i] = (uint8_t)(10 + i); }
+        for (int i = 0; i < 26; i++) { base32['A' + i] = (uint8_t)i; base32['a' + i] = (uint8_t)i; }
+        for (int i = 0; i < 6; i++) base32['2' + i] = (uint8_t)(26 + i);
+    }
+};
+static constexpr MagnetDecodeTables MAGNET_TABLES{};
+
 // percent-decoding
 static std::string urlDecode(const std::string &s) {
     std::string out;
     out.reserve(s.size());
     for (size_t i = 0; i < s.size(); ++i) {
         if (s[i] == '%' && i + 2 < s.size()) {
-            int hi = std::stoi(s.substr(i + 1, 1), nullptr, 16);
-            int lo = std::stoi(s.substr(i + 2, 1), nullptr, 16);
+            uint8_t hi = MAGNET_TABLES.hex[(unsigned char)s[i + 1]];
+            uint8_t lo = MAGNET_TABLES.hex[(unsigned char)s[i + 2]];
+            if ((hi | lo) == 0xFF) throw std::runtime_error("Invalid percent-encoding");
             out.push_back((char)((hi << 4) | lo));
             i += 2;
         } else if (s[i] == '+') {
@@ -46,36 +62,35 @@ static std::vector<uint8_t> hexBytes(const std::string &hex) {
     if (hex.size() % 2 != 0) throw std::runtime_error("Invalid hex length");
     std::vector<uint8_t> out(hex.size() / 2);
     for (size_t i = 0; i < out.size(); i++) {
-        out[i] = (uint8_t)std::stoi(hex.substr(2*i, 2), nullptr, 16);
+        uint8_t hi = MAGNET_TABLES.hex[(unsigned char)hex[2*i]];
+        uint8_t lo = MAGNET_TABLES.hex[(unsigned char)hex[2*i + 1]];
+        if ((hi | lo) == 0xFF) throw std::runtime_error("Invalid hex digit");
+        out[i] = (uint8_t)((hi << 4) | lo);
     }
     return out;
 }
 
 // convert bytes -> lowercase hex
 static std::string toHex(const std::vector<uint8_t> &bytes) {
-    std::ostringstream oss;
-    oss << std::hex << std::setfill('0');
-    for (auto b : bytes) oss << std::setw(2) << (int)b;
-    return oss.str();
+    static const char digits[] = "0123456789abcdef";
+    std::string out(bytes.size() * 2, '0');
+    for (size_t i = 0; i < bytes.size(); i++) {
+        out[2*i] = digits[bytes[i] >> 4];
+        out[2*i + 1] = digits[bytes[i] & 0x0F];
+    }
+    return out;
 }
 
 // RFC4648 base32 decode
 static std::vector<uint8_t> base32Decode(const std::string &input) {
-    static const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
-    int lookup[256];
-    std::fill(std::begin(lookup), std::end(lookup), -1);
-
-    for (int i = 0; i < 32; i++) {
-        lookup[(unsigned char)alphabet[i]] = i;
-        lookup[(unsigned char)std::tolower(alphabet[i])] = i;
-    }
-
     std::vector<uint8_t> output;
+    output.reserve(input.size() * 5 / 8);
     int buffer = 0, bits = 0;
 
     for (char c : input) {
-        if (lookup[(unsigned char)c] == -1) continue;
-        buffer = (buffer << 5) | lookup[(unsigned char)c];
+        uint8_t v = MAGNET_TABLES.base32[(unsigned char)c];
+        if (v == 0xFF) continue;
+        buffer = ((buffer << 5) | v) & 0xFFF;
         bits += 5;
 
         if (bits >= 8) {
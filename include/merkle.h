@@ -0,0 +1,68 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "parser.h"
+
+// BEP 52 merkle trees. Leaves are SHA-256 hashes of 16 KiB blocks of a single
+// file (the last block may be short). Leaves past the end of the file are all
+// zero, and the leaf count is padded to a power of two. Hash layers are stored
+// flat as concatenated 32-byte hashes, the same way v1 `pieces` stores 20-byte
+// SHA-1 hashes.
+constexpr std::size_t MERKLE_BLOCK_SIZE = 16 * 1024;
+constexpr std::size_t MERKLE_HASH_SIZE = 32;
+
+class MerkleFileTree {
+public:
+    std::vector<uint8_t> root;         // "pieces root", empty for empty files
+    std::vector<uint8_t> piece_layer;  // one hash per piece, empty if file fits in one piece
+};
+
+class MerkleFileResult {
+public:
+    size_t file_index = 0;
+    bool ok = false;
+    std::vector<size_t> bad_pieces;    // piece indices relative to the file
+    std::string error;
+};
+
+// Smallest power of two >= blocks (1 for 0).
+size_t merkleNumLeaves(size_t blocks);
+
+// Root of a subtree of `leaves` all-zero leaves.
+std::vector<uint8_t> merklePadHash(size_t leaves);
+
+// Root of a layer of `layer.size()/32` hashes padded with `pad` up to `width`.
+std::vector<uint8_t> merkleRoot(const std::vector<uint8_t> &layer, size_t width,
+                                const std::vector<uint8_t> &pad);
+
+// SHA-256 of each 16 KiB block of data, concatenated.
+std::vector<uint8_t> merkleHashBlocks(const uint8_t *data, size_t len);
+
+// Build pieces root and piece layer for one file from its leaf hashes.
+MerkleFileTree merkleBuildFromLeaves(const std::vector<uint8_t> &leaves, int64_t piece_length);
+
+// Read a file from disk and build its tree.
+MerkleFileTree merkleBuildFile(const std::string &path, int64_t piece_length);
+
+// Uncle hashes from leaf `index` up to the root of the subtree `leaves` spans
+// (padded with zero leaves to a power of two). This is what a BEP 52 hash
+// request returns and what merkleVerifyBlock consumes.
+std::vector<uint8_t> merkleProof(const std::vector<uint8_t> &leaves, size_t width, size_t index);
+
+// Check a single 16 KiB block against a piece hash (or a file's pieces root)
+// using its proof, so one bad block can be rejected without the rest of the piece.
+bool merkleVerifyBlock(const uint8_t *block, size_t len, size_t index,
+                       const std::vector<uint8_t> &proof, const uint8_t *expected);
+
+// Check a whole piece of `len` bytes. `width` is the padded leaf count of the
+// subtree: blocks per piece for files with a piece layer, otherwise
+// merkleNumLeaves() of the file's block count.
+bool merkleVerifyPiece(const uint8_t *data, size_t len, size_t width, const uint8_t *expected);
+
+// Rebuild the tree of every v2 file under root_dir and compare it to the
+// torrent. Files are spread over `threads` workers (0 = hardware concurrency).
+std::vector<MerkleFileResult> verifyFilesV2(const TorrentMetadata &meta, const std::string &root_dir,
+                                            unsigned threads = 0);
@@ -0,0 +1,111 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Process-wide counters and latency histograms. Each thread writes only to
+// its own cache-line-aligned block, with plain relaxed loads and stores and
+// no locking, so recording costs a few nanoseconds plus the clock reads.
+// CollectMetrics() sums every block, including blocks of threads that have
+// exited.
+
+enum MetricCounter : uint8_t {
+    METRIC_BENCODE_BYTES,        // bytes validated or decoded to a tape
+    METRIC_SHA1_BYTES,
+    METRIC_SHA256_BYTES,
+    METRIC_PARSE_FILES,          // ParseTorrentData calls
+    METRIC_PARSE_ERRORS,
+    METRIC_IO_READ_BYTES,        // payload read from disk for piece checks
+    METRIC_PIECES_CHECKED,       // read back from disk and hashed
+    METRIC_PIECES_HASHED_ON_RECEIVE,   // checked from blocks hashed as they arrived
+    METRIC_PIECES_FAILED,        // either kind
+    METRIC_DAEMON_REQUESTS,
+    METRIC_DAEMON_ERRORS,
+    METRIC_COUNTER_COUNT
+};
+
+enum MetricHistogram : uint8_t {
+    METRIC_BENCODE_NS,           // one validate or tape build
+    METRIC_SHA1_NS,              // inputs of at least METRIC_HASH_TIMING_MIN bytes
+    METRIC_SHA256_NS,
+    METRIC_PARSE_READ_NS,        // ParseFile: open and map/read the file
+    METRIC_PARSE_SCAN_NS,        // stage-one validation of the whole file
+    METRIC_PARSE_EXTRACT_NS,     // streaming decode into TorrentMetadata
+    METRIC_PARSE_HASH_NS,        // info hash (SHA-1, and SHA-256 for v2)
+    METRIC_PARSE_TOTAL_NS,
+    METRIC_IO_READ_NS,           // reading one piece from disk
+    METRIC_PIECE_CHECK_NS,       // read + hash of one piece
+    METRIC_PIECE_FINISH_NS,      // completing a piece hashed as it arrived
+    METRIC_DAEMON_REQUEST_NS,
+    METRIC_HISTOGRAM_COUNT
+};
+
+// Hashes of small inputs (merkle node pairs are 64 bytes) would cost less
+// than the two clock reads, so they only count bytes.
+const size_t METRIC_HASH_TIMING_MIN = 4096;
+
+// Log-linear buckets in the style of HdrHistogram: 8 linear sub-buckets per
+// power of two, i.e. at most 12.5% relative error, covering all of uint64.
+const unsigned METRIC_SUB_BITS = 3;
+const size_t METRIC_BUCKETS = (64 - METRIC_SUB_BITS + 1) << METRIC_SUB_BITS;
+
+size_t metricBucket(uint64_t value);
+uint64_t metricBucketLow(size_t bucket);
+uint64_t metricBucketHigh(size_t bucket);
+
+void metricAdd(MetricCounter c, uint64_t n = 1);
+void metricRecord(MetricHistogram h, uint64_t value);
+
+inline uint64_t metricNow() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Records the time from construction to destruction (or stop()).
+class MetricTimer {
+public:
+    explicit MetricTimer(MetricHistogram h) : h_(h), start_(metricNow()) {}
+    ~MetricTimer() { stop(); }
+    uint64_t stop() {
+        if (done_) return 0;
+        done_ = true;
+        uint64_t ns = metricNow() - start_;
+        metricRecord(h_, ns);
+        return ns;
+    }
+
+private:
+    MetricHistogram h_;
+    uint64_t start_;
+    bool done_ = false;
+};
+
+class HistogramSnapshot {
+public:
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(METRIC_BUCKETS);
+
+    // Upper bound of the bucket holding quantile q (0..1), capped at max.
+    uint64_t percentile(double q) const;
+};
+
+class MetricsSnapshot {
+public:
+    uint64_t counters[METRIC_COUNTER_COUNT] = {};
+    HistogramSnapshot histograms[METRIC_HISTOGRAM_COUNT];
+};
+
+MetricsSnapshot CollectMetrics();
+const char *MetricCounterName(MetricCounter c);       // Prometheus name, e.g. "peerstorm_sha1_bytes_total"
+const char *MetricHistogramName(MetricHistogram h);   // e.g. "peerstorm_sha1_seconds"
+
+// Prometheus text exposition format (counters; histograms as summaries with
+// quantiles in seconds).
+std::string FormatMetricsPrometheus(const MetricsSnapshot &s);
+// Human-readable table for the stats command.
+std::string FormatMetricsTable(const MetricsSnapshot &s);
@@ -1,9 +1,12 @@
 #pragma once
 #include <cstdint>
+#include <map>
 #include <string>
 #include <vector>
 
 #include "magnet_parser.h"
+#include "file_table.h"
+#include "input_source.h"
 
 enum TorrentSourceType{
     TORRENT_FILE,
@@ -11,20 +14,14 @@ enum TorrentSourceType{
     UNKNOWN
 };
 
-class TorrentDataFile{
-public:
-    int64_t length;
-    std::vector<std::string> path;
-};
-
 class TorrentMetadata{
 public:
     std::string announce;
     std::vector<std::string> announce_list;
     std::string name;
-    int64_t piece_length;
+    int64_t piece_length = 0;
     std::vector<uint8_t> pieces;
-    std::vector<TorrentDataFile> files;
+    FileTable files;                       // paths, lengths, attributes and v2 roots / piece layers
     std::string download_directory;
     uint64_t total_size=0;
     size_t piece_count=0;
@@ -33,8 +30,22 @@ public:
     std::string created_by;
     std::string comment;
     std::vector<uint8_t> info_hash = std::vector<uint8_t>(20);
+    int meta_version = 1;                  // 2 for v2 and hybrid torrents
+    bool multi_file = false;               // files live under download_directory/name/
+    bool has_v1 = true;                    // false for pure v2 torrents (no "pieces")
+    std::vector<uint8_t> info_hash_v2;     // SHA-256 of the info dict, empty for v1
+    // Keys ParseFile does not know, with their raw bencoded values, for
+    // extensions (e.g. "private", "source", "url-list").
+    std::map<std::string, std::string> extra_fields;
+    std::map<std::string, std::string> extra_info_fields;
 };
 
 TorrentSourceType IdentifySourceType(std::string &input);
-TorrentMetadata ParseFile(std::string &path);
+TorrentMetadata ParseFile(std::string &path, InputMode mode = INPUT_AUTO);   // "-" reads stdin
+// Parse an in-memory .torrent. `data` only needs to live for the call.
+TorrentMetadata ParseTorrentData(const char *data, size_t size);
 MagnetData ParseMagnet(std::string &input);
+
+// Location of files[file_index] under root_dir, following the v1/v2 layout
+// rules (single-file torrents are stored as root_dir/name).
+std::string FilePathOnDisk(const TorrentMetadata &meta, size_t file_index, const std::string &root_dir);
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// BitTorrent peer wire protocol (BEP 3): the 68-byte handshake, then
+// messages framed as a 4-byte big-endian length, a 1-byte id and a payload.
+
+const uint32_t PEER_BLOCK_SIZE = 16 * 1024;
+const size_t PEER_HANDSHAKE_SIZE = 68;
+// Largest message accepted: a bitfield for 8M pieces, or a 128 KiB block
+const size_t PEER_MAX_MESSAGE = 1024 * 1024 + 1;
+
+enum PeerMessageId : int {
+    MSG_KEEP_ALIVE = -1,
+    MSG_CHOKE = 0,
+    MSG_UNCHOKE = 1,
+    MSG_INTERESTED = 2,
+    MSG_NOT_INTERESTED = 3,
+    MSG_HAVE = 4,
+    MSG_BITFIELD = 5,
+    MSG_REQUEST = 6,
+    MSG_PIECE = 7,
+    MSG_CANCEL = 8
+};
+
+class PeerMessage {
+public:
+    PeerMessageId id = MSG_KEEP_ALIVE;
+    uint32_t piece = 0;          // have, request, piece, cancel
+    uint32_t begin = 0;          // request, piece, cancel
+    uint32_t length = 0;         // request, cancel
+    std::string_view payload;    // bitfield bits or block data, pointing into the input buffer
+};
+
+std::string EncodeHandshake(const std::vector<uint8_t> &info_hash, const std::string &peer_id);
+// False until all 68 bytes are there. Throws runtime_error if it is not a
+// BitTorrent handshake.
+bool TakeHandshake(const std::string &buf, size_t &pos, std::vector<uint8_t> &info_hash, std::string &peer_id);
+
+void AppendMessage(std::string &out, PeerMessageId id);   // choke, unchoke, interested, not interested
+void AppendHave(std::string &out, uint32_t piece);
+void AppendBitfield(std::string &out, const std::vector<bool> &have);
+void AppendRequest(std::string &out, PeerMessageId id, uint32_t piece, uint32_t begin, uint32_t length);   // request or cancel
+void AppendPiece(std::string &out, uint32_t piece, uint32_t begin, const uint8_t *data, size_t len);
+
+// Parse the next complete message at pos. False if more bytes are needed;
+// throws runtime_error on an oversized or malformed message. Unknown ids
+// (extensions) are skipped.
+bool TakeMessage(const std::string &buf, size_t &pos, PeerMessage &msg);
+std::vector<bool> DecodeBitfield(std::string_view bits, size_t num_pieces);
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include "parser.h"
+#include "piece_store.h"
+#include "sha1.h"
+#include "storage.h"
+
+// Checks pieces while they download, so a finished piece never has to be
+// read back from disk just to hash it.
+//
+// v1 (and hybrid) pieces run an incremental SHA-1 that consumes blocks in
+// order. A block that arrives ahead of the hash position is copied aside
+// until the gap before it fills; the copies of all pieces share
+// `memory_budget` bytes. Past that, early blocks are only noted and read
+// back from the PieceStore when the hash position reaches them, which is the
+// only time this reads from disk. Pure v2 pieces need no ordering: each
+// 16 KiB block's leaf hash is taken on arrival and the piece's merkle root
+// is built when it completes.
+//
+// Blocks must be written to the store before they are added, and each block
+// added once (BlockScheduler already drops duplicates). Not thread-safe.
+
+const size_t PIECE_HASH_MEMORY_BUDGET = 16 * 1024 * 1024;
+
+class PieceHasher {
+public:
+    PieceHasher(const TorrentMetadata &meta, const FileStorage &storage, PieceStore &store,
+                size_t memory_budget = PIECE_HASH_MEMORY_BUDGET);
+
+    void addBlock(size_t piece, uint32_t begin, const uint8_t *data, size_t len);
+    // Check a piece once all its blocks are in. The piece's state is dropped
+    // either way; a failed piece starts over from its first block.
+    bool finish(size_t piece);
+    void discard(size_t piece);
+
+    size_t bufferedBytes() const { return buffered_; }
+    size_t peakBufferedBytes() const { return peak_buffered_; }
+    uint64_t diskReadBytes() const { return disk_read_; }
+
+private:
+    class PartialPiece {
+    public:
+        Sha1Context sha1;
+        uint32_t hashed = 0;                             // v1: bytes consumed in order
+        std::map<uint32_t, std::vector<uint8_t>> ahead;  // v1: copied early blocks by offset
+        std::map<uint32_t, uint32_t> on_disk;            // v1: early blocks left on disk, offset -> length
+        std::vector<uint8_t> leaves;                     // v2: SHA-256 of each 16 KiB block
+        uint64_t received = 0;
+        bool read_failed = false;
+    };
+
+    void advance(size_t piece, PartialPiece &pp);
+    bool finishV2(size_t piece, const PartialPiece &pp) const;
+
+    const TorrentMetadata &meta_;
+    const FileStorage &storage_;
+    PieceStore &store_;
+    size_t budget_;
+    std::unordered_map<size_t, PartialPiece> pieces_;
+    size_t buffered_ = 0;
+    size_t peak_buffered_ = 0;
+    uint64_t disk_read_ = 0;
+    std::vector<uint8_t> scratch_;
+};
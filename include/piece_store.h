@@ -0,0 +1,112 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "parser.h"
+#include "storage.h"
+
+// Per-file download priority. Piece priorities use the same scale: a piece
+// gets the highest priority of the files it touches, and 0 means the piece is
+// not downloaded at all.
+enum FilePriority : uint8_t {
+    PRIORITY_SKIP = 0,
+    PRIORITY_LOW = 1,
+    PRIORITY_NORMAL = 4,
+    PRIORITY_HIGH = 7
+};
+
+// Parse "skip", "low", "normal" or "high"; throws runtime_error otherwise.
+FilePriority ParseFilePriority(const std::string &name);
+const char *FilePriorityName(uint8_t priority);
+
+// One priority per piece. Pad files never raise a piece's priority.
+std::vector<uint8_t> PiecePriorities(const TorrentMetadata &meta, const FileStorage &storage,
+                                     const std::vector<uint8_t> &file_priorities);
+
+// Stores the bytes of skipped files that share a wanted ("edge") piece, so
+// the piece can be hash-checked without creating the skipped file.
+//
+// Layout: a header ("PSPF", version, piece length, piece count, then one
+// little-endian uint32 slot number per piece, 0xFFFFFFFF for none), padded to
+// 4 KiB, followed by piece-sized slots. A slot holds the piece at its natural
+// offsets; only the skipped files' ranges are ever written, so the rest stays
+// sparse. The file is created on first write.
+class PartFile {
+public:
+    static constexpr uint32_t NO_SLOT = 0xFFFFFFFFu;
+
+    // Loads an existing part file; throws if it belongs to a different layout.
+    PartFile(std::string path, int64_t piece_length, size_t num_pieces);
+
+    bool hasPiece(size_t piece) const { return slots_[piece] != NO_SLOT; }
+    void write(size_t piece, int64_t offset, const uint8_t *data, size_t len);
+    bool read(size_t piece, int64_t offset, uint8_t *data, size_t len);
+    // Forget a piece once no skipped file needs it; its slot is reused.
+    void release(size_t piece);
+
+    size_t usedSlots() const { return used_; }
+    const std::string &path() const { return path_; }
+
+private:
+    uint64_t headerSize() const;
+    void open();
+    void writeSlotEntry(size_t piece);
+
+    std::string path_;
+    int64_t piece_length_;
+    std::vector<uint32_t> slots_;   // piece -> slot
+    std::vector<uint32_t> free_;    // released slots
+    uint32_t next_slot_ = 0;
+    size_t used_ = 0;
+    std::fstream file_;
+};
+
+// Reads and writes whole pieces under root_dir honouring file priorities.
+// Wanted files are created (sparse) on first write; skipped files are never
+// created. Bytes of skipped files inside edge pieces go to the part file
+// "<root_dir>/.<info hash hex>.parts". Throws runtime_error on construction if
+// a file path would leave root_dir. Not thread-safe.
+class PieceStore {
+public:
+    PieceStore(const TorrentMetadata &meta, const FileStorage &storage, std::string root_dir);
+
+    // One entry per file (missing entries count as normal). Data parked in
+    // the part file for files that become wanted is moved into place.
+    void setFilePriorities(const std::vector<uint8_t> &priorities);
+    const std::vector<uint8_t> &filePriorities() const { return file_prio_; }
+    const std::vector<uint8_t> &piecePriorities() const { return piece_prio_; }
+    bool wanted(size_t piece) const { return piece_prio_[piece] != PRIORITY_SKIP; }
+    // Wanted pieces that also hold bytes of skipped files
+    bool isEdgePiece(size_t piece) const;
+
+    void writePiece(size_t piece, const uint8_t *data, size_t len);
+    bool readPiece(size_t piece, std::vector<uint8_t> &buf);
+    // Part of a piece, `offset` bytes into it
+    void writeBlock(size_t piece, int64_t offset, const uint8_t *data, size_t len);
+    bool readBlock(size_t piece, int64_t offset, uint8_t *data, size_t len);
+    bool checkPiece(size_t piece);
+
+    const std::string &rootDir() const { return root_dir_; }
+    const std::string &filePath(size_t file_index) const { return paths_[file_index]; }   // checked to stay under rootDir()
+
+    uint64_t wantedFileBytes() const;
+    uint64_t wantedPieceBytes() const;
+    size_t edgePieces() const;
+    const PartFile &partFile() const { return part_; }
+
+private:
+    bool skipped(size_t file_index) const;
+    void writeFileRange(size_t file_index, int64_t offset, const uint8_t *data, size_t len);
+    bool readFileRange(size_t file_index, int64_t offset, uint8_t *data, size_t len) const;
+
+    const TorrentMetadata &meta_;
+    const FileStorage &storage_;
+    std::string root_dir_;
+    std::vector<std::string> paths_;   // FilePathOnDisk of every file
+    std::vector<uint8_t> file_prio_;
+    std::vector<uint8_t> piece_prio_;
+    PartFile part_;
+};
@@ -0,0 +1,99 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "parser.h"
+#include "storage.h"
+
+class ResumeFileInfo {
+public:
+    int64_t size = -1;       // -1: file did not exist when the resume data was saved
+    int64_t mtime = 0;       // filesystem clock ticks, only compared for equality
+};
+
+// Fast-resume state of one torrent, stored as a bencoded dictionary
+class ResumeData {
+public:
+    std::vector<uint8_t> info_hash;                        // 20 bytes
+    std::string save_path;
+    std::vector<uint8_t> have;                             // verified pieces, MSB first like BITFIELD
+    std::vector<ResumeFileInfo> files;                     // parallel to TorrentMetadata::files
+    std::map<uint32_t, std::vector<uint8_t>> unfinished;   // piece -> bitfield of downloaded 16 KiB blocks
+    std::vector<uint8_t> file_priorities;                  // FilePriority per file; empty = all normal
+
+    bool hasPiece(size_t piece) const;
+    void setPiece(size_t piece, bool value);
+};
+
+std::string EncodeResume(const ResumeData &rd);
+ResumeData DecodeResume(const std::string &data);
+
+// Write to <path>.tmp, flush to disk and rename over <path>, so a crash
+// leaves either the old or the new file, never a torn one.
+void WriteResumeFile(const std::string &path, const ResumeData &rd);
+bool LoadResumeFile(const std::string &path, ResumeData &rd);
+
+// Record the current size and mtime of every file under root_dir.
+std::vector<ResumeFileInfo> SnapshotFiles(const TorrentMetadata &meta, const std::string &root_dir);
+
+// Compare resume data against the filesystem using only stat() calls. Pieces
+// touching files whose size or mtime changed lose their have bit and
+// unfinished block map and are returned for rechecking; everything else is
+// trusted. Resume data for a different torrent is reset and every piece is
+// returned; so is every piece when the data holds no file snapshot yet (only
+// priorities, see SaveFilePriorities).
+std::vector<size_t> ValidateResume(const TorrentMetadata &meta, const FileStorage &storage,
+                                   const std::string &root_dir, ResumeData &rd);
+
+// Collects resume data updates and writes them in batches from a background
+// thread every `interval`, instead of one write per state change. Pending
+// updates are flushed on destruction.
+class ResumeWriter {
+public:
+    ResumeWriter(const std::string &dir, std::chrono::milliseconds interval);
+    ~ResumeWriter();
+
+    void update(const ResumeData &rd);   // replaces any pending update for the same torrent
+    void flush();                        // write everything pending now
+    std::string pathFor(const std::vector<uint8_t> &info_hash) const;
+
+private:
+    void run();
+
+    std::string dir_;
+    std::chrono::milliseconds interval_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::map<std::string, ResumeData> pending_;   // keyed by hex info-hash
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+class VerifySummary {
+public:
+    bool loaded = false;      // resume data existed for this torrent
+    size_t rechecked = 0;     // pieces read back from disk
+    size_t have = 0;
+    size_t pieces = 0;
+    size_t wanted = 0;        // pieces not skipped by the saved file priorities
+    size_t wanted_have = 0;
+};
+
+// Record per-file priorities (FilePriority values) in the torrent's resume
+// data, keeping the rest of it, and queue the update with `writer`.
+void SaveFilePriorities(const TorrentMetadata &meta, const std::vector<uint8_t> &priorities, ResumeWriter &writer);
+
+// Load the torrent's resume data, recheck only the pieces it cannot vouch
+// for and queue the updated state with `writer`.
+VerifySummary VerifyWithResume(const TorrentMetadata &meta, const FileStorage &storage,
+                               const std::string &save_path, ResumeWriter &writer);
+// Same, for a caller that keeps the resume data in memory between checks.
+// `rd` is updated in place; `loaded` reports whether it was non-empty.
+VerifySummary VerifyWithResume(const TorrentMetadata &meta, const FileStorage &storage,
+                               const std::string &save_path, ResumeData &rd, ResumeWriter &writer);
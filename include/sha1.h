@@ -1,8 +1,30 @@
 #pragma once
 #include <array>
+#include <cstddef>
 #include <cstdint>
 #include <string>
 #include <vector>
 
 std::vector<std::uint8_t> sha1(const std::string &data);
-std::vector<std::uint8_t> sha1_bytes(const std::vector<std::uint8_t> &data);
\ No newline at end of file
+std::vector<std::uint8_t> sha1_bytes(const std::vector<std::uint8_t> &data);
+
+// Hash `len` bytes at `data` into the 20-byte buffer `out` without copying the input.
+void sha1_raw(const std::uint8_t *data, std::size_t len, std::uint8_t *out);
+
+// Incremental SHA-1 for data that arrives in parts (e.g. blocks of a piece).
+// Feeding the same bytes in any split gives the same digest as sha1_raw.
+class Sha1Context {
+public:
+    Sha1Context() { reset(); }
+
+    void reset();
+    void update(const std::uint8_t *data, std::size_t len);
+    // Write the 20-byte digest. The context must be reset before reuse.
+    void finish(std::uint8_t *out);
+    std::uint64_t size() const { return len_; }
+
+private:
+    std::uint32_t h_[5];
+    std::uint8_t buf_[64];   // partial 64-byte chunk
+    std::uint64_t len_ = 0;
+};
@@ -0,0 +1,13 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+std::vector<std::uint8_t> sha256(const std::string &data);
+std::vector<std::uint8_t> sha256_bytes(const std::vector<std::uint8_t> &data);
+
+// Hash `len` bytes at `data` into the 32-byte buffer `out` without allocating.
+// Used by the merkle code, which hashes millions of 16 KiB blocks and 64-byte
+// node pairs. Dispatches to the SHA-NI instructions when the CPU has them.
+void sha256_raw(const std::uint8_t *data, std::size_t len, std::uint8_t *out);
@@ -0,0 +1,54 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "parser.h"
+
+// Part of a piece that lives in one file
+class FileSlice {
+public:
+    size_t file_index = 0;
+    int64_t offset = 0;      // offset inside the file
+    int64_t length = 0;
+};
+
+// Maps pieces onto files. v1 and hybrid torrents concatenate files (pad
+// files included); pure v2 torrents start every file on a piece boundary,
+// so they are laid out the same way with implicit padding.
+class FileStorage {
+public:
+    explicit FileStorage(const TorrentMetadata &meta);
+
+    size_t numPieces() const { return num_pieces_; }
+    int64_t pieceSize(size_t piece) const;
+    std::vector<FileSlice> mapPiece(size_t piece) const;
+
+    // First and one-past-last piece touching a file (equal for empty files)
+    std::pair<size_t, size_t> filePieceRange(size_t file_index) const;
+    uint64_t fileOffset(size_t file_index) const { return offsets_[file_index]; }
+    const TorrentMetadata &metadata() const { return meta_; }
+
+private:
+    const TorrentMetadata &meta_;
+    std::vector<uint64_t> offsets_;  // start of each file in piece space
+    uint64_t end_ = 0;
+    size_t num_pieces_ = 0;
+};
+
+// Check piece data already in memory against the torrent's hashes.
+bool PieceMatches(const TorrentMetadata &meta, const FileStorage &storage, size_t piece, const uint8_t *data,
+                  size_t len);
+
+// Read a piece from disk under root_dir and check it against the torrent:
+// SHA-1 from `pieces` when the torrent has v1 data, merkle hashes otherwise.
+// Pad files read as zeros. Missing or short files fail the check.
+bool CheckPiece(const TorrentMetadata &meta, const FileStorage &storage, const std::string &root_dir,
+                size_t piece);
+
+// Check a list of pieces on `threads` workers (0 = hardware concurrency).
+// Returns one flag per entry of `pieces`.
+std::vector<bool> CheckPieces(const TorrentMetadata &meta, const FileStorage &storage,
+                              const std::string &root_dir, const std::vector<size_t> &pieces,
+                              unsigned threads = 0);
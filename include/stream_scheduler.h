@@ -0,0 +1,150 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "storage.h"
+
+// Deadline-driven piece scheduling for streaming one file while it
+// downloads. The consumer's read position and bitrate give every piece ahead
+// of it a deadline; pieces inside a read-ahead window go, in deadline order,
+// to whichever peer is expected to finish them first, so the fastest peers
+// carry the urgent pieces and slower peers work further ahead. A request
+// that will miss its deadline (or is already overdue) is sent to a second
+// peer once; whichever copy arrives first wins and the other is cancelled.
+//
+// Requests are for whole pieces. Time is in seconds on any monotonic clock.
+
+// Read-ahead window: this many seconds of download at the observed
+// throughput (or of playback, if that is more), clamped to the limits below.
+const double STREAM_READAHEAD_SECONDS = 8.0;
+const size_t STREAM_MIN_WINDOW = 4;
+const size_t STREAM_MAX_WINDOW = 256;
+// Requests queued on one peer at a time
+const size_t STREAM_MAX_PEER_QUEUE = 4;
+// Rate assumed for a peer that has not delivered anything yet (bytes/s)
+const double STREAM_UNKNOWN_PEER_RATE = 64 * 1024;
+
+class StreamPeer {
+public:
+    const std::vector<bool> *have = nullptr;   // nullptr: has every piece
+    double rate = 0;          // measured bytes/s, 0 until the first piece arrives
+    double busy_until = 0;    // expected time its queued requests are done
+    double last_done = 0;
+    size_t queued = 0;
+    bool connected = true;
+
+    bool hasPiece(size_t piece) const { return !have || (*have)[piece]; }
+    double estimatedRate() const { return rate > 0 ? rate : STREAM_UNKNOWN_PEER_RATE; }
+};
+
+class StreamRequest {
+public:
+    size_t piece = 0;
+    size_t peer = 0;
+    bool duplicate = false;   // second request for a late piece
+};
+
+class StreamScheduler {
+public:
+    // bitrate: bytes per second the consumer reads. piece_priorities (from
+    // PiecePriorities) marks pieces to skip; empty wants everything.
+    StreamScheduler(const FileStorage &storage, size_t file_index, double bitrate,
+                    std::vector<uint8_t> piece_priorities = {});
+
+    size_t addPeer(const std::vector<bool> *have = nullptr);
+    // Drops the peer's outstanding requests; they are rescheduled.
+    void removePeer(size_t peer);
+    const StreamPeer &peer(size_t i) const { return peers_[i]; }
+
+    // Offset inside the streamed file the consumer reads next.
+    void setReadPosition(uint64_t file_offset);
+    uint64_t readPosition() const { return read_pos_; }
+
+    // Returns the other peers that were asked for the same piece; the caller
+    // should cancel those requests.
+    std::vector<size_t> pieceReceived(size_t piece, size_t peer, double now);
+    // Hash failure, reject or choke: the piece goes back to the pool.
+    void requestFailed(size_t piece, size_t peer, double now);
+    // Pieces already on disk (e.g. from resume data)
+    void markHave(size_t piece) { have_[piece] = true; }
+
+    // New requests to send; call whenever something changed or on a timer.
+    std::vector<StreamRequest> schedule(double now);
+
+    bool havePiece(size_t piece) const { return have_[piece]; }
+    // Deadline relative to now: seconds of playback before the consumer
+    // reaches the piece (0 for pieces at or behind the read position).
+    double timeToDeadline(size_t piece) const;
+    size_t windowPieces() const;
+    double throughput() const { return throughput_; }
+    // Bytes of the file readable from the read position without a gap
+    uint64_t bufferedBytes() const;
+    size_t duplicatesSent() const { return duplicates_; }
+
+private:
+    class Outstanding {
+    public:
+        size_t piece;
+        size_t peer;
+        double issued;
+        double expected;   // estimated arrival
+        bool duplicated;   // a second copy was requested
+    };
+
+    size_t pieceAt(uint64_t file_offset) const;
+    bool needed(size_t piece) const { return !have_[piece] && (prio_.empty() || prio_[piece] != 0); }
+    bool requested(size_t piece) const;
+    double pieceBytes(size_t piece) const;
+    void refreshPeer(size_t peer, double now);
+    StreamRequest assign(size_t piece, size_t peer, bool duplicate, double now);
+    // Peer with the earliest expected finish for `piece`, or SIZE_MAX
+    size_t bestPeer(size_t piece, double now, size_t exclude, double &finish) const;
+
+    const FileStorage &storage_;
+    size_t file_index_;
+    double bitrate_;
+    std::vector<uint8_t> prio_;
+    size_t first_piece_, end_piece_;
+    uint64_t file_start_;           // file offset in piece space
+    uint64_t file_length_;
+    uint64_t read_pos_ = 0;
+
+    std::vector<bool> have_;
+    std::vector<StreamPeer> peers_;
+    std::vector<Outstanding> outstanding_;
+    double throughput_ = 0;         // bytes/s, exponentially decayed
+    double last_sample_ = 0;
+    size_t duplicates_ = 0;
+};
+
+// ------------------------------
+// Simulated playback
+// ------------------------------
+class StreamSimOptions {
+public:
+    double bitrate = 1 << 20;              // bytes/s
+    std::vector<double> peer_rates = {4 << 20, 2 << 20, 1 << 20, 1 << 20, 512 << 10, 256 << 10, 128 << 10, 64 << 10};
+    double latency = 0.05;                 // seconds per request
+    double availability = 1.0;             // fraction of pieces each non-first peer has
+    double rate_jitter = 0.3;              // each peer's rate varies by up to +-30% per second
+    double stall_at = 5.0;                 // the fastest peer drops to 2% of its rate then (<0: never)
+    double startup_seconds = 2.0;          // playback starts once this much is buffered
+    bool deadline = true;                  // false: plain in-order requests, no window or duplicates
+    unsigned seed = 1;
+};
+
+class StreamSimResult {
+public:
+    double startup_delay = 0;
+    size_t stalls = 0;
+    double stall_seconds = 0;
+    double finish_time = 0;                // playback reached the end of the file
+    uint64_t downloaded_bytes = 0;
+    uint64_t wasted_bytes = 0;             // duplicate or cancelled transfers
+    size_t duplicate_requests = 0;
+};
+
+// Plays file_index of the torrent against simulated peers in 5 ms steps.
+StreamSimResult SimulateStreaming(const FileStorage &storage, size_t file_index, const StreamSimOptions &opts);
@@ -0,0 +1,133 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block_scheduler.h"
+#include "dedup_index.h"
+#include "parser.h"
+#include "piece_hasher.h"
+#include "storage.h"
+
+// In-process swarm on 127.0.0.1: seeders serving a complete copy of the
+// torrent and leechers downloading it with BlockScheduler, all speaking the
+// peer wire protocol over real TCP sockets in one poll() loop. Every node
+// listens on its own port and finds the others through a tracker; leechers
+// upload the pieces they have to each other.
+//
+// Links are shaped in the sender: every message waits for the node's uplink
+// (`bandwidth` bytes/s, shared by all its connections) and then `latency`
+// seconds before it is written to the socket, so a request round trip costs
+// 2 * latency plus serialization. Loss is modelled the way TCP turns it into
+// delay: each lost 1460-byte segment is sent again and arrives a round trip
+// later, holding back everything behind it on that connection (congestion
+// window cuts are not modelled). Seeders only turn a queued request into
+// block data when their uplink is free, so a cancel still catches requests
+// that have not been served. Leechers write blocks to disk as they arrive
+// and check pieces with PieceHasher.
+//
+// Random choices (loss, piece picking) are seeded, so runs differ only by
+// scheduling noise.
+
+// Stand-in HTTP tracker on 127.0.0.1 (BEP 3 announces, compact peer lists
+// as in BEP 23), answering from its own thread. Peers never expire; seeds
+// are not sent to other seeds. Throws runtime_error if it cannot listen
+// (and on Windows).
+class LoopbackTracker {
+public:
+    LoopbackTracker();
+    ~LoopbackTracker();
+    LoopbackTracker(const LoopbackTracker &) = delete;
+    LoopbackTracker &operator=(const LoopbackTracker &) = delete;
+
+    uint16_t port() const { return port_; }
+    std::string announceUrl() const;
+    size_t announces() const { return announces_; }
+
+private:
+    class Peer {
+    public:
+        std::string peer_id;
+        uint16_t port = 0;
+        bool seed = false;
+    };
+
+    void run();
+    std::string handle(const std::string &request);
+
+    int listen_fd_ = -1;
+    int wake_[2] = {-1, -1};
+    uint16_t port_ = 0;
+    std::map<std::string, std::vector<Peer>> swarms_;   // by info hash; tracker thread only
+    std::atomic<size_t> announces_{0};
+    std::thread thread_;
+};
+
+class SwarmOptions {
+public:
+    size_t seeders = 3;
+    size_t leechers = 1;
+    double latency = 0.05;            // one-way seconds
+    double bandwidth = 4 << 20;       // upload bytes/s per node; 0 = unlimited
+    double loss = 0;                  // fraction of TCP segments lost
+    unsigned seed = 1;                // loss; leecher i picks pieces with scheduler.seed + i
+    size_t stalled_seeders = 0;       // this many seeders stop sending at stall_at
+    double stall_at = 2.0;
+    double timeout = 600;             // give up after this many seconds
+    size_t hash_memory = PIECE_HASH_MEMORY_BUDGET;   // per leecher, for out-of-order blocks
+    const DedupIndex *dedup = nullptr;  // leechers first fill what they can from local copies
+    bool resume = false;              // leechers keep fast-resume data in their directory (see RunLoopbackSwarm)
+    LoopbackTracker *tracker = nullptr; // announce here; null: the swarm runs its own
+    BlockSchedulerOptions scheduler;
+};
+
+class SwarmPeerStats {
+public:
+    size_t node = 0;                  // remote node; seeders come first
+    uint64_t bytes = 0;               // useful block bytes received from it
+    double rate = 0;
+    double rtt = 0;
+    size_t depth = 0;                 // queue depth at the end
+    size_t max_depth = 0;
+    bool snubbed = false;
+};
+
+class SwarmLeecherStats {
+public:
+    double seconds = 0;               // until every wanted piece was verified (or timeout)
+    bool complete = false;
+    uint64_t bytes = 0;               // block payload received, duplicates included
+    uint64_t wasted_bytes = 0;        // duplicate or unrequested blocks
+    size_t hash_failures = 0;
+    size_t reassigned = 0;
+    size_t endgame_requests = 0;
+    size_t cancels = 0;
+    size_t local_pieces = 0;          // verified from local copies found in the dedup index
+    size_t resumed_pieces = 0;        // verified pieces taken over from fast-resume data
+    size_t resumed_blocks = 0;        // blocks of unfinished pieces taken over from it
+    uint64_t read_back_bytes = 0;     // re-read from disk to finish hashing a piece
+    size_t peak_hash_buffer = 0;      // out-of-order bytes held for hashing
+    std::vector<SwarmPeerStats> peers;
+};
+
+class SwarmResult {
+public:
+    double seconds = 0;               // until the last leecher finished
+    uint64_t bytes = 0;               // useful bytes delivered to all leechers
+    double cpu_seconds = 0;           // user + system time of the whole process during the run
+    uint64_t max_rss_bytes = 0;       // process memory high-water mark so far
+    std::vector<SwarmLeecherStats> leechers;
+};
+
+// Seeders read from seed_dir; leecher i writes to out_dir/leecher-<i>. Nodes
+// join in order, seeders first, each connecting to the peers the tracker
+// returns. With `resume`, a leecher starts from the resume file
+// ".<info hash hex>.resume" in its directory (verified pieces and the blocks
+// of unfinished ones) and rewrites it when the run ends, finished or not.
+// Throws runtime_error if sockets cannot be set up (and on Windows).
+SwarmResult RunLoopbackSwarm(const TorrentMetadata &meta, const FileStorage &storage, const std::string &seed_dir,
+                             const std::string &out_dir, const SwarmOptions &opts);
@@ -0,0 +1,132 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "parser.h"
+#include "magnet_parser.h"
+
+// Fixed-size 20-byte info-hash, stored inline (no heap allocation)
+class InfoHash {
+public:
+    std::array<uint8_t, 20> bytes{};
+
+    InfoHash() = default;
+    explicit InfoHash(const uint8_t *p);
+    explicit InfoHash(const std::vector<uint8_t> &v);   // throws unless v has >= 20 bytes
+
+    bool operator==(const InfoHash &o) const { return bytes == o.bytes; }
+    bool operator!=(const InfoHash &o) const { return bytes != o.bytes; }
+};
+
+void *hugePageAlloc(size_t bytes);
+void hugePageFree(void *p, size_t bytes);
+
+// Allocator for the index arrays. Large tables are 2 MiB aligned and, on
+// Linux, marked for transparent huge pages: random probes into a table of
+// several hundred MB otherwise spend most of their time on TLB misses.
+template <typename T>
+class HugePageAllocator {
+public:
+    using value_type = T;
+
+    HugePageAllocator() = default;
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U> &) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(hugePageAlloc(n * sizeof(T))); }
+    void deallocate(T *p, size_t n) { hugePageFree(p, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const HugePageAllocator<U> &) const { return true; }
+    template <typename U>
+    bool operator!=(const HugePageAllocator<U> &) const { return false; }
+};
+
+using TorrentHandle = uint32_t;
+constexpr TorrentHandle INVALID_TORRENT_HANDLE = 0xFFFFFFFFu;
+
+// Open-addressing InfoHash -> uint32 map in the SwissTable layout: one control
+// byte per slot holding 7 bits of the hash, probed 16 at a time with SSE2,
+// and 24-byte slots holding the key inline. Capacity is a power of two and
+// the table grows at 7/8 load, so memory is capacity * 25 bytes. Keys prefer
+// one of two hash-chosen slots in their group, which lookups fetch in
+// parallel with the control bytes, so a hit on a table far larger than the
+// cache usually costs one memory round trip rather than two.
+class InfoHashIndex {
+public:
+    InfoHashIndex();
+
+    // Insert or return the existing value. `inserted` reports which.
+    uint32_t insert(const InfoHash &key, uint32_t value, bool *inserted = nullptr);
+    uint32_t find(const InfoHash &key) const;   // INVALID_TORRENT_HANDLE when absent
+    // Look up n keys at once, overlapping their memory accesses; for tracker
+    // and DHT replies or feed imports that carry many hashes.
+    void find(const InfoHash *keys, size_t n, uint32_t *out) const;
+    bool erase(const InfoHash &key);
+
+    void reserve(size_t n);
+    size_t size() const { return size_; }
+    size_t capacity() const { return ctrl_.size(); }
+    size_t memoryUsage() const { return ctrl_.size() + slots_.size() * sizeof(Slot); }
+
+private:
+    struct Slot {
+        uint8_t key[20];
+        uint32_t value;
+    };
+
+    uint64_t hashKey(const InfoHash &key) const;
+    size_t findSlot(const InfoHash &key, uint64_t h) const;   // capacity() when absent
+    size_t probeStart(uint64_t h) const;
+    void rehash(size_t new_capacity);
+
+    std::vector<int8_t, HugePageAllocator<int8_t>> ctrl_;
+    std::vector<Slot, HugePageAllocator<Slot>> slots_;
+    size_t size_ = 0;
+    size_t tombstones_ = 0;
+    uint64_t seed_;
+};
+
+// A torrent known to the session, from a .torrent file, a magnet link or both
+class TorrentEntry {
+public:
+    InfoHash info_hash;                         // v1 hash, or truncated v2 hash for pure v2
+    std::unique_ptr<TorrentMetadata> meta;      // null until the metadata is known
+    std::unique_ptr<MagnetData> magnet;         // null if never added by magnet link
+    bool in_use = false;
+};
+
+// Session-wide torrent table. Handles are indices into a stable arena and
+// stay valid until the torrent is removed. Hybrid torrents are reachable by
+// both their v1 hash and their truncated v2 hash.
+class TorrentRegistry {
+public:
+    // Adding a torrent whose hash is already present merges into that entry,
+    // so a magnet link and its .torrent end up on the same handle. If a
+    // hybrid's v1 and v2 hashes were added as two separate entries, the v2
+    // one is folded into the v1 one and its handle, now invalid, is stored
+    // in `released`.
+    TorrentHandle addTorrent(TorrentMetadata meta, TorrentHandle *released = nullptr);
+    TorrentHandle addMagnet(MagnetData magnet);
+
+    TorrentHandle find(const InfoHash &hash) const { return index_.find(hash); }
+    TorrentEntry *get(TorrentHandle h);
+    const TorrentEntry *get(TorrentHandle h) const;
+    bool remove(TorrentHandle h);
+
+    void reserve(size_t n) { index_.reserve(n); }
+    size_t size() const { return entries_.size() - free_.size(); }
+    const InfoHashIndex &index() const { return index_; }
+
+private:
+    TorrentHandle allocate(const InfoHash &hash);
+    static void mergeMagnet(TorrentEntry &e, MagnetData magnet);
+
+    InfoHashIndex index_;
+    std::deque<TorrentEntry> entries_;
+    std::vector<TorrentHandle> free_;
+};
@@ -5,6 +5,24 @@
 #include "include/bencode.h"
 #include "include/sha1.h"
 #include "include/magnet_parser.h"
+#include "include/creator.h"
+#include "include/storage.h"
+#include "include/resume.h"
+#include "include/daemon.h"
+#include "include/metrics.h"
+#include "include/piece_store.h"
+#include "include/stream_scheduler.h"
+#include "include/swarm.h"
+#include "include/dedup_index.h"
+#include "include/magnet_batch.h"
+#include "include/torrent_index.h"
+#include <chrono>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
 using namespace std;
 
 void printTorrentMetadata(const TorrentMetadata& meta) {
@@ -28,32 +46,909 @@ void printTorrentMetadata(const TorrentMetadata& meta) {
 
     if (!meta.files.empty()) {
         cout << "Files:" << endl;
-        for (auto &f : meta.files) {
+        for (size_t i = 0; i < meta.files.size(); ++i) {
             cout << "  - Path: ";
-            for (auto &p : f.path) cout << p << "/";
-            cout << " | Size: " << f.length << " bytes" << endl;
+            for (auto &p : meta.files.path(i)) cout << p << "/";
+            cout << " | Size: " << meta.files.length(i) << " bytes" << endl;
         }
+        size_t table_bytes = meta.files.memoryUsage();
+        cout << "File table memory: " << table_bytes << " bytes ("
+             << table_bytes / meta.files.size() << " bytes/file)" << endl;
     }
 
-    cout << "Info hash (SHA1): ";
+    cout << "Meta version: " << meta.meta_version << endl;
+    cout << (meta.has_v1 ? "Info hash (SHA1): " : "Info hash (truncated SHA256): ");
     for (auto byte : meta.info_hash)
         printf("%02x", byte);
     cout << endl;
+
+    if (!meta.info_hash_v2.empty()) {
+        cout << "Info hash v2 (SHA256): ";
+        for (auto byte : meta.info_hash_v2)
+            printf("%02x", byte);
+        cout << endl;
+    }
 }
 void printMagnetdata(const MagnetData& magdata ){
     cout<<"info hash hex"<<magdata.info_hash_hex<<endl;
     cout<<"trackers:"<<magdata.trackers.size()<<endl;
     cout<<"web seeds:"<<magdata.web_seeds.size()<<endl;
 }
+// create <path> [--piece-length N] [--v2] [--announce URL] [--comment C] [--threads N] [-o out.torrent]
+int runCreate(int argc, char* argv[]) {
+    string path = argv[2];
+    string out;
+    CreateOptions opts;
+
+    for (int i = 3; i < argc; ++i) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--piece-length" && has_value) opts.piece_length = stoll(argv[++i]);
+        else if (arg == "--announce" && has_value) opts.announce = argv[++i];
+        else if (arg == "--comment" && has_value) opts.comment = argv[++i];
+        else if (arg == "--threads" && has_value) opts.threads = static_cast<unsigned>(stoul(argv[++i]));
+        else if (arg == "-o" && has_value) out = argv[++i];
+        else if (arg == "--v2") opts.v2 = true;
+        else {
+            cerr << "Unknown create option: " << arg << endl;
+            return 1;
+        }
+    }
+
+    try {
+        string torrent = CreateTorrent(path, opts);
+        if (out.empty()) {
+            string base = path;
+            while (base.size() > 1 && (base.back() == '/' || base.back() == '\\')) base.pop_back();
+            out = base + ".torrent";
+        }
+        ofstream f(out, ios::binary);
+        if (!f.write(torrent.data(), static_cast<streamsize>(torrent.size())))
+            throw runtime_error("Cannot write " + out);
+        cout << "Created " << out << endl;
+    } catch (const exception& e) {
+        cerr << "create failed: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// "0,4,10-12" -> file indices
+static vector<size_t> parseIndexList(const string& spec, size_t limit) {
+    vector<size_t> out;
+    size_t pos = 0;
+    while (pos < spec.size()) {
+        size_t comma = spec.find(',', pos);
+        string item = spec.substr(pos, comma == string::npos ? string::npos : comma - pos);
+        size_t dash = item.find('-');
+        size_t first = stoul(item.substr(0, dash));
+        size_t last = dash == string::npos ? first : stoul(item.substr(dash + 1));
+        if (last < first || last >= limit) throw runtime_error("file index out of range: " + item);
+        for (size_t i = first; i <= last; ++i) out.push_back(i);
+        if (comma == string::npos) break;
+        pos = comma + 1;
+    }
+    return out;
+}
+
+// select <torrent> <files> [--priority P] [--from DIR --to DIR] [--resume-dir D]
+// Skips every file not listed and reports what that saves. With --from and
+// --to, copies the wanted pieces out of a complete copy the way a download
+// would write them, then checks them. With --resume-dir, the priorities are
+// saved in the torrent's resume data for verify and the daemon.
+int runSelect(int argc, char* argv[]) {
+    if (argc < 4) {
+        cerr << "Usage: " << argv[0] << " select <torrent> <files, e.g. 0,4,10-12> [--priority P]"
+             << " [--from DIR --to DIR] [--resume-dir D]" << endl;
+        return 1;
+    }
+    string torrent = argv[2];
+    string from, to, resume_dir;
+    FilePriority priority = PRIORITY_NORMAL;
+
+    try {
+        for (int i = 4; i + 1 < argc; i += 2) {
+            string arg = argv[i];
+            if (arg == "--priority") priority = ParseFilePriority(argv[i + 1]);
+            else if (arg == "--from") from = argv[i + 1];
+            else if (arg == "--to") to = argv[i + 1];
+            else if (arg == "--resume-dir") resume_dir = argv[i + 1];
+            else throw runtime_error("unknown option " + arg);
+        }
+
+        TorrentMetadata meta = ParseFile(torrent);
+        FileStorage storage(meta);
+        vector<uint8_t> prios(meta.files.size(), PRIORITY_SKIP);
+        for (size_t i : parseIndexList(argv[3], meta.files.size())) prios[i] = priority;
+
+        PieceStore store(meta, storage, to.empty() ? string(".") : to);
+        store.setFilePriorities(prios);
+        size_t wanted = 0;
+        for (size_t p = 0; p < storage.numPieces(); ++p) wanted += store.wanted(p);
+        size_t edges = store.edgePieces();
+
+        cout << "Selected bytes: " << store.wantedFileBytes() << " of " << meta.total_size << endl;
+        cout << "Pieces to download: " << wanted << " of " << storage.numPieces() << " ("
+             << store.wantedPieceBytes() << " bytes)" << endl;
+        cout << "Edge pieces shared with skipped files: " << edges << endl;
+        if (!resume_dir.empty()) {
+            ResumeWriter writer(resume_dir, chrono::seconds(30));
+            SaveFilePriorities(meta, store.filePriorities(), writer);
+        }
+
+        if (!from.empty() && !to.empty()) {
+            PieceStore source(meta, storage, from);
+            vector<uint8_t> buf;
+            size_t ok = 0;
+            for (size_t p = 0; p < storage.numPieces(); ++p) {
+                if (!store.wanted(p)) continue;
+                if (!source.readPiece(p, buf)) throw runtime_error("cannot read piece " + to_string(p) + " from " + from);
+                store.writePiece(p, buf.data(), buf.size());
+                ok += store.checkPiece(p);
+            }
+            cout << "Copied and verified: " << ok << "/" << wanted << " pieces, part file slots: "
+                 << store.partFile().usedSlots() << endl;
+        }
+    } catch (const exception& e) {
+        cerr << "select failed: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// stream-sim <torrent> [file index] [--bitrate B] [--peers R1,R2,...] [--latency S]
+//            [--availability F] [--stall-at S] [--seed N]
+// Plays one file against simulated peers, with the deadline scheduler and
+// with plain in-order requests, and compares startup delay and stalls.
+int runStreamSim(int argc, char* argv[]) {
+    string torrent = argv[2];
+    size_t file_index = 0;
+    StreamSimOptions opts;
+
+    try {
+        int i = 3;
+        if (i < argc && argv[i][0] != '-') file_index = stoul(argv[i++]);
+        for (; i + 1 < argc; i += 2) {
+            string arg = argv[i];
+            string value = argv[i + 1];
+            if (arg == "--bitrate") opts.bitrate = stod(value);
+            else if (arg == "--latency") opts.latency = stod(value);
+            else if (arg == "--availability") opts.availability = stod(value);
+            else if (arg == "--stall-at") opts.stall_at = stod(value);
+            else if (arg == "--seed") opts.seed = static_cast<unsigned>(stoul(value));
+            else if (arg == "--peers") {
+                opts.peer_rates.clear();
+                size_t pos = 0;
+                while (pos <= value.size()) {
+                    size_t comma = value.find(',', pos);
+                    double rate = stod(value.substr(pos, comma - pos));
+                    if (!(rate > 0)) throw runtime_error("peer rates must be positive");
+                    opts.peer_rates.push_back(rate);
+                    if (comma == string::npos) break;
+                    pos = comma + 1;
+                }
+            } else {
+                throw runtime_error("unknown option " + arg);
+            }
+        }
+
+        TorrentMetadata meta = ParseFile(torrent);
+        FileStorage storage(meta);
+        if (file_index >= meta.files.size())
+            throw runtime_error("file index " + to_string(file_index) + " out of range (" +
+                                to_string(meta.files.size()) + " files)");
+        cout << "Streaming " << meta.files.joinedPath(file_index) << " (" << meta.files.length(file_index)
+             << " bytes) at " << opts.bitrate << " B/s from " << opts.peer_rates.size() << " peers" << endl;
+        printf("%-10s %9s %7s %9s %9s %7s %10s\n", "mode", "startup", "stalls", "stalled", "finish", "dups",
+               "wasted");
+        for (bool deadline : {true, false}) {
+            opts.deadline = deadline;
+            StreamSimResult r = SimulateStreaming(storage, file_index, opts);
+            printf("%-10s %8.2fs %7zu %8.2fs %8.2fs %7zu %9.1f%%\n", deadline ? "deadline" : "in-order",
+                   r.startup_delay, r.stalls, r.stall_seconds, r.finish_time, r.duplicate_requests,
+                   r.downloaded_bytes ? 100.0 * r.wasted_bytes / r.downloaded_bytes : 0.0);
+        }
+    } catch (const exception& e) {
+        cerr << "stream-sim failed: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// A new, uniquely named directory under the system temp directory, so
+// concurrent runs never share (or delete) each other's files.
+filesystem::path makeTempDir(const string& prefix) {
+    string path = (filesystem::temp_directory_path() / (prefix + "-XXXXXX")).string();
+#ifndef _WIN32
+    if (!mkdtemp(&path[0])) throw runtime_error("Cannot create a temporary directory: " + string(strerror(errno)));
+    return path;
+#else
+    random_device rd;
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        filesystem::path dir = filesystem::temp_directory_path() / (prefix + "-" + to_string(rd()));
+        if (filesystem::create_directory(dir)) return dir;
+    }
+    throw runtime_error("Cannot create a temporary directory");
+#endif
+}
+
+// pipeline-bench <torrent> <data dir> [--latency S] [--bandwidth B] [--seeders N]
+//                [--depth N] [--snub S] [--stall N] [--hash-memory B] [--dedup INDEX]
+//                [--timeout S] [--out DIR]
+// Downloads the torrent from in-process seeders over loopback TCP with
+// injected latency, once with a fixed request queue of --depth blocks per
+// peer and once with queues sized from each peer's bandwidth-delay product.
+// With --out the downloads are kept in DIR with fast-resume data, so a run
+// cut short by --timeout continues where it stopped the next time.
+int runPipelineBench(int argc, char* argv[]) {
+    if (argc < 4) {
+        cerr << "Usage: " << argv[0] << " pipeline-bench <torrent> <data dir> [--latency S] [--bandwidth B]"
+             << " [--seeders N] [--depth N] [--snub S] [--stall N] [--hash-memory B] [--dedup INDEX]"
+             << " [--timeout S] [--out DIR]" << endl;
+        return 1;
+    }
+    string torrent = argv[2];
+    string data_dir = argv[3];
+    SwarmOptions opts;
+    size_t fixed_depth = 5;
+    unique_ptr<DedupIndex> dedup;
+    filesystem::path out;
+    bool keep_out = false;
+
+    try {
+        for (int i = 4; i + 1 < argc; i += 2) {
+            string arg = argv[i];
+            string value = argv[i + 1];
+            if (arg == "--latency") opts.latency = stod(value);
+            else if (arg == "--bandwidth") opts.bandwidth = stod(value);
+            else if (arg == "--seeders") opts.seeders = stoul(value);
+            else if (arg == "--depth") fixed_depth = stoul(value);
+            else if (arg == "--snub") opts.scheduler.snub_timeout = stod(value);
+            else if (arg == "--stall") opts.stalled_seeders = stoul(value);
+            else if (arg == "--hash-memory") opts.hash_memory = stoul(value);
+            else if (arg == "--dedup") dedup.reset(new DedupIndex(value));
+            else if (arg == "--timeout") opts.timeout = stod(value);
+            else if (arg == "--out") out = value;
+            else throw runtime_error("unknown option " + arg);
+        }
+
+        opts.dedup = dedup.get();
+        keep_out = opts.resume = !out.empty();
+        TorrentMetadata meta = ParseFile(torrent);
+        FileStorage storage(meta);
+        if (!keep_out) out = makeTempDir("peerstorm-pipeline-bench");
+        cout << "Downloading " << meta.name << " (" << meta.total_size << " bytes) from " << opts.seeders
+             << " seeders, " << opts.latency * 1000 << " ms one-way, " << opts.bandwidth / (1 << 20)
+             << " MiB/s uplink each" << endl;
+        printf("%-10s %9s %10s %9s %8s %8s %8s\n", "queue", "time", "MiB/s", "reassign", "endgame", "cancels",
+               "wasted");
+        for (size_t depth : {fixed_depth, static_cast<size_t>(0)}) {
+            opts.scheduler.fixed_depth = depth;
+            string mode = depth ? "fixed " + to_string(depth) : "bdp";
+            SwarmResult r = RunLoopbackSwarm(meta, storage, data_dir, (out / (depth ? "fixed" : "bdp")).string(), opts);
+            const SwarmLeecherStats &l = r.leechers[0];
+            printf("%-10s %8.2fs %10.2f %9zu %8zu %8zu %7.1f%%%s\n", mode.c_str(), l.seconds,
+                   l.seconds > 0 ? (l.bytes - l.wasted_bytes) / l.seconds / (1 << 20) : 0.0, l.reassigned,
+                   l.endgame_requests, l.cancels, l.bytes ? 100.0 * l.wasted_bytes / l.bytes : 0.0,
+                   l.complete ? (l.hash_failures ? "  hash failures" : "") : "  incomplete");
+            if (dedup) printf("    %zu pieces from local copies\n", l.local_pieces);
+            if (opts.resume)
+                printf("    resumed %zu pieces and %zu blocks of unfinished ones\n", l.resumed_pieces, l.resumed_blocks);
+            printf("    hashed on receive: %.1f KiB peak out-of-order buffer, %.2f MiB read back\n",
+                   l.peak_hash_buffer / 1024.0, l.read_back_bytes / double(1 << 20));
+            for (auto &p : l.peers)
+                printf("    seeder %zu: %6.2f MiB/s  rtt %6.1f ms  queue %3zu (max %zu)%s\n", p.node,
+                       p.rate / (1 << 20), p.rtt * 1000, p.depth, p.max_depth, p.snubbed ? "  snubbed" : "");
+        }
+        if (!keep_out) filesystem::remove_all(out);
+    } catch (const exception& e) {
+        error_code ec;
+        if (!out.empty() && !keep_out) filesystem::remove_all(out, ec);
+        cerr << "pipeline-bench failed: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// dedup-import <index> <save path> <torrent>... [--threads N]
+// Index the files of torrents already downloaded under the save path by
+// content, on N threads.
+int runDedupImport(int argc, char* argv[]) {
+    if (argc < 5) {
+        cerr << "Usage: " << argv[0] << " dedup-import <index> <save path> <torrent>... [--threads N]" << endl;
+        return 1;
+    }
+    unsigned threads = 0;
+    vector<string> torrents;
+    for (int i = 4; i < argc; ++i) {
+        if (string(argv[i]) == "--threads" && i + 1 < argc) threads = static_cast<unsigned>(stoul(argv[++i]));
+        else torrents.push_back(argv[i]);
+    }
+
+    try {
+        DedupIndex index(argv[2]);
+        auto t0 = chrono::steady_clock::now();
+        DedupImportResult r = ImportTorrents(index, torrents, argv[3], threads);
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        index.save();
+        for (auto &e : r.errors) cerr << e.first << ": " << e.second << endl;
+        cout << "Imported " << r.torrents << " torrents, " << r.keys << " new keys in " << secs << " s; index has "
+             << index.size() << " keys" << endl;
+        return r.errors.empty() ? 0 : 1;
+    } catch (const exception& e) {
+        cerr << "dedup-import failed: " << e.what() << endl;
+        return 1;
+    }
+}
+
+// dedup-fill <index> <torrent> <save path> [--resume-dir D]
+// Put missing files in place from identical local files the index knows,
+// then check the pieces they cover. Files skipped by priorities saved with
+// select --resume-dir are left alone.
+int runDedupFill(int argc, char* argv[]) {
+    if (argc < 5) {
+        cerr << "Usage: " << argv[0] << " dedup-fill <index> <torrent> <save path> [--resume-dir D]" << endl;
+        return 1;
+    }
+    string resume_dir;
+    if (argc >= 7 && string(argv[5]) == "--resume-dir") resume_dir = argv[6];
+    try {
+        DedupIndex index(argv[2]);
+        string torrent = argv[3];
+        TorrentMetadata meta = ParseFile(torrent);
+        FileStorage storage(meta);
+        PieceStore store(meta, storage, argv[4]);
+        if (!resume_dir.empty()) {
+            ResumeWriter writer(resume_dir, chrono::seconds(30));
+            ResumeData rd;
+            if (LoadResumeFile(writer.pathFor(meta.info_hash), rd) && rd.info_hash == meta.info_hash)
+                store.setFilePriorities(rd.file_priorities);
+        }
+        DedupFillResult r = FillFromIndex(index, meta, storage, store);
+        cout << "Files: " << r.files_cloned << " cloned, " << r.files_copied << " copied, " << r.files_present
+             << " already present (" << r.bytes << " bytes)" << endl;
+        cout << "Pieces: " << r.verified.size() << " of " << storage.numPieces() << " verified from local data, "
+             << r.failed << " left for download" << endl;
+    } catch (const exception& e) {
+        cerr << "dedup-fill failed: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// swarm-bench [--size B] [--files N] [--piece-length B] [--v2] [--seeders N] [--leechers N]
+//             [--bandwidth B] [--latency S] [--loss F] [--seed N] [--depth N] [--hash-memory B]
+// End-to-end run of the whole stack on one box: makes a synthetic torrent,
+// announces it to a loopback tracker and lets the leechers download it from
+// the seeders and from each other over shaped loopback links.
+int runSwarmBench(int argc, char* argv[]) {
+    uint64_t size = 64 << 20;
+    size_t files = 4;
+    SwarmOptions opts;
+    CreateOptions create;
+    opts.seeders = 2;
+    opts.leechers = 4;
+    opts.bandwidth = 8 << 20;
+    opts.latency = 0.025;
+    filesystem::path dir;
+
+    try {
+        for (int i = 2; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "--v2") {
+                create.v2 = true;
+                continue;
+            }
+            if (i + 1 >= argc) throw runtime_error("missing value for " + arg);
+            string value = argv[++i];
+            if (arg == "--size") size = stoull(value);
+            else if (arg == "--files") files = max<size_t>(1, stoul(value));
+            else if (arg == "--piece-length") create.piece_length = stoll(value);
+            else if (arg == "--seeders") opts.seeders = stoul(value);
+            else if (arg == "--leechers") opts.leechers = stoul(value);
+            else if (arg == "--bandwidth") opts.bandwidth = stod(value);
+            else if (arg == "--latency") opts.latency = stod(value);
+            else if (arg == "--loss") opts.loss = stod(value);
+            else if (arg == "--seed") opts.seed = opts.scheduler.seed = static_cast<unsigned>(stoul(value));
+            else if (arg == "--depth") opts.scheduler.fixed_depth = stoul(value);
+            else if (arg == "--hash-memory") opts.hash_memory = stoul(value);
+            else throw runtime_error("unknown option " + arg);
+        }
+        if (opts.loss < 0 || opts.loss >= 1) throw runtime_error("--loss must be in [0, 1)");
+
+        // same bytes for the same seed, so runs can be compared
+        dir = makeTempDir("peerstorm-swarm-bench");
+        filesystem::path data = dir / "synthetic";
+        filesystem::create_directories(data);
+        mt19937_64 rng(opts.seed);
+        vector<uint64_t> buf(1 << 16);
+        for (size_t f = 0; f < files; ++f) {
+            uint64_t left = size / files + (f < size % files ? 1 : 0);
+            ofstream out(data / ("file-" + to_string(f) + ".bin"), ios::binary);
+            while (left > 0) {
+                for (auto &w : buf) w = rng();
+                size_t n = static_cast<size_t>(min<uint64_t>(left, buf.size() * sizeof(uint64_t)));
+                if (!out.write(reinterpret_cast<const char *>(buf.data()), static_cast<streamsize>(n)))
+                    throw runtime_error("Cannot write synthetic data under " + data.string());
+                left -= n;
+            }
+        }
+
+        LoopbackTracker tracker;
+        create.announce = tracker.announceUrl();
+        string torrent = CreateTorrent(data.string(), create);
+        TorrentMetadata meta = ParseTorrentData(torrent.data(), torrent.size());
+        FileStorage storage(meta);
+        opts.tracker = &tracker;
+
+        cout << "Swarm of " << opts.seeders << " seeders and " << opts.leechers << " leechers sharing "
+             << meta.total_size << " bytes in " << storage.numPieces() << " pieces" << (create.v2 ? " (hybrid)" : "")
+             << "; links: " << opts.bandwidth / (1 << 20) << " MiB/s uplink, " << opts.latency * 1000
+             << " ms one-way, " << opts.loss * 100 << "% loss" << endl;
+        SwarmResult r = RunLoopbackSwarm(meta, storage, dir.string(), (dir / "out").string(), opts);
+
+        printf("%-8s %9s %9s %13s %8s %9s\n", "leecher", "time", "MiB/s", "from leechers", "wasted", "failures");
+        bool complete = true;
+        for (size_t i = 0; i < r.leechers.size(); ++i) {
+            const SwarmLeecherStats &l = r.leechers[i];
+            uint64_t useful = l.bytes - l.wasted_bytes, from_leechers = 0;
+            for (auto &p : l.peers)
+                if (p.node >= opts.seeders) from_leechers += p.bytes;
+            printf("%-8zu %8.2fs %9.2f %12.1f%% %7.1f%% %9zu%s\n", i, l.seconds,
+                   l.seconds > 0 ? useful / l.seconds / (1 << 20) : 0.0, useful ? 100.0 * from_leechers / useful : 0.0,
+                   l.bytes ? 100.0 * l.wasted_bytes / l.bytes : 0.0, l.hash_failures, l.complete ? "" : "  incomplete");
+            complete = complete && l.complete;
+        }
+        double gb = r.bytes / 1e9;
+        printf("Completion time:      %.2f s\n", r.seconds);
+        printf("Aggregate throughput: %.2f MiB/s\n", r.seconds > 0 ? r.bytes / r.seconds / (1 << 20) : 0.0);
+        printf("CPU:                  %.2f s (%.2f s per GB delivered)\n", r.cpu_seconds, gb > 0 ? r.cpu_seconds / gb : 0.0);
+        printf("Memory high-water:    %.1f MiB\n", r.max_rss_bytes / double(1 << 20));
+        printf("Tracker announces:    %zu\n", tracker.announces());
+        filesystem::remove_all(dir);
+        return complete ? 0 : 1;
+    } catch (const exception& e) {
+        error_code ec;
+        if (!dir.empty()) filesystem::remove_all(dir, ec);
+        cerr << "swarm-bench failed: " << e.what() << endl;
+        return 1;
+    }
+}
+
+// verify <torrent> <save path> [--resume-dir D]
+// Only pieces the resume data cannot vouch for are read back from disk.
+int runVerify(int argc, char* argv[]) {
+    if (argc < 4) {
+        cerr << "Usage: " << argv[0] << " verify <torrent> <save path> [--resume-dir D]" << endl;
+        return 1;
+    }
+    string torrent = argv[2];
+    string save_path = argv[3];
+    string resume_dir = ".peerstorm/resume";
+    if (argc >= 6 && string(argv[4]) == "--resume-dir") resume_dir = argv[5];
+
+    try {
+        TorrentMetadata meta = ParseFile(torrent);
+        FileStorage storage(meta);
+        ResumeWriter writer(resume_dir, chrono::seconds(30));
+        VerifySummary sum = VerifyWithResume(meta, storage, save_path, writer);
+
+        cout << "Resume data: " << (sum.loaded ? "loaded" : "none") << endl;
+        cout << "Rechecked pieces: " << sum.rechecked << endl;
+        cout << "Verified pieces: " << sum.have << "/" << sum.pieces << endl;
+        if (sum.wanted < sum.pieces)
+            cout << "Wanted pieces (saved priorities): " << sum.wanted_have << "/" << sum.wanted << endl;
+    } catch (const exception& e) {
+        cerr << "verify failed: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// bench-parse <torrent> [runs]
+// Times loading and parsing with the file mapped versus read into memory.
+int runBenchParse(int argc, char* argv[]) {
+    string torrent = argv[2];
+    int runs = argc >= 4 ? stoi(argv[3]) : 10;
+    if (runs < 1) runs = 1;
+
+    try {
+        const InputMode modes[] = {INPUT_MMAP, INPUT_READ};
+        for (InputMode mode : modes) {
+            double load_ms = 0, parse_ms = 0;
+            bool mapped = false;
+            for (int r = 0; r < runs; ++r) {
+                auto t0 = chrono::steady_clock::now();
+                InputSource src = InputSource::open(torrent, mode);
+                auto t1 = chrono::steady_clock::now();
+                TorrentMetadata meta = ParseTorrentData(src.data(), src.size());
+                auto t2 = chrono::steady_clock::now();
+                load_ms += chrono::duration<double, milli>(t1 - t0).count();
+                parse_ms += chrono::duration<double, milli>(t2 - t1).count();
+                mapped = src.mapped();
+            }
+            cout << (mode == INPUT_MMAP ? "mmap" : "read") << (mapped ? "" : " (not mapped)")
+                 << ": load " << load_ms / runs << " ms, parse " << parse_ms / runs
+                 << " ms, total " << (load_ms + parse_ms) / runs << " ms" << endl;
+        }
+        cout << endl << FormatMetricsTable(CollectMetrics());
+    } catch (const exception& e) {
+        cerr << "bench-parse failed: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// bench-magnets <file> [--chunk B]
+// Parses a feed of newline-separated magnet links with ParseMagnetBatch, in
+// chunks of about B bytes cut at line ends into one reused batch, then the
+// same lines one at a time with ParseMagnet, and checks they agree on which
+// lines are valid and on each link's info hash and name.
+int runBenchMagnets(int argc, char* argv[]) {
+    string path = argv[2];
+    size_t chunk = 4 << 20;
+    if (argc >= 5 && string(argv[3]) == "--chunk") chunk = max<size_t>(1, stoul(argv[4]));
+
+    try {
+        InputSource src = InputSource::open(path);
+        const char *data = src.data();
+        size_t size = src.size();
+        MagnetBatch batch;
+        size_t links = 0, rejected = 0, single_links = 0, mismatches = 0;
+        double batch_s = 0, single_s = 0;
+
+        for (size_t pos = 0; pos < size;) {
+            size_t end = size;
+            if (size - pos > chunk) {
+                const char *nl = static_cast<const char *>(memchr(data + pos + chunk - 1, '\n', size - pos - chunk + 1));
+                if (nl) end = static_cast<size_t>(nl - data) + 1;
+            }
+
+            auto t0 = chrono::steady_clock::now();
+            batch.clear();
+            ParseMagnetBatch(data + pos, end - pos, batch);
+            batch_s += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+            links += batch.size();
+            rejected += batch.rejected_lines.size();
+
+            // the same lines through ParseMagnet, trimmed the way the batch parser trims them
+            vector<string> lines;
+            for (size_t b = pos; b < end;) {
+                size_t e = b;
+                while (e < end && data[e] != '\n') ++e;
+                size_t next = e + 1;
+                while (e > b && (data[e - 1] == '\r' || data[e - 1] == ' ' || data[e - 1] == '\t')) --e;
+                while (b < e && (data[b] == ' ' || data[b] == '\t')) ++b;
+                lines.emplace_back(data + b, e - b);
+                b = next;
+            }
+            vector<char> ok(lines.size(), 0);
+            vector<MagnetData> parsed(lines.size());
+            t0 = chrono::steady_clock::now();
+            for (size_t l = 0; l < lines.size(); ++l) {
+                if (lines[l].empty()) continue;
+                try {
+                    parsed[l] = ParseMagnet(lines[l]);
+                    ok[l] = 1;
+                } catch (const exception&) {
+                }
+            }
+            single_s += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+            size_t k = 0, r = 0;
+            for (size_t l = 0; l < lines.size(); ++l) {
+                if (lines[l].empty()) continue;
+                bool batch_ok = !(r < batch.rejected_lines.size() && batch.rejected_lines[r] == l);
+                if (!batch_ok) ++r;
+                single_links += ok[l];
+                if (batch_ok != static_cast<bool>(ok[l])) {
+                    ++mismatches;
+                } else if (batch_ok) {
+                    MagnetData d = batch.toMagnetData(k);
+                    mismatches += d.info_hash_bytes != parsed[l].info_hash_bytes || d.display_name != parsed[l].display_name;
+                }
+                k += batch_ok;
+            }
+            pos = end;
+        }
+
+        double mb = size / double(1 << 20);
+        printf("%zu links, %zu rejected lines, %.1f MiB\n", links, rejected, mb);
+        printf("%-14s %10s %10s %10s\n", "parser", "seconds", "ns/link", "MiB/s");
+        printf("%-14s %10.3f %10.1f %10.1f\n", "batch", batch_s, links ? batch_s * 1e9 / links : 0.0,
+               batch_s > 0 ? mb / batch_s : 0.0);
+        printf("%-14s %10.3f %10.1f %10.1f\n", "ParseMagnet", single_s,
+               single_links ? single_s * 1e9 / single_links : 0.0, single_s > 0 ? mb / single_s : 0.0);
+        printf("Disagreements: %zu\n", mismatches);
+        return mismatches ? 1 : 0;
+    } catch (const exception& e) {
+        cerr << "bench-magnets failed: " << e.what() << endl;
+        return 1;
+    }
+}
+
+// bench-index [entries] [lookups]
+// Fills an InfoHashIndex with random info hashes and times inserts, lookups
+// of present keys in random order and lookups of absent keys.
+int runBenchIndex(int argc, char* argv[]) {
+    size_t entries = argc >= 3 ? stoul(argv[2]) : 10000000;
+    size_t lookups = argc >= 4 ? stoul(argv[3]) : entries;
+    if (entries == 0 || lookups == 0) {
+        cerr << "bench-index: entries and lookups must be positive" << endl;
+        return 1;
+    }
+
+    mt19937_64 rng(1);
+    auto randomHash = [&rng]() {
+        InfoHash h;
+        for (size_t i = 0; i < h.bytes.size(); i += 8) {
+            uint64_t w = rng();
+            memcpy(h.bytes.data() + i, &w, min<size_t>(8, h.bytes.size() - i));
+        }
+        return h;
+    };
+    vector<InfoHash> keys(entries), hits(lookups), misses(lookups);
+    for (auto &k : keys) k = randomHash();
+    for (auto &k : hits) k = keys[rng() % entries];
+    for (auto &k : misses) k = randomHash();
+    auto ns = [](chrono::steady_clock::time_point t0, size_t n) {
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / n;
+    };
+
+    InfoHashIndex index;
+    index.reserve(entries);
+    auto t0 = chrono::steady_clock::now();
+    for (size_t i = 0; i < entries; ++i) index.insert(keys[i], static_cast<uint32_t>(i));
+    double insert_ns = ns(t0, entries);
+
+    uint64_t found = 0;
+    t0 = chrono::steady_clock::now();
+    for (auto &k : hits) found += index.find(k) != INVALID_TORRENT_HANDLE;
+    double hit_ns = ns(t0, lookups);
+
+    uint64_t absent = 0;
+    t0 = chrono::steady_clock::now();
+    for (auto &k : misses) absent += index.find(k) == INVALID_TORRENT_HANDLE;
+    double miss_ns = ns(t0, lookups);
+
+    vector<uint32_t> handles(lookups);
+    t0 = chrono::steady_clock::now();
+    index.find(hits.data(), lookups, handles.data());
+    double batch_ns = ns(t0, lookups);
+    uint64_t batch_found = 0;
+    for (uint32_t v : handles) batch_found += v != INVALID_TORRENT_HANDLE;
+
+    printf("%zu entries in %zu slots, %.1f MB (%.1f bytes/entry)\n", index.size(), index.capacity(),
+           index.memoryUsage() / 1e6, double(index.memoryUsage()) / index.size());
+    printf("insert %8.1f ns\n", insert_ns);
+    printf("hit    %8.1f ns  (%llu/%zu found)\n", hit_ns, static_cast<unsigned long long>(found), lookups);
+    printf("miss   %8.1f ns  (%llu/%zu absent)\n", miss_ns, static_cast<unsigned long long>(absent), lookups);
+    printf("batch  %8.1f ns  (%llu/%zu found)\n", batch_ns, static_cast<unsigned long long>(batch_found), lookups);
+    return found == lookups && batch_found == lookups ? 0 : 1;
+}
+
+// ------------------------------
+// Daemon client commands
+// add/remove/status/verify/stats/shutdown are sent to a running daemon; "batch"
+// reads one such command per line from stdin and pipelines them all over a
+// single connection.
+// ------------------------------
+
+// Turn "op arg..." into a daemon request. Paths are made absolute because the
+// daemon resolves them from its own working directory.
+BDict buildDaemonRequest(const vector<string>& args) {
+    if (args.empty()) throw runtime_error("empty command");
+    const string& op = args[0];
+    BDict req;
+    req["op"] = BValue(op);
+
+    auto hashArg = [&](size_t i) {
+        if (args.size() <= i || args[i].size() != 40) throw runtime_error(op + ": expected a 40-digit hex info hash");
+        vector<uint8_t> h = hexBytes(args[i]);
+        req["info-hash"] = BValue(string(h.begin(), h.end()));
+    };
+    auto pathArg = [&](size_t i, const char* key) {
+        if (args.size() > i) req[key] = BValue(filesystem::absolute(args[i]).lexically_normal().string());
+    };
+
+    if (op == "add") {
+        if (args.size() < 2) throw runtime_error("add: expected a torrent path or magnet link");
+        if (args[1].rfind("magnet:", 0) == 0) req["magnet"] = BValue(args[1]);
+        else pathArg(1, "path");
+        pathArg(2, "save path");
+    } else if (op == "remove") {
+        hashArg(1);
+    } else if (op == "status") {
+        if (args.size() > 1) hashArg(1);
+    } else if (op == "verify") {
+        hashArg(1);
+        pathArg(2, "save path");
+    } else if (op == "stats") {
+        if (args.size() > 1 && args[1] == "--prometheus") req["format"] = BValue(string("prometheus"));
+        else if (args.size() > 1) throw runtime_error("stats: unknown option " + args[1]);
+    } else if (op != "shutdown") {
+        throw runtime_error("unknown command: " + op);
+    }
+    return req;
+}
+
+static string responseHash(const BDict& d) {
+    const string& h = d.at("info-hash").asString();
+    return toHex(vector<uint8_t>(h.begin(), h.end()));
+}
+
+// One line per result; false if the daemon reported an error.
+bool printDaemonResponse(const string& op, const BDict& resp) {
+    if (!resp.count("ok") || resp.at("ok").asInt() == 0) {
+        cout << "error: " << (resp.count("error") ? resp.at("error").asString() : "no response") << endl;
+        return false;
+    }
+    if (op == "add") {
+        cout << responseHash(resp) << " " << resp.at("name").asString()
+             << (resp.at("existed").asInt() ? " (already added)" : "") << endl;
+    } else if (op == "status") {
+        for (auto& item : resp.at("torrents").asList()) {
+            const BDict& t = item.asDict();
+            long long have = t.at("have").asInt();
+            cout << responseHash(t) << "\t" << t.at("name").asString() << "\t" << t.at("size").asInt() << "\t"
+                 << (have < 0 ? string("-") : to_string(have)) << "/" << t.at("pieces").asInt() << "\t"
+                 << t.at("save path").asString() << endl;
+        }
+    } else if (op == "verify") {
+        cout << "verified " << resp.at("have").asInt() << "/" << resp.at("pieces").asInt() << " (rechecked "
+             << resp.at("rechecked").asInt() << ", resume data " << (resp.at("resume").asInt() ? "loaded" : "none");
+        if (resp.at("wanted").asInt() < resp.at("pieces").asInt())
+            cout << ", wanted " << resp.at("wanted have").asInt() << "/" << resp.at("wanted").asInt();
+        cout << ")" << endl;
+    } else if (op == "stats") {
+        cout << resp.at("text").asString();
+    } else {
+        cout << "ok" << endl;
+    }
+    return true;
+}
+
+int runDaemon(int argc, char* argv[]) {
+    DaemonOptions opts;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        string arg = argv[i];
+        if (arg == "--socket") opts.socket_path = argv[i + 1];
+        else if (arg == "--resume-dir") opts.resume_dir = argv[i + 1];
+    }
+    if (opts.socket_path.empty()) opts.socket_path = DefaultDaemonSocket();
+    try {
+        cout << "Starting PeerStorm daemon on " << opts.socket_path << endl;
+        RunDaemon(opts);
+    } catch (const exception& e) {
+        cerr << "daemon: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+int runClient(int argc, char* argv[]) {
+    vector<string> args(argv + 1, argv + argc);
+    try {
+        BDict req = buildDaemonRequest(args);
+        DaemonClient client(DefaultDaemonSocket());
+        return printDaemonResponse(args[0], client.call(req)) ? 0 : 1;
+    } catch (const exception& e) {
+        cerr << args[0] << " failed: " << e.what() << endl;
+        return 1;
+    }
+}
+
+// Split a batch line on whitespace; double quotes group a path with spaces.
+vector<string> splitCommandLine(const string& line) {
+    vector<string> out;
+    string cur;
+    bool quoted = false, any = false;
+    for (char c : line) {
+        if (c == '"') { quoted = !quoted; any = true; }
+        else if (!quoted && (c == ' ' || c == '\t' || c == '\r')) {
+            if (any) out.push_back(cur);
+            cur.clear();
+            any = false;
+        } else { cur += c; any = true; }
+    }
+    if (any) out.push_back(cur);
+    return out;
+}
+
+int runBatch() {
+    try {
+        DaemonClient client(DefaultDaemonSocket());
+        vector<pair<string, string>> ops;   // op, or a local usage error that is never sent
+        string line;
+        while (getline(cin, line)) {
+            vector<string> args = splitCommandLine(line);
+            if (args.empty() || args[0][0] == '#') continue;
+            try {
+                BDict req = buildDaemonRequest(args);
+                req["id"] = BValue(static_cast<long long>(ops.size()));
+                client.send(req);
+                ops.emplace_back(args[0], string());
+            } catch (const exception& e) {
+                ops.emplace_back(args[0], e.what());
+            }
+        }
+        client.flush();
+
+        int failed = 0;
+        for (auto& op : ops) {
+            if (!op.second.empty()) {
+                cout << "error: " << op.second << endl;
+                ++failed;
+            } else {
+                failed += !printDaemonResponse(op.first, client.receive());
+            }
+        }
+        return failed ? 1 : 0;
+    } catch (const exception& e) {
+        cerr << "batch failed: " << e.what() << endl;
+        return 1;
+    }
+}
+
 int main(int argc, char* argv[]) {
+    string command = argc >= 2 ? argv[1] : "";
+
+    // commands served by a running daemon
+    if (command == "daemon")
+        return runDaemon(argc, argv);
+    if (command == "batch")
+        return runBatch();
+    if (command == "add" || command == "remove" || command == "status" || command == "stats" ||
+        command == "shutdown" ||
+        (command == "verify" && argc >= 3 && !filesystem::exists(argv[2])))
+        return runClient(argc, argv);
+    if (command == "swarm-bench")   // options only
+        return runSwarmBench(argc, argv);
+    if (command == "bench-index")   // optional arguments only
+        return runBenchIndex(argc, argv);
+
     if (argc < 3) {
-        cerr << "Usage: " << argv[0] << " add-torrent <torrent path or magnet link>" << endl;
+        cerr << "Usage: " << argv[0] << " add-torrent <torrent path, - for stdin, or magnet link>" << endl;
+        cerr << "       " << argv[0] << " create <path> [--piece-length N] [--v2] [-o out.torrent]" << endl;
+        cerr << "       " << argv[0] << " verify <torrent> <save path> [--resume-dir D]" << endl;
+        cerr << "       " << argv[0] << " select <torrent> <files> [--priority P] [--from DIR --to DIR] [--resume-dir D]" << endl;
+        cerr << "       " << argv[0] << " stream-sim <torrent> [file index] [--bitrate B] [--peers R1,R2,...]" << endl;
+        cerr << "       " << argv[0] << " pipeline-bench <torrent> <data dir> [--latency S] [--bandwidth B]" << endl;
+        cerr << "       " << argv[0] << " dedup-import <index> <save path> <torrent>... [--threads N]" << endl;
+        cerr << "       " << argv[0] << " dedup-fill <index> <torrent> <save path> [--resume-dir D]" << endl;
+        cerr << "       " << argv[0] << " swarm-bench [--size B] [--seeders N] [--leechers N] [--bandwidth B]"
+             << " [--latency S] [--loss F]" << endl;
+        cerr << "       " << argv[0] << " bench-parse <torrent> [runs]" << endl;
+        cerr << "       " << argv[0] << " bench-magnets <file of magnet links> [--chunk B]" << endl;
+        cerr << "       " << argv[0] << " bench-index [entries] [lookups]" << endl;
+        cerr << "       " << argv[0] << " daemon [--socket PATH] [--resume-dir D]" << endl;
+        cerr << "       " << argv[0] << " add <torrent or magnet> [save path]    (via daemon)" << endl;
+        cerr << "       " << argv[0] << " remove <info hash> | status [info hash] | verify <info hash> [save path]" << endl;
+        cerr << "       " << argv[0] << " stats [--prometheus] | shutdown | batch < commands.txt" << endl;
         return 1;
     }
 
-    string command = argv[1];
     string input = argv[2];
 
+    if (command == "create")
+        return runCreate(argc, argv);
+    if (command == "verify")
+        return runVerify(argc, argv);
+    if (command == "select")
+        return runSelect(argc, argv);
+    if (command == "stream-sim")
+        return runStreamSim(argc, argv);
+    if (command == "pipeline-bench")
+        return runPipelineBench(argc, argv);
+    if (command == "dedup-import")
+        return runDedupImport(argc, argv);
+    if (command == "dedup-fill")
+        return runDedupFill(argc, argv);
+    if (command == "bench-parse")
+        return runBenchParse(argc, argv);
+    if (command == "bench-magnets")
+        return runBenchMagnets(argc, argv);
+
     if (command != "add-torrent") {
         cerr << "Unknown command: " << command << endl;
         return 1;
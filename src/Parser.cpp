@@ -1,5 +1,4 @@
 // src/Parser.cpp
-#include <fstream>
 #include <iostream>
 #include <string>
 #include <chrono>
@@ -8,23 +7,28 @@
 #include <iomanip>
 #include <vector>
 #include <stdexcept>
+#include <filesystem>
+#include <cstring>
+#include <string_view>
+#include <unordered_map>
 
 #include "../include/parser.h"
 #include "../include/bencode.h"
 #include "../include/sha1.h"
+#include "../include/sha256.h"
+#include "../include/merkle.h"
 #include "../include/magnet_parser.h"
+#include "../include/metrics.h"
 
 using namespace std;
 
-bool fileExists(const std::string& path) {
-    std::ifstream f(path);
-    return f.good();
-}
-
+// Only stats the path; the file itself is opened once, by ParseFile.
+// "-" stands for a torrent piped on standard input.
 TorrentSourceType IdentifySourceType(string &input) {
+    std::error_code ec;
     if (input.rfind("magnet:", 0) == 0)
         return MAGNET;
-    else if (fileExists(input))
+    else if (input == "-" || std::filesystem::exists(input, ec))
         return TORRENT_FILE;
     else
         return UNKNOWN;
@@ -42,232 +46,414 @@ std::string unixTimestampToLocalTime(long long timestamp) {
 }
 
 // ------------------------------
-// Byte-oriented bencode walker (mirrors your working BencodeParser logic)
-// It only finds the raw start/end of the bencoded "info" value.
+// Metadata key schema
+// Every dictionary key ParseFile understands, resolved through a perfect
+// hash computed at compile time: one hash and one compare per key, instead
+// of a std::map lookup per field. Keys not in the table are unknown.
 // ------------------------------
-static bool parseValueBytes(const std::vector<unsigned char>& data, size_t &pos);
-
-static bool parseStringBytes(const std::vector<unsigned char>& data, size_t &pos) {
-    size_t n = data.size();
-    if (pos >= n || !('0' <= data[pos] && data[pos] <= '9')) return false;
-    size_t len = 0;
-    while (pos < n && data[pos] >= '0' && data[pos] <= '9') {
-        len = len * 10 + (data[pos] - '0');
-        pos++;
+enum class MetaKey : uint8_t {
+    UNKNOWN,
+    ANNOUNCE, ANNOUNCE_LIST, COMMENT, CREATED_BY, CREATION_DATE, INFO, PIECE_LAYERS,   // root
+    NAME, PIECE_LENGTH, PIECES, FILES, LENGTH, META_VERSION, FILE_TREE,              // info
+    PATH, ATTR, PIECES_ROOT                                                           // file entries
+};
+
+struct MetaKeyEntry {
+    std::string_view name;
+    MetaKey key;
+};
+
+static constexpr MetaKeyEntry META_KEYS[] = {
+    {"announce", MetaKey::ANNOUNCE},
+    {"announce-list", MetaKey::ANNOUNCE_LIST},
+    {"comment", MetaKey::COMMENT},
+    {"created by", MetaKey::CREATED_BY},
+    {"creation date", MetaKey::CREATION_DATE},
+    {"info", MetaKey::INFO},
+    {"piece layers", MetaKey::PIECE_LAYERS},
+    {"name", MetaKey::NAME},
+    {"piece length", MetaKey::PIECE_LENGTH},
+    {"pieces", MetaKey::PIECES},
+    {"files", MetaKey::FILES},
+    {"length", MetaKey::LENGTH},
+    {"meta version", MetaKey::META_VERSION},
+    {"file tree", MetaKey::FILE_TREE},
+    {"path", MetaKey::PATH},
+    {"attr", MetaKey::ATTR},
+    {"pieces root", MetaKey::PIECES_ROOT},
+};
+static constexpr size_t META_KEY_COUNT = sizeof(META_KEYS) / sizeof(META_KEYS[0]);
+static constexpr size_t META_KEY_SLOTS = 64;
+static constexpr uint32_t META_NO_SEED = 0xFFFFFFFFu;
+
+static constexpr uint32_t metaKeyHash(std::string_view s, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < s.size(); ++i) {
+        h ^= static_cast<uint8_t>(s[i]);
+        h *= 16777619u;
     }
-    if (pos >= n || data[pos] != ':') return false;
-    pos++; // skip ':'
-    if (pos + len > n) return false;
-    pos += len;
-    return true;
+    return (h ^ (h >> 16)) % META_KEY_SLOTS;
 }
 
-static bool parseIntegerBytes(const std::vector<unsigned char>& data, size_t &pos) {
-    size_t n = data.size();
-    if (pos >= n || data[pos] != 'i') return false;
-    pos++; // skip 'i'
-    while (pos < n && data[pos] != 'e') pos++;
-    if (pos >= n || data[pos] != 'e') return false;
-    pos++; // skip 'e'
+static constexpr bool metaSeedIsPerfect(uint32_t seed) {
+    bool used[META_KEY_SLOTS] = {};
+    for (size_t i = 0; i < META_KEY_COUNT; ++i) {
+        uint32_t slot = metaKeyHash(META_KEYS[i].name, seed);
+        if (used[slot]) return false;
+        used[slot] = true;
+    }
     return true;
 }
 
-static bool parseListBytes(const std::vector<unsigned char>& data, size_t &pos) {
-    size_t n = data.size();
-    if (pos >= n || data[pos] != 'l') return false;
-    pos++; // skip 'l'
-    while (pos < n && data[pos] != 'e') {
-        if (!parseValueBytes(data, pos)) return false;
-    }
-    if (pos >= n || data[pos] != 'e') return false;
-    pos++; // skip 'e'
-    return true;
+static constexpr uint32_t findMetaKeySeed() {
+    for (uint32_t seed = 0; seed < 4096; ++seed)
+        if (metaSeedIsPerfect(seed)) return seed;
+    return META_NO_SEED;
 }
 
-static bool parseDictBytes(const std::vector<unsigned char>& data, size_t &pos) {
-    size_t n = data.size();
-    if (pos >= n || data[pos] != 'd') return false;
-    pos++; // skip 'd'
-    while (pos < n && data[pos] != 'e') {
-        // parse key (must be a string length:...)
-        if (!parseStringBytes(data, pos)) return false;
-        // parse value
-        if (!parseValueBytes(data, pos)) return false;
-    }
-    if (pos >= n || data[pos] != 'e') return false;
-    pos++; // skip 'e'
-    return true;
+static constexpr uint32_t META_KEY_SEED = findMetaKeySeed();
+static_assert(META_KEY_SEED != META_NO_SEED, "no collision-free seed for the metadata key table");
+
+// slot -> 1 + index into META_KEYS, 0 when the slot is empty
+struct MetaKeySlots {
+    uint8_t entry[META_KEY_SLOTS];
+};
+
+static constexpr MetaKeySlots buildMetaKeySlots() {
+    MetaKeySlots t{};
+    for (size_t i = 0; i < META_KEY_COUNT; ++i)
+        t.entry[metaKeyHash(META_KEYS[i].name, META_KEY_SEED)] = static_cast<uint8_t>(i + 1);
+    return t;
 }
 
-static bool parseValueBytes(const std::vector<unsigned char>& data, size_t &pos) {
-    if (pos >= data.size()) return false;
-    unsigned char t = data[pos];
-    if (t >= '0' && t <= '9') return parseStringBytes(data, pos);
-    if (t == 'i') return parseIntegerBytes(data, pos);
-    if (t == 'l') return parseListBytes(data, pos);
-    if (t == 'd') return parseDictBytes(data, pos);
-    if (t == 'e') { pos++; return true; } // should rarely be used here
-    return false;
+static constexpr MetaKeySlots META_KEY_TABLE = buildMetaKeySlots();
+
+static MetaKey lookupMetaKey(std::string_view key) {
+    uint8_t e = META_KEY_TABLE.entry[metaKeyHash(key, META_KEY_SEED)];
+    if (e != 0 && META_KEYS[e - 1].name == key) return META_KEYS[e - 1].key;
+    return MetaKey::UNKNOWN;
 }
 
-// This function mirrors your working parser's findInfoDictionary logic.
-// It returns true and sets [out_start, out_end) to the raw bencoded bytes of the value for "info".
-static bool findInfoRangeFromBytes(const std::vector<unsigned char>& data, size_t &out_start, size_t &out_end) {
-    out_start = out_end = static_cast<size_t>(-1);
-    size_t n = data.size();
-    if (n == 0) return false;
-    if (data[0] != 'd') return false;
-
-    size_t pos = 0;
-    // Expect root dict
-    if (data[pos++] != 'd') return false;
-
-    // iterate root dict keys
-    while (pos < n && data[pos] != 'e') {
-        // key must be a string: <len>:<key>
-        if (pos >= n || data[pos] < '0' || data[pos] > '9') return false;
-        size_t key_len = 0;
-        while (pos < n && data[pos] >= '0' && data[pos] <= '9') {
-            key_len = key_len * 10 + (data[pos] - '0');
-            pos++;
-        }
-        if (pos >= n || data[pos] != ':') return false;
-        pos++; // skip ':'
-        if (pos + key_len > n) return false;
-        std::string key;
-        key.reserve(key_len);
-        for (size_t i = 0; i < key_len; ++i) {
-            key.push_back(static_cast<char>(data[pos++]));
-        }
+// ------------------------------
+// Streaming extraction
+// ParseFile walks the bencoded bytes once with a BencodeReader and writes
+// straight into TorrentMetadata; no BValue tree is built.
+// ------------------------------
 
-        if (key == "info") {
-            // start of info value is current pos
-            size_t start_pos = pos;
-            if (!parseValueBytes(data, pos)) return false;
-            size_t end_pos = pos;
-            out_start = start_pos;
-            out_end = end_pos;
-            return true;
-        } else {
-            // skip the value for this key
-            if (!parseValueBytes(data, pos)) return false;
-        }
+// A torrent's names become paths under the save directory, so each one must
+// be a single plain component: no "..", ".", empty name, root or separator.
+static void checkPathComponent(std::string_view part) {
+    bool unsafe = part.empty() || part == "." || part == "..";
+    for (char c : part) {
+#ifdef _WIN32
+        unsafe |= c == ':';   // drive letters ("C:") and alternate data streams
+#endif
+        unsafe |= c == '/' || c == '\\' || c == '\0';
     }
+    if (unsafe) throw runtime_error("Unsafe path component in torrent: \"" + string(part) + "\"");
+}
 
-    return false;
+// v1 "files" list. Path components go straight into the file table.
+static void readFileList(BencodeReader &r, TorrentMetadata &meta) {
+    r.enterList();
+    while (r.more()) {
+        r.enterDict();
+        int64_t length = -1;
+        uint8_t flags = 0;
+        uint32_t dir = FileTable::ROOT_DIR;
+        std::string_view last;
+        bool has_path = false;
+        while (r.more()) {
+            switch (lookupMetaKey(r.readString())) {
+            case MetaKey::LENGTH: length = r.readInt(); break;
+            case MetaKey::ATTR: flags = fileFlagsFromAttr(r.readString()); break;
+            case MetaKey::PATH:
+                r.enterList();
+                while (r.more()) {
+                    if (has_path) dir = meta.files.directory(dir, last);
+                    last = r.readString();
+                    checkPathComponent(last);
+                    has_path = true;
+                }
+                break;
+            default: r.skip(); break;
+            }
+        }
+        if (length < 0) throw runtime_error("File entry without length");
+        if (!has_path) throw runtime_error("Empty file path in torrent");
+        meta.files.addFile(dir, last, length, flags);
+        meta.total_size += length;
+    }
 }
 
 // ------------------------------
-// ParseFile implementation
+// BEP 52 file tree walker
+// Leaves are dicts keyed by the empty string; everything else is a directory.
+// Pure v2 torrents build the file table from the tree; hybrid torrents
+// already have it from the v1 list and only attach the pieces roots.
 // ------------------------------
-TorrentMetadata ParseFile(string &path) {
-    TorrentMetadata meta;
+static void readFileTreeLeaf(BencodeReader &r, FileTable &files, uint32_t dir, std::string_view name, bool hybrid) {
+    r.enterDict();
+    int64_t length = -1;
+    uint8_t flags = 0;
+    std::string_view root;
+    bool has_root = false;
+    while (r.more()) {
+        switch (lookupMetaKey(r.readString())) {
+        case MetaKey::LENGTH: length = r.readInt(); break;
+        case MetaKey::ATTR: flags = fileFlagsFromAttr(r.readString()); break;
+        case MetaKey::PIECES_ROOT: root = r.readString(); has_root = true; break;
+        default: r.skip(); break;
+        }
+    }
+    if (length < 0) throw runtime_error("File tree entry without length");
 
-    // --- Read file into raw vector of bytes ---
-    ifstream file(path, ios::binary);
-    if (!file) throw runtime_error("Cannot open .torrent file");
-
-    // read into vector<unsigned char>
-    std::vector<unsigned char> raw;
-    file.seekg(0, ios::end);
-    std::streampos fsize = file.tellg();
-    if (fsize <= 0) throw runtime_error("Empty or invalid file size");
-    raw.resize(static_cast<size_t>(fsize));
-    file.seekg(0, ios::beg);
-    if (!file.read(reinterpret_cast<char*>(raw.data()), static_cast<std::streamsize>(raw.size())))
-        throw runtime_error("Error reading file");
-
-    // --- Find raw info slice using byte-walker that mirrors your working code ---
-    size_t info_start = static_cast<size_t>(-1);
-    size_t info_end = static_cast<size_t>(-1);
-    if (!findInfoRangeFromBytes(raw, info_start, info_end)) {
-        throw runtime_error("Could not locate 'info' dictionary in torrent (byte-scan failed)");
+    size_t i;
+    if (hybrid) {
+        uint32_t f = files.findFile(dir, name);
+        if (f == FileTable::NOT_FOUND) return;
+        i = f;
+    } else {
+        i = files.addFile(dir, name, length, flags);
     }
-    if (info_start >= info_end || info_end > raw.size()) {
-        throw runtime_error("Invalid info byte range found");
+    if (has_root) {
+        if (root.size() != MERKLE_HASH_SIZE) throw runtime_error("Invalid pieces root length");
+        files.setPiecesRoot(i, reinterpret_cast<const uint8_t *>(root.data()));
     }
+}
 
-    // Extract raw bytes slice for hashing
-    // Use a vector<uint8_t> to preserve raw bytes exactly (no std::string conversion)
-    std::vector<uint8_t> info_bytes;
-    info_bytes.reserve(info_end - info_start);
-    info_bytes.insert(info_bytes.end(), raw.begin() + info_start, raw.begin() + info_end);
-
-    // Compute SHA1 over the raw byte vector using sha1_bytes (added below)
-    meta.info_hash = sha1_bytes(info_bytes);
-
-
-    // --- Now decode the full file into BValue for the rest of metadata ---
-    // convert raw to std::string for existing decoder functions
-    std::string data_str;
-    data_str.assign(reinterpret_cast<const char*>(raw.data()), raw.size());
-
-    size_t pos = 0;
-    BValue root = decodeValue(data_str, pos);
-    const BDict &dict = root.asDict();
+static void readFileTreeNode(BencodeReader &r, FileTable &files, uint32_t parent, std::string_view name, bool hybrid) {
+    checkPathComponent(name);
+    r.enterDict();
+    uint32_t dir = FileTable::NOT_FOUND;
+    bool resolved = false;
+    while (r.more()) {
+        std::string_view key = r.readString();
+        if (key.empty()) {
+            readFileTreeLeaf(r, files, parent, name, hybrid);
+            continue;
+        }
+        if (!resolved) {
+            dir = hybrid ? files.findDirectory(parent, name) : files.directory(parent, name);
+            resolved = true;
+        }
+        if (dir == FileTable::NOT_FOUND) r.skip();
+        else readFileTreeNode(r, files, dir, key, hybrid);
+    }
+}
 
-    // --- Basic fields ---
-    if (dict.count("announce"))
-        meta.announce = dict.at("announce").asString();
+static void readFileTree(BencodeReader &r, FileTable &files, bool hybrid) {
+    r.enterDict();
+    while (r.more()) {
+        std::string_view name = r.readString();
+        readFileTreeNode(r, files, FileTable::ROOT_DIR, name, hybrid);
+    }
+}
 
-    if (dict.count("announce-list")) {
-        for (auto &tier : dict.at("announce-list").asList())
-            for (auto &v : tier.asList())
-                meta.announce_list.push_back(v.asString());
+// Attach "piece layers" entries to v2 files and check each one hashes up to
+// its file's pieces root, so a corrupt layer is rejected at load time.
+static void attachPieceLayers(const char *data, size_t size, std::string_view raw_layers, TorrentMetadata &meta) {
+    unordered_map<std::string_view, std::string_view> layers;
+    if (!raw_layers.empty()) {
+        BencodeReader r(data, size, static_cast<size_t>(raw_layers.data() - data));
+        r.enterDict();
+        while (r.more()) {
+            std::string_view root = r.readString();
+            layers[root] = r.readString();
+        }
     }
+    size_t blocks_per_piece = static_cast<size_t>(meta.piece_length) / MERKLE_BLOCK_SIZE;
+
+    for (size_t i = 0; i < meta.files.size(); ++i) {
+        const uint8_t *root = meta.files.piecesRoot(i);
+        int64_t length = meta.files.length(i);
+        if (!root || length <= meta.piece_length) continue;
+        auto it = layers.find(std::string_view(reinterpret_cast<const char *>(root), MERKLE_HASH_SIZE));
+        if (it == layers.end()) throw runtime_error("Missing piece layer for v2 file");
+
+        std::string_view layer = it->second;
+        size_t pieces = static_cast<size_t>((length + meta.piece_length - 1) / meta.piece_length);
+        if (layer.size() != pieces * MERKLE_HASH_SIZE) throw runtime_error("Invalid piece layer length");
+
+        vector<uint8_t> computed = merkleRoot(vector<uint8_t>(layer.begin(), layer.end()),
+                                              merkleNumLeaves(pieces), merklePadHash(blocks_per_piece));
+        if (memcmp(computed.data(), root, MERKLE_HASH_SIZE) != 0)
+            throw runtime_error("Piece layer does not match pieces root");
+        meta.files.setPieceLayer(i, reinterpret_cast<const uint8_t *>(layer.data()), layer.size());
+    }
+}
 
-    if (dict.count("creation date")) {
-        meta.Unix_timestamp = dict.at("creation date").asInt();
-        meta.creation_date = unixTimestampToLocalTime(meta.Unix_timestamp);
+// Values the info dict parser cannot act on until the whole dict is read:
+// keys arrive sorted, so "file tree" and "files" precede "meta version",
+// and "length" precedes "name".
+struct InfoPending {
+    std::string_view file_tree;
+    int64_t length = -1;
+};
+
+static void readInfo(BencodeReader &r, TorrentMetadata &meta, InfoPending &pending) {
+    r.enterDict();
+    while (r.more()) {
+        std::string_view key = r.readString();
+        switch (lookupMetaKey(key)) {
+        case MetaKey::NAME: meta.name.assign(r.readString()); break;
+        case MetaKey::PIECE_LENGTH: meta.piece_length = r.readInt(); break;
+        case MetaKey::META_VERSION: meta.meta_version = static_cast<int>(r.readInt()); break;
+        case MetaKey::PIECES: {
+            std::string_view pieces = r.readString();
+            meta.pieces.assign(pieces.begin(), pieces.end());
+            meta.piece_count = meta.pieces.size() / 20;
+            break;
+        }
+        case MetaKey::FILES:
+            meta.multi_file = true;
+            readFileList(r, meta);
+            break;
+        case MetaKey::LENGTH: pending.length = r.readInt(); break;
+        case MetaKey::FILE_TREE: pending.file_tree = r.skip(); break;
+        default: meta.extra_info_fields.emplace(key, r.skip()); break;
+        }
     }
+}
 
-    if (dict.count("created by"))
-        meta.created_by = dict.at("created by").asString();
+std::string FilePathOnDisk(const TorrentMetadata &meta, size_t file_index, const std::string &root_dir) {
+    std::filesystem::path root(root_dir);
+    std::filesystem::path p = root;
+    if (meta.multi_file) p /= meta.name;
+    for (auto &part : meta.files.path(file_index)) p /= part;
+    // the parser already rejects unsafe names; never leave root_dir regardless
+    std::filesystem::path rel = p.lexically_normal().lexically_relative(root.lexically_normal());
+    if (rel.empty() || *rel.begin() == "." || *rel.begin() == "..")
+        throw runtime_error("File path escapes the save directory: " + p.string());
+    return p.string();
+}
 
-    if (dict.count("comment"))
-        meta.comment = dict.at("comment").asString();
+// ------------------------------
+// ParseFile implementation
+// ------------------------------
+// Phase timings: "scan" is the stage-one validation, "hash" the info hash(es),
+// and "extract" everything else (the streaming decode, file tree and piece
+// layers), which since the single-pass rewrite is one fused step.
+static TorrentMetadata parseTorrentBytes(const char *data, size_t size) {
+    const uint64_t t_start = metricNow();
+    // Reject malformed or non-canonical input before anything is allocated.
+    size_t end = 0;
+    if (const char *err = bencodeValidate(data, size, end))
+        throw runtime_error(string("Invalid torrent: ") + err + " at position " + to_string(end));
+    if (end != size) throw runtime_error("Invalid torrent: trailing data after root dictionary");
+    const uint64_t t_scanned = metricNow();
+    metricRecord(METRIC_PARSE_SCAN_NS, t_scanned - t_start);
+    uint64_t hash_ns = 0;
 
-    // --- INFO DICTIONARY (parsed struct) ---
-    const BValue &info_bvalue = dict.at("info"); // parsed object
-    const BDict &info = info_bvalue.asDict();
+    TorrentMetadata meta;
+    BencodeReader r(data, size);
+    std::string_view info, piece_layers;
+    InfoPending pending;
+
+    r.enterDict();
+    while (r.more()) {
+        std::string_view key = r.readString();
+        switch (lookupMetaKey(key)) {
+        case MetaKey::ANNOUNCE: meta.announce.assign(r.readString()); break;
+        case MetaKey::ANNOUNCE_LIST:
+            r.enterList();
+            while (r.more()) {
+                r.enterList();
+                while (r.more()) meta.announce_list.emplace_back(r.readString());
+            }
+            break;
+        case MetaKey::CREATION_DATE:
+            meta.Unix_timestamp = r.readInt();
+            meta.creation_date = unixTimestampToLocalTime(meta.Unix_timestamp);
+            break;
+        case MetaKey::CREATED_BY: meta.created_by.assign(r.readString()); break;
+        case MetaKey::COMMENT: meta.comment.assign(r.readString()); break;
+        case MetaKey::INFO: {
+            size_t start = r.position();
+            readInfo(r, meta, pending);
+            info = std::string_view(data + start, r.position() - start);
+            break;
+        }
+        case MetaKey::PIECE_LAYERS: piece_layers = r.skip(); break;
+        default: meta.extra_fields.emplace(key, r.skip()); break;
+        }
+    }
+    if (info.empty()) throw runtime_error("Key 'info' not found in torrent file");
+    checkPathComponent(meta.name);
+    if (meta.meta_version == 2) {
+        // BEP 52: a power of two, at least one 16 KiB merkle block
+        if (meta.piece_length < static_cast<int64_t>(MERKLE_BLOCK_SIZE) || (meta.piece_length & (meta.piece_length - 1)))
+            throw runtime_error("Invalid piece length for a v2 torrent: " + to_string(meta.piece_length));
+    } else if (meta.piece_length <= 0) {
+        throw runtime_error("Invalid piece length: " + to_string(meta.piece_length));
+    }
 
-    // fill metadata fields from parsed info
-    if (info.count("name")) meta.name = info.at("name").asString();
-    if (info.count("piece length")) meta.piece_length = info.at("piece length").asInt();
+    const uint8_t *info_bytes = reinterpret_cast<const uint8_t *>(info.data());
+    uint64_t t_hash = metricNow();
+    sha1_raw(info_bytes, info.size(), meta.info_hash.data());
+    hash_ns += metricNow() - t_hash;
 
-    // Pieces
-    if (info.count("pieces")) {
-        string pieces_str = info.at("pieces").asString();
-        meta.pieces.assign(pieces_str.begin(), pieces_str.end());
-        meta.piece_count = meta.pieces.size() / 20;
+    // SINGLE-FILE: the one file is named after the torrent
+    if (!meta.multi_file && pending.length >= 0) {
+        meta.files.addFile(FileTable::ROOT_DIR, meta.name, pending.length);
+        meta.total_size = static_cast<uint64_t>(pending.length);
     }
 
-    // MULTI-FILE MODE
-    if (info.count("files")) {
-        for (auto &item : info.at("files").asList()) {
-            const BDict &fd = item.asDict();
-            TorrentDataFile f;
-            f.length = fd.at("length").asInt();
-            for (auto &p : fd.at("path").asList())
-                f.path.push_back(p.asString());
-
-            meta.total_size += f.length;
-            meta.files.push_back(f);
-        }
-    } else {
-        // SINGLE-FILE
-        if (info.count("length")) {
-            TorrentDataFile f;
-            f.length = info.at("length").asInt();
-            f.path.push_back(meta.name);
-            meta.total_size = f.length;
-            meta.files.push_back(f);
+    // --- V2 / HYBRID (BEP 52) ---
+    if (meta.meta_version == 2) {
+        if (pending.file_tree.empty()) throw runtime_error("v2 torrent without file tree");
+        meta.info_hash_v2.resize(32);
+        t_hash = metricNow();
+        sha256_raw(info_bytes, info.size(), meta.info_hash_v2.data());
+        hash_ns += metricNow() - t_hash;
+
+        // hybrid: the v1 list is authoritative (it carries the pad files)
+        bool hybrid = !meta.files.empty();
+        BencodeReader tree(data, size, static_cast<size_t>(pending.file_tree.data() - data));
+        readFileTree(tree, meta.files, hybrid);
+
+        if (!hybrid) {
+            // pure v2: the file tree is the only file list
+            meta.has_v1 = false;
+            meta.multi_file = !(meta.files.size() == 1 && meta.files.path(0).size() == 1 &&
+                                meta.files.name(0) == meta.name);
+            for (size_t i = 0; i < meta.files.size(); ++i) {
+                int64_t length = meta.files.length(i);
+                meta.total_size += length;
+                meta.piece_count += static_cast<size_t>((length + meta.piece_length - 1) / meta.piece_length);
+            }
+            // BEP 52: the truncated v2 hash stands in wherever 20 bytes are expected
+            meta.info_hash.assign(meta.info_hash_v2.begin(), meta.info_hash_v2.begin() + 20);
         }
+        attachPieceLayers(data, size, piece_layers, meta);
     }
 
+    meta.files.finalize();
+    metricRecord(METRIC_PARSE_HASH_NS, hash_ns);
+    metricRecord(METRIC_PARSE_EXTRACT_NS, metricNow() - t_scanned - hash_ns);
     return meta;
 }
 
+TorrentMetadata ParseTorrentData(const char *data, size_t size) {
+    MetricTimer total(METRIC_PARSE_TOTAL_NS);
+    try {
+        TorrentMetadata meta = parseTorrentBytes(data, size);
+        metricAdd(METRIC_PARSE_FILES);
+        return meta;
+    } catch (...) {
+        metricAdd(METRIC_PARSE_ERRORS);
+        throw;
+    }
+}
+
+TorrentMetadata ParseFile(string &path, InputMode mode) {
+    MetricTimer read(METRIC_PARSE_READ_NS);
+    InputSource src = InputSource::open(path, mode);
+    read.stop();
+    if (src.size() == 0) throw runtime_error("Empty or invalid file size");
+    return ParseTorrentData(src.data(), src.size());
+}
+
 MagnetData ParseMagnet(string &input) {
  if (input.rfind("magnet:?", 0) != 0)
         throw std::runtime_error("Not a magnet link");
@@ -1,47 +1,280 @@
 #include "../include/bencode.h"
+#include "../include/metrics.h"
 
 #include <algorithm>
-#include <cctype>
+#include <climits>
 #include <cstdlib>
+#include <cstring>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PEERSTORM_BENCODE_SSE2 1
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
 using namespace std;
 
-// -------- INTEGER --------
-long long decodeInt(const std::string& data, size_t& pos) {
-    if (pos >= data.size() || data[pos] != 'i')
-        throw std::runtime_error("decodeInt: expected 'i' at position " + std::to_string(pos));
-    pos++; // skip 'i'
+// -------- NUMBER SCANNING --------
+// Every integer and string length goes through these two scanners, so the
+// canonical-form rules live in one place.
+
+// Length of the run of ASCII digits at p. 16 bytes per step with SSE2:
+// adding 0x80 - '0' maps '0'..'9' onto the 10 smallest signed bytes.
+static size_t digitRun(const char *p, const char *end) {
+    const char *start = p;
+#ifdef PEERSTORM_BENCODE_SSE2
+    const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80 - '0'));
+    const __m128i limit = _mm_set1_epi8(static_cast<char>(0x80 + 10));
+    while (end - p >= 16) {
+        __m128i v = _mm_add_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)), bias);
+        unsigned m = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmplt_epi8(v, limit))) ^ 0xFFFFu;
+        if (m) {
+#if defined(_MSC_VER)
+            unsigned long i;
+            _BitScanForward(&i, m);
+            return static_cast<size_t>(p - start) + i;
+#else
+            return static_cast<size_t>(p - start) + static_cast<size_t>(__builtin_ctz(m));
+#endif
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && *p >= '0' && *p <= '9') ++p;
+    return static_cast<size_t>(p - start);
+}
 
-    size_t end = data.find('e', pos);
-    if (end == std::string::npos)
-        throw std::runtime_error("Invalid bencode integer");
+// "i<int>e" at data[pos]. Returns nullptr and advances pos, or the reason.
+static const char *scanInt(const char *data, size_t size, size_t &pos, long long &out) {
+    if (pos >= size || data[pos] != 'i') return "expected integer";
+    size_t p = pos + 1;
+    bool neg = p < size && data[p] == '-';
+    if (neg) ++p;
+    size_t n = digitRun(data + p, data + size);
+    if (n == 0 || p + n >= size || data[p + n] != 'e') return "malformed integer";
+    if (data[p] == '0' && (n > 1 || neg)) return "non-canonical integer";
+    if (n > 19) return "integer overflow";
+    unsigned long long v = 0;
+    for (size_t k = 0; k < n; ++k) v = v * 10 + static_cast<unsigned>(data[p + k] - '0');
+    if (v > static_cast<unsigned long long>(LLONG_MAX)) return "integer overflow";
+    out = neg ? -static_cast<long long>(v) : static_cast<long long>(v);
+    pos = p + n + 1;
+    return nullptr;
+}
 
-    long long val = std::stoll(data.substr(pos, end - pos));
-    pos = end + 1;
-    return val;
+// "<len>:" at data[pos], with the string body in range. Advances pos to the
+// first content byte.
+static const char *scanLength(const char *data, size_t size, size_t &pos, size_t &len) {
+    size_t n = digitRun(data + pos, data + size);
+    if (n == 0 || pos + n >= size || data[pos + n] != ':') return "expected string";
+    if (data[pos] == '0' && n > 1) return "non-canonical string length";
+    if (n > 19) return "string length out of range";
+    unsigned long long v = 0;
+    for (size_t k = 0; k < n; ++k) v = v * 10 + static_cast<unsigned>(data[pos + k] - '0');
+    size_t body = pos + n + 1;
+    if (v > size - body) return "string length out of range";
+    len = static_cast<size_t>(v);
+    pos = body;
+    return nullptr;
 }
 
-// -------- STRING --------
-std::string decodeString(const std::string& data, size_t& pos) {
-    // parse length
-    size_t colon = data.find(':', pos);
-    if (colon == std::string::npos)
-        throw std::runtime_error("Invalid bencode string (no colon)");
+static size_t decimalWidth(unsigned long long v) {
+    size_t n = 1;
+    while (v >= 10) { v /= 10; ++n; }
+    return n;
+}
 
-    // length must be digits
-    for (size_t i = pos; i < colon; ++i)
-        if (!isdigit(static_cast<unsigned char>(data[i])))
-            throw std::runtime_error("Invalid string length digits in bencode");
+[[noreturn]] static void bencodeFail(const char *what, size_t pos) {
+    throw std::runtime_error(std::string("bencode: ") + what + " at position " + std::to_string(pos));
+}
 
-    size_t len = std::stoul(data.substr(pos, colon - pos));
-    pos = colon + 1;
+// -------- STAGE ONE --------
+// Iterative walk with a fixed-size stack, shared by bencodeValidate (no
+// output) and BencodeTape::build. String bodies are skipped by length and
+// never read, except dictionary keys, which are compared with their
+// predecessor to enforce ordering.
+template <bool EMIT>
+static const char *scanValue(const char *data, size_t size, size_t &pos, vector<BencodeTapeEntry> *tape) {
+    struct Frame {
+        bool dict;
+        bool want_value;      // dict: a key has been read, its value is next
+        uint32_t entry;       // tape index of the opener
+        size_t key;           // previous key, as offset/length into data
+        size_t key_len;
+        bool has_key;
+    };
+    Frame stack[BENCODE_MAX_DEPTH];
+    size_t depth = 0;
+
+    do {
+        if (pos >= size) return "unexpected end of data";
+        Frame *top = depth ? &stack[depth - 1] : nullptr;
+        char c = data[pos];
+
+        if (c == 'e') {
+            if (!top) return "unexpected end marker";
+            if (top->want_value) return "dictionary key without value";
+            if (EMIT) {
+                BencodeTapeEntry e{};
+                e.type = BType::NONE;
+                e.offset = static_cast<uint32_t>(pos);
+                e.match = top->entry;
+                (*tape)[top->entry].match = static_cast<uint32_t>(tape->size());
+                tape->push_back(e);
+            }
+            ++pos;
+            --depth;
+        } else if (top && top->dict && !top->want_value) {
+            // dictionary key
+            size_t len;
+            if (c < '0' || c > '9') return "dictionary key is not a string";
+            if (const char *err = scanLength(data, size, pos, len)) return err;
+            if (top->has_key) {
+                int cmp = memcmp(data + top->key, data + pos, min(top->key_len, len));
+                if (cmp > 0 || (cmp == 0 && top->key_len >= len))
+                    return cmp == 0 && top->key_len == len ? "duplicate dictionary key" : "unsorted dictionary keys";
+            }
+            top->key = pos;
+            top->key_len = len;
+            top->has_key = true;
+            top->want_value = true;
+            if (EMIT) {
+                BencodeTapeEntry e{};
+                e.type = BType::STRING;
+                e.offset = static_cast<uint32_t>(pos);
+                e.length = static_cast<uint32_t>(len);
+                tape->push_back(e);
+            }
+            pos += len;
+            continue;
+        } else if (c == 'l' || c == 'd') {
+            if (depth == BENCODE_MAX_DEPTH) return "nesting too deep";
+            Frame &f = stack[depth++];
+            f.dict = c == 'd';
+            f.want_value = false;
+            f.has_key = false;
+            f.entry = 0;
+            if (EMIT) {
+                f.entry = static_cast<uint32_t>(tape->size());
+                BencodeTapeEntry e{};
+                e.type = f.dict ? BType::DICT : BType::LIST;
+                e.offset = static_cast<uint32_t>(pos);
+                tape->push_back(e);
+            }
+            ++pos;
+            continue;
+        } else if (c == 'i') {
+            long long v;
+            size_t start = pos;
+            if (const char *err = scanInt(data, size, pos, v)) return err;
+            if (EMIT) {
+                BencodeTapeEntry e{};
+                e.type = BType::INT;
+                e.offset = static_cast<uint32_t>(start);
+                e.int_val = v;
+                tape->push_back(e);
+            }
+        } else if (c >= '0' && c <= '9') {
+            size_t len;
+            if (const char *err = scanLength(data, size, pos, len)) return err;
+            if (EMIT) {
+                BencodeTapeEntry e{};
+                e.type = BType::STRING;
+                e.offset = static_cast<uint32_t>(pos);
+                e.length = static_cast<uint32_t>(len);
+                tape->push_back(e);
+            }
+            pos += len;
+        } else {
+            return "invalid token";
+        }
 
-    if (pos + len > data.size())
-        throw std::runtime_error("Invalid string length (out of range)");
+        // a complete value: inside a dict, a key comes next
+        if (depth) stack[depth - 1].want_value = false;
+    } while (depth > 0);
+    return nullptr;
+}
+
+const char *bencodeValidate(const char *data, size_t size, size_t &pos) {
+    MetricTimer timer(METRIC_BENCODE_NS);
+    size_t p = pos;
+    const char *err = scanValue<false>(data, size, p, nullptr);
+    metricAdd(METRIC_BENCODE_BYTES, p - pos);
+    pos = p;
+    return err;
+}
+
+size_t BencodeTape::build(const char *data, size_t size, size_t pos) {
+    if (size > 0xFFFFFFFFu) throw std::runtime_error("bencode: input larger than 4 GiB");
+    data_ = data;
+    tape_.clear();
+    MetricTimer timer(METRIC_BENCODE_NS);
+    size_t start = pos;
+    if (const char *err = scanValue<true>(data, size, pos, &tape_)) bencodeFail(err, pos);
+    metricAdd(METRIC_BENCODE_BYTES, pos - start);
+    return pos;
+}
+
+// Canonical form makes every raw range recoverable from the tape: a string
+// starts 1 + width(length) bytes before its body, an integer spans
+// "i" + sign + width + "e".
+BValue BencodeTape::toValue(size_t i) const {
+    const BencodeTapeEntry &e = tape_[i];
+    BValue v;
+    v.type = e.type;
+    switch (e.type) {
+    case BType::INT: {
+        unsigned long long mag = e.int_val < 0 ? 0ULL - static_cast<unsigned long long>(e.int_val)
+                                               : static_cast<unsigned long long>(e.int_val);
+        v.int_val = e.int_val;
+        v.raw_start = e.offset;
+        v.raw_end = e.offset + 2 + (e.int_val < 0) + decimalWidth(mag);
+        break;
+    }
+    case BType::STRING:
+        v.str_val.assign(data_ + e.offset, e.length);
+        v.raw_start = e.offset - 1 - decimalWidth(e.length);
+        v.raw_end = e.offset + e.length;
+        break;
+    case BType::LIST:
+        for (size_t j = i + 1; j < e.match; j = next(j))
+            v.list_val.push_back(toValue(j));
+        v.raw_start = e.offset;
+        v.raw_end = tape_[e.match].offset + 1;
+        break;
+    case BType::DICT:
+        // keys are already sorted, so every insert lands at the end
+        for (size_t j = i + 1; j < e.match;) {
+            std::string key(string(j));
+            j = next(j);
+            v.dict_val.emplace_hint(v.dict_val.end(), std::move(key), toValue(j));
+            j = next(j);
+        }
+        v.raw_start = e.offset;
+        v.raw_end = tape_[e.match].offset + 1;
+        break;
+    default:
+        throw std::runtime_error("BencodeTape: end marker is not a value");
+    }
+    return v;
+}
+
+// -------- INTEGER --------
+long long decodeInt(const std::string& data, size_t& pos) {
+    long long val;
+    if (const char *err = scanInt(data.data(), data.size(), pos, val)) bencodeFail(err, pos);
+    return val;
+}
 
+// -------- STRING --------
+std::string decodeString(const std::string& data, size_t& pos) {
+    size_t len;
+    if (const char *err = scanLength(data.data(), data.size(), pos, len)) bencodeFail(err, pos);
     std::string s = data.substr(pos, len);
     pos += len;
     return s;
@@ -51,97 +284,25 @@ std::string decodeString(const std::string& data, size_t& pos) {
 BList decodeList(const std::string& data, size_t& pos) {
     if (pos >= data.size() || data[pos] != 'l')
         throw std::runtime_error("decodeList: expected 'l' at position " + std::to_string(pos));
-    pos++; // skip 'l'
-    BList list;
-
-    while (pos < data.size() && data[pos] != 'e') {
-        list.push_back(decodeValue(data, pos));
-    }
-    if (pos >= data.size() || data[pos] != 'e')
-        throw std::runtime_error("decodeList: unterminated list");
-    pos++; // skip 'e'
-    return list;
+    return std::move(decodeValue(data, pos).list_val);
 }
 
 // -------- DICTIONARY --------
 BDict decodeDict(const std::string& data, size_t& pos) {
     if (pos >= data.size() || data[pos] != 'd')
         throw std::runtime_error("decodeDict: expected 'd' at position " + std::to_string(pos));
-    pos++; // skip 'd'
-    BDict dict;
-
-    while (pos < data.size() && data[pos] != 'e') {
-        // Parse key manually (do not use decodeString which returns a BValue with offsets).
-        size_t colon = data.find(':', pos);
-        if (colon == std::string::npos)
-            throw std::runtime_error("decodeDict: malformed key (no colon)");
-
-        // ensure digits only for length
-        for (size_t i = pos; i < colon; ++i)
-            if (!isdigit(static_cast<unsigned char>(data[i])))
-                throw std::runtime_error("decodeDict: invalid key length digits");
-
-        size_t keylen = std::stoul(data.substr(pos, colon - pos));
-        pos = colon + 1;
-
-        if (pos + keylen > data.size())
-            throw std::runtime_error("decodeDict: key length out of range");
-
-        std::string key = data.substr(pos, keylen);
-        pos += keylen;
-
-        BValue val = decodeValue(data, pos);
-        dict.emplace(std::move(key), std::move(val));
-    }
-
-    if (pos >= data.size() || data[pos] != 'e')
-        throw std::runtime_error("decodeDict: unterminated dictionary");
-    pos++; // skip 'e'
-    return dict;
+    return std::move(decodeValue(data, pos).dict_val);
 }
 
 // -------- MASTER DECODER --------
+// Validate and index the value in one pass, then build the tree from the
+// tape without touching the digits again.
 BValue decodeValue(const std::string& data, size_t& pos) {
     if (pos >= data.size())
         throw std::runtime_error("decodeValue: out of range");
-
-    size_t value_start = pos;
-    char c = data[pos];
-
-    if (c == 'i') {
-        long long v = decodeInt(data, pos);
-        BValue value(v);
-        value.raw_start = value_start;
-        value.raw_end = pos;
-        return value;
-    }
-    if (std::isdigit(static_cast<unsigned char>(c))) {
-        std::string s = decodeString(data, pos);
-        BValue value(s);
-        value.raw_start = value_start;
-        value.raw_end = pos;
-        return value;
-    }
-    if (c == 'l') {
-        // mark list start at pos (points to 'l')
-        size_t list_start = pos;
-        BList lst = decodeList(data, pos);
-        BValue value(lst);
-        value.raw_start = list_start;
-        value.raw_end = pos;
-        return value;
-    }
-    if (c == 'd') {
-        // mark dict start at pos (points to 'd')
-        size_t dict_start = pos;
-        BDict d = decodeDict(data, pos);
-        BValue value(d);
-        value.raw_start = dict_start;
-        value.raw_end = pos;
-        return value;
-    }
-
-    throw std::runtime_error("decodeValue: invalid bencode value at position " + std::to_string(pos));
+    BencodeTape tape;
+    pos = tape.build(data.data(), data.size(), pos);
+    return tape.toValue(0);
 }
 
 string bencode_value(const BValue &v) {
@@ -196,59 +357,7 @@ string bencode_value(const BValue &v) {
 
 // skipBencodeValue: advance pos over ONE bencoded value (string, int, list, dict)
 void skipBencodeValue(const std::string &data, size_t &pos) {
-    if (pos >= data.size()) throw std::runtime_error("skipBencodeValue: out of range");
-    char c = data[pos];
-
-    if (c == 'i') {
-        pos++;
-        size_t end = data.find('e', pos);
-        if (end == std::string::npos) throw std::runtime_error("malformed integer");
-        pos = end + 1;
-        return;
-    }
-    if (std::isdigit(static_cast<unsigned char>(c))) {
-        size_t colon = data.find(':', pos);
-        if (colon == std::string::npos) throw std::runtime_error("malformed string");
-        // validate digits
-        for (size_t i = pos; i < colon; ++i)
-            if (!isdigit(static_cast<unsigned char>(data[i])))
-                throw std::runtime_error("malformed string length digits");
-        size_t len = std::stoull(data.substr(pos, colon - pos));
-        pos = colon + 1;
-        if (pos + len > data.size()) throw std::runtime_error("string length out of range");
-        pos += len;
-        return;
-    }
-    if (c == 'l') {
-        pos++;
-        while (pos < data.size() && data[pos] != 'e')
-            skipBencodeValue(data, pos);
-        if (pos >= data.size() || data[pos] != 'e')
-            throw std::runtime_error("unterminated list");
-        pos++;
-        return;
-    }
-    if (c == 'd') {
-        pos++;
-        while (pos < data.size() && data[pos] != 'e') {
-            size_t colon = data.find(':', pos);
-            if (colon == std::string::npos) throw std::runtime_error("malformed dict key");
-            // validate digits
-            for (size_t i = pos; i < colon; ++i)
-                if (!isdigit(static_cast<unsigned char>(data[i])))
-                    throw std::runtime_error("malformed dict key length digits");
-            size_t keylen = std::stoull(data.substr(pos, colon - pos));
-            pos = colon + 1;
-            if (pos + keylen > data.size()) throw std::runtime_error("dict key out of range");
-            pos += keylen;
-            skipBencodeValue(data, pos);
-        }
-        if (pos >= data.size() || data[pos] != 'e')
-            throw std::runtime_error("unterminated dict");
-        pos++;
-        return;
-    }
-    throw std::runtime_error("skipBencodeValue: unknown token at " + std::to_string(pos));
+    if (const char *err = bencodeValidate(data.data(), data.size(), pos)) bencodeFail(err, pos);
 }
 
 std::pair<size_t, size_t> findInfoValueRange(const std::string& data) {
@@ -257,19 +366,12 @@ std::pair<size_t, size_t> findInfoValueRange(const std::string& data) {
     pos++; // skip root 'd'
 
     while (pos < data.size() && data[pos] != 'e') {
-        size_t colon = data.find(':', pos);
-        if (colon == std::string::npos) throw std::runtime_error("Invalid key (no colon)");
-        // validate digits for key length
-        for (size_t i = pos; i < colon; ++i)
-            if (!isdigit(static_cast<unsigned char>(data[i])))
-                throw std::runtime_error("Invalid key length digits in root dictionary");
-        size_t key_len = std::stoull(data.substr(pos, colon - pos));
-        pos = colon + 1;
-        if (pos + key_len > data.size()) throw std::runtime_error("Invalid key length (out of range)");
-        std::string key = data.substr(pos, key_len);
+        size_t key_len;
+        if (const char *err = scanLength(data.data(), data.size(), pos, key_len)) bencodeFail(err, pos);
+        bool is_info = data.compare(pos, key_len, "info") == 0;
         pos += key_len;
 
-        if (key == "info") {
+        if (is_info) {
             size_t start = pos;
             size_t end = pos;
             // skip the value into 'end' so it points just after the end of the value
@@ -281,3 +383,57 @@ std::pair<size_t, size_t> findInfoValueRange(const std::string& data) {
     }
     throw std::runtime_error("Key 'info' not found in torrent file");
 }
+
+// -------- STREAMING READER --------
+void BencodeReader::fail(const char *what) const {
+    bencodeFail(what, pos_);
+}
+
+BType BencodeReader::peek() const {
+    if (pos_ >= size_) fail("unexpected end of data");
+    char c = data_[pos_];
+    if (c == 'i') return BType::INT;
+    if (c == 'l') return BType::LIST;
+    if (c == 'd') return BType::DICT;
+    if (c >= '0' && c <= '9') return BType::STRING;
+    if (c == 'e') return BType::NONE;
+    fail("invalid token");
+}
+
+long long BencodeReader::readInt() {
+    long long v;
+    if (const char *err = scanInt(data_, size_, pos_, v)) fail(err);
+    return v;
+}
+
+std::string_view BencodeReader::readString() {
+    size_t len;
+    if (const char *err = scanLength(data_, size_, pos_, len)) fail(err);
+    std::string_view s(data_ + pos_, len);
+    pos_ += len;
+    return s;
+}
+
+void BencodeReader::enterList() {
+    if (pos_ >= size_ || data_[pos_] != 'l') fail("expected list");
+    ++pos_;
+}
+
+void BencodeReader::enterDict() {
+    if (pos_ >= size_ || data_[pos_] != 'd') fail("expected dictionary");
+    ++pos_;
+}
+
+bool BencodeReader::more() {
+    if (pos_ >= size_) fail("unterminated list or dictionary");
+    if (data_[pos_] != 'e') return true;
+    ++pos_;
+    return false;
+}
+
+std::string_view BencodeReader::skip() {
+    size_t start = pos_;
+    // uninstrumented: these bytes are already counted by the caller's validate
+    if (const char *err = scanValue<false>(data_, size_, pos_, nullptr)) fail(err);
+    return std::string_view(data_ + start, pos_ - start);
+}
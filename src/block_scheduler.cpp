@@ -0,0 +1,355 @@
+#include "../include/block_scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+// Time constant of the per-peer delivery rate estimate
+static const double RATE_TAU = 0.5;
+
+BlockScheduler::BlockScheduler(const FileStorage &storage, std::vector<uint8_t> piece_priorities,
+                               BlockSchedulerOptions opts)
+    : storage_(storage), prio_(std::move(piece_priorities)), opts_(opts), pieces_(storage.numPieces()),
+      piece_size_(storage.numPieces()), availability_(storage.numPieces(), 0), rng_(opts.seed) {
+    for (size_t p = 0; p < pieces_.size(); ++p) {
+        piece_size_[p] = static_cast<uint32_t>(storage.pieceSize(p));
+        if (wanted(p)) ++remaining_;
+    }
+    unstarted_ = remaining_;
+}
+
+size_t BlockScheduler::blocksInPiece(size_t piece) const {
+    return (piece_size_[piece] + PEER_BLOCK_SIZE - 1) / PEER_BLOCK_SIZE;
+}
+
+uint32_t BlockScheduler::blockLength(size_t piece, size_t block) const {
+    return min(PEER_BLOCK_SIZE, piece_size_[piece] - static_cast<uint32_t>(block) * PEER_BLOCK_SIZE);
+}
+
+// ------------------------------
+// Peers
+// ------------------------------
+size_t BlockScheduler::addPeer() {
+    PeerState p;
+    p.have.assign(pieces_.size(), false);
+    peers_.push_back(std::move(p));
+    return peers_.size() - 1;
+}
+
+void BlockScheduler::removePeer(size_t peer) {
+    setChoked(peer, true);
+    PeerState &ps = peers_[peer];
+    for (size_t p = 0; p < ps.have.size(); ++p)
+        if (ps.have[p]) --availability_[p];
+    ps.have.assign(ps.have.size(), false);
+    ps.connected = false;
+}
+
+void BlockScheduler::setBitfield(size_t peer, const std::vector<bool> &have) {
+    PeerState &ps = peers_[peer];
+    if (have.size() != ps.have.size()) throw runtime_error("Bitfield size does not match the torrent");
+    for (size_t p = 0; p < have.size(); ++p) {
+        if (ps.have[p] == have[p]) continue;
+        if (have[p]) ++availability_[p];
+        else --availability_[p];
+    }
+    ps.have = have;
+}
+
+void BlockScheduler::peerHas(size_t peer, size_t piece) {
+    PeerState &ps = peers_[peer];
+    if (piece >= ps.have.size() || ps.have[piece]) return;
+    ps.have[piece] = true;
+    ++availability_[piece];
+}
+
+void BlockScheduler::setChoked(size_t peer, bool choked) {
+    PeerState &ps = peers_[peer];
+    ps.choked = choked;
+    if (!choked) return;
+    vector<Pending> pending;
+    pending.swap(ps.outstanding);
+    for (auto &r : pending) releaseBlock(peer, r.block);
+}
+
+bool BlockScheduler::interesting(size_t peer) const {
+    const PeerState &ps = peers_[peer];
+    for (size_t p = 0; p < pieces_.size(); ++p)
+        if (ps.have[p] && wanted(p)) return true;
+    return false;
+}
+
+size_t BlockScheduler::queueDepth(size_t peer) const {
+    const PeerState &ps = peers_[peer];
+    if (ps.snubbed) return 1;
+    if (opts_.fixed_depth) return opts_.fixed_depth;
+    if (ps.rate <= 0 || ps.min_rtt <= 0) return BLOCK_QUEUE_START;
+    double bdp = BLOCK_QUEUE_HEADROOM * ps.rate * ps.min_rtt / PEER_BLOCK_SIZE;
+    size_t depth = static_cast<size_t>(ceil(bdp)) + 1;
+    return min(max(depth, BLOCK_QUEUE_MIN), BLOCK_QUEUE_MAX);
+}
+
+// ------------------------------
+// Block state
+// ------------------------------
+void BlockScheduler::startPiece(size_t piece) {
+    PieceState &st = pieces_[piece];
+    st.blocks.assign(blocksInPiece(piece), BLOCK_FREE);
+    st.requested = st.received = 0;
+    st.started = true;
+    partial_.push_back(piece);
+    --unstarted_;
+}
+
+void BlockScheduler::setBlock(size_t piece, size_t block, BlockState state) {
+    PieceState &st = pieces_[piece];
+    uint8_t &b = st.blocks[block];
+    if (b == BLOCK_REQUESTED) --st.requested;
+    else if (b == BLOCK_RECEIVED) --st.received;
+    b = state;
+    if (state == BLOCK_REQUESTED) ++st.requested;
+    else if (state == BLOCK_RECEIVED) ++st.received;
+}
+
+bool BlockScheduler::requestedByOther(size_t peer, const BlockRequest &block) const {
+    for (size_t q = 0; q < peers_.size(); ++q) {
+        if (q == peer || peers_[q].snubbed) continue;
+        for (auto &r : peers_[q].outstanding)
+            if (r.block == block) return true;
+    }
+    return false;
+}
+
+void BlockScheduler::releaseBlock(size_t peer, const BlockRequest &block) {
+    PieceState &st = pieces_[block.piece];
+    if (!st.started || st.have) return;
+    size_t b = block.begin / PEER_BLOCK_SIZE;
+    if (st.blocks[b] == BLOCK_REQUESTED && !requestedByOther(peer, block)) setBlock(block.piece, b, BLOCK_FREE);
+}
+
+// ------------------------------
+// Requests
+// ------------------------------
+// Rarest piece the peer has that nobody has started, random among equals
+size_t BlockScheduler::pickPiece(size_t peer) {
+    const PeerState &ps = peers_[peer];
+    size_t best = SIZE_MAX;
+    uint32_t best_avail = 0;
+    size_t ties = 0;
+    for (size_t p = 0; p < pieces_.size(); ++p) {
+        if (!ps.have[p] || pieces_[p].started || !wanted(p)) continue;
+        uint32_t a = availability_[p];
+        if (best == SIZE_MAX || a < best_avail) {
+            best = p;
+            best_avail = a;
+            ties = 1;
+        } else if (a == best_avail && uniform_int_distribution<size_t>(0, ties++)(rng_) == 0) {
+            best = p;
+        }
+    }
+    return best;
+}
+
+void BlockScheduler::request(size_t peer, size_t piece, size_t block, double now, std::vector<BlockRequest> &out) {
+    BlockRequest r;
+    r.piece = static_cast<uint32_t>(piece);
+    r.begin = static_cast<uint32_t>(block) * PEER_BLOCK_SIZE;
+    r.length = blockLength(piece, block);
+    if (pieces_[piece].blocks[block] == BLOCK_FREE) setBlock(piece, block, BLOCK_REQUESTED);
+    peers_[peer].outstanding.push_back(Pending{r, now});
+    out.push_back(r);
+}
+
+std::vector<BlockRequest> BlockScheduler::requestsFor(size_t peer, double now) {
+    vector<BlockRequest> out;
+    PeerState &ps = peers_[peer];
+    if (!ps.connected || ps.choked) return out;
+    size_t depth = queueDepth(peer);
+    if (ps.outstanding.size() >= depth) return out;
+    size_t need = depth - ps.outstanding.size();
+
+    // 1. free blocks of pieces already started
+    for (size_t p : partial_) {
+        if (!ps.have[p]) continue;
+        PieceState &st = pieces_[p];
+        if (st.requested + st.received == st.blocks.size()) continue;
+        for (size_t b = 0; b < st.blocks.size() && need; ++b) {
+            if (st.blocks[b] != BLOCK_FREE) continue;
+            request(peer, p, b, now, out);
+            --need;
+        }
+        if (!need) return out;
+    }
+
+    // 2. new pieces, rarest first
+    while (need) {
+        size_t p = pickPiece(peer);
+        if (p == SIZE_MAX) break;
+        startPiece(p);
+        size_t blocks = pieces_[p].blocks.size();
+        for (size_t b = 0; b < blocks && need; ++b, --need) request(peer, p, b, now, out);
+    }
+    if (!need) return out;
+
+    // 3. endgame: nothing is left unrequested, so double up on blocks other
+    //    peers are still holding
+    endgame_ = unstarted_ == 0;
+    for (size_t p : partial_) {
+        const PieceState &st = pieces_[p];
+        if (st.requested + st.received != st.blocks.size()) endgame_ = false;
+    }
+    if (!endgame_ || !opts_.endgame) return out;
+    for (size_t p : partial_) {
+        if (!ps.have[p]) continue;
+        const PieceState &st = pieces_[p];
+        for (size_t b = 0; b < st.blocks.size() && need; ++b) {
+            if (st.blocks[b] != BLOCK_REQUESTED) continue;
+            BlockRequest r;
+            r.piece = static_cast<uint32_t>(p);
+            r.begin = static_cast<uint32_t>(b) * PEER_BLOCK_SIZE;
+            bool mine = false;
+            for (auto &o : ps.outstanding)
+                if (o.block == r) mine = true;
+            if (mine) continue;
+            request(peer, p, b, now, out);
+            ++endgame_requests_;
+            --need;
+        }
+        if (!need) break;
+    }
+    return out;
+}
+
+bool BlockScheduler::blockReceived(size_t peer, const BlockRequest &block, double now,
+                                   std::vector<std::pair<size_t, BlockRequest>> &cancel) {
+    PeerState &ps = peers_[peer];
+    for (size_t i = 0; i < ps.outstanding.size(); ++i) {
+        if (!(ps.outstanding[i].block == block)) continue;
+        double rtt = now - ps.outstanding[i].sent;
+        // Only the minimum: later samples include the wait behind our own
+        // queued requests, and following them would grow the queue without end.
+        if (ps.min_rtt <= 0 || rtt < ps.min_rtt) ps.min_rtt = rtt;
+        ps.outstanding.erase(ps.outstanding.begin() + static_cast<ptrdiff_t>(i));
+        break;
+    }
+    ps.rate = ps.rate * exp(-(now - ps.rate_time) / RATE_TAU) + block.length / RATE_TAU;
+    ps.rate_time = now;
+    ps.last_block = now;
+    ps.snubbed = false;
+
+    if (block.piece >= pieces_.size()) return false;
+    PieceState &st = pieces_[block.piece];
+    size_t b = block.begin / PEER_BLOCK_SIZE;
+    if (st.have || !st.started || block.begin % PEER_BLOCK_SIZE != 0 || b >= st.blocks.size() ||
+        block.length != blockLength(block.piece, b))
+        return false;
+    if (st.blocks[b] == BLOCK_RECEIVED) {
+        ++duplicates_;
+        return false;
+    }
+    setBlock(block.piece, b, BLOCK_RECEIVED);
+
+    for (size_t q = 0; q < peers_.size(); ++q) {
+        if (q == peer) continue;
+        auto &out = peers_[q].outstanding;
+        for (size_t i = 0; i < out.size(); ++i) {
+            if (!(out[i].block == block)) continue;
+            cancel.emplace_back(q, out[i].block);
+            out.erase(out.begin() + static_cast<ptrdiff_t>(i));
+            ++cancels_;
+            break;
+        }
+    }
+    return true;
+}
+
+void BlockScheduler::requestRejected(size_t peer, const BlockRequest &block) {
+    auto &out = peers_[peer].outstanding;
+    for (size_t i = 0; i < out.size(); ++i) {
+        if (!(out[i].block == block)) continue;
+        out.erase(out.begin() + static_cast<ptrdiff_t>(i));
+        releaseBlock(peer, block);
+        return;
+    }
+}
+
+// ------------------------------
+// Pieces
+// ------------------------------
+std::vector<uint8_t> BlockScheduler::receivedBlocks(size_t piece) const {
+    const PieceState &st = pieces_[piece];
+    vector<uint8_t> mask;
+    if (!st.started) return mask;
+    mask.assign((st.blocks.size() + 7) / 8, 0);
+    for (size_t b = 0; b < st.blocks.size(); ++b)
+        if (st.blocks[b] == BLOCK_RECEIVED) mask[b / 8] |= static_cast<uint8_t>(0x80 >> (b % 8));
+    return mask;
+}
+
+void BlockScheduler::restoreBlocks(size_t piece, const std::vector<uint8_t> &mask) {
+    PieceState &st = pieces_[piece];
+    if (st.have || !wanted(piece)) return;
+    if (!st.started) startPiece(piece);
+    for (size_t b = 0; b < st.blocks.size() && b / 8 < mask.size(); ++b)
+        if ((mask[b / 8] >> (7 - b % 8)) & 1) setBlock(piece, b, BLOCK_RECEIVED);
+}
+
+bool BlockScheduler::pieceComplete(size_t piece) const {
+    const PieceState &st = pieces_[piece];
+    return st.started && st.received == st.blocks.size();
+}
+
+void BlockScheduler::pieceVerified(size_t piece) {
+    PieceState &st = pieces_[piece];
+    if (st.have) return;
+    if (wanted(piece)) {
+        --remaining_;
+        if (!st.started) --unstarted_;
+    }
+    st.have = true;
+    if (st.started) partial_.erase(find(partial_.begin(), partial_.end(), piece));
+    st.started = false;
+    vector<uint8_t>().swap(st.blocks);
+    st.requested = st.received = 0;
+    for (auto &ps : peers_) {
+        ps.outstanding.erase(remove_if(ps.outstanding.begin(), ps.outstanding.end(),
+                                       [&](const Pending &r) { return r.block.piece == piece; }),
+                             ps.outstanding.end());
+    }
+}
+
+void BlockScheduler::pieceFailed(size_t piece) {
+    PieceState &st = pieces_[piece];
+    if (!st.started) return;
+    for (size_t b = 0; b < st.blocks.size(); ++b) st.blocks[b] = BLOCK_FREE;
+    st.requested = st.received = 0;
+}
+
+void BlockScheduler::tick(double now) {
+    for (size_t peer = 0; peer < peers_.size(); ++peer) {
+        PeerState &ps = peers_[peer];
+        if (!ps.connected) continue;
+        // decay here too, or a peer that stops delivering keeps its last rate
+        if (now > ps.rate_time) {
+            ps.rate *= exp(-(now - ps.rate_time) / RATE_TAU);
+            ps.rate_time = now;
+        }
+        if (ps.snubbed || ps.outstanding.empty()) continue;
+        // waiting since the last block, or since the oldest request if later
+        double oldest = now;
+        for (auto &r : ps.outstanding) oldest = min(oldest, r.sent);
+        double since = max(ps.last_block, oldest);
+        if (now - since <= opts_.snub_timeout) continue;
+
+        ps.snubbed = true;
+        for (auto &r : ps.outstanding) {
+            PieceState &st = pieces_[r.block.piece];
+            size_t b = r.block.begin / PEER_BLOCK_SIZE;
+            if (!st.started || st.blocks[b] != BLOCK_REQUESTED || requestedByOther(peer, r.block)) continue;
+            setBlock(r.block.piece, b, BLOCK_FREE);
+            ++reassigned_;
+        }
+    }
+}
@@ -0,0 +1,325 @@
+#include "../include/creator.h"
+#include "../include/bencode.h"
+#include "../include/merkle.h"
+#include "../include/sha1.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Read chunks are whole pieces and at least this large.
+static const size_t CREATE_CHUNK_SIZE = 8 << 20;
+
+// One file (or pad file) in v1 stream order
+class CreateEntry {
+public:
+    fs::path disk_path;
+    vector<string> path;
+    int64_t length = 0;
+    uint64_t offset = 0;               // position in the concatenated v1 stream
+    bool pad = false;
+    vector<uint8_t> pieces_root;       // v2 results, filled by the workers
+    vector<uint8_t> piece_layer;
+};
+
+class CreateChunk {
+public:
+    vector<uint8_t> buf;
+    uint64_t offset = 0;
+    size_t len = 0;
+};
+
+// Minimal blocking queue used to pass chunks between the reader and the workers
+template <typename T>
+class ChunkQueue {
+public:
+    void push(T v) {
+        {
+            lock_guard<mutex> lk(m_);
+            q_.push(std::move(v));
+        }
+        cv_.notify_one();
+    }
+
+    T pop() {
+        unique_lock<mutex> lk(m_);
+        cv_.wait(lk, [this] { return !q_.empty(); });
+        T v = std::move(q_.front());
+        q_.pop();
+        return v;
+    }
+
+private:
+    mutex m_;
+    condition_variable cv_;
+    queue<T> q_;
+};
+
+static vector<CreateEntry> collectFiles(const fs::path &root, bool single) {
+    vector<CreateEntry> entries;
+    if (single) {
+        CreateEntry e;
+        e.disk_path = root;
+        e.path.push_back(root.filename().string());
+        e.length = static_cast<int64_t>(fs::file_size(root));
+        entries.push_back(e);
+        return entries;
+    }
+
+    for (auto &de : fs::recursive_directory_iterator(root)) {
+        if (!de.is_regular_file()) continue;
+        CreateEntry e;
+        e.disk_path = de.path();
+        for (auto &part : fs::relative(de.path(), root)) e.path.push_back(part.string());
+        e.length = static_cast<int64_t>(de.file_size());
+        entries.push_back(e);
+    }
+    // byte-wise order of path components, same as the v2 file tree
+    sort(entries.begin(), entries.end(),
+         [](const CreateEntry &a, const CreateEntry &b) { return a.path < b.path; });
+    return entries;
+}
+
+// Lay files out in the v1 stream, inserting BEP 47 pad files in hybrid mode so
+// every file starts on a piece boundary and v1 and v2 pieces line up.
+static vector<CreateEntry> layoutStream(vector<CreateEntry> files, int64_t piece_length, bool v2,
+                                        uint64_t &total) {
+    vector<CreateEntry> out;
+    total = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        files[i].offset = total;
+        total += static_cast<uint64_t>(files[i].length);
+        out.push_back(files[i]);
+
+        int64_t tail = files[i].length % piece_length;
+        if (v2 && tail != 0 && i + 1 < files.size()) {
+            CreateEntry pad;
+            pad.pad = true;
+            pad.length = piece_length - tail;
+            pad.path = {".pad", to_string(pad.length)};
+            pad.offset = total;
+            total += static_cast<uint64_t>(pad.length);
+            out.push_back(pad);
+        }
+    }
+    return out;
+}
+
+// Hash one chunk: v1 piece hashes, plus v2 piece-layer hashes (or the whole
+// root for files no bigger than a piece) for every file the chunk covers.
+static void hashChunk(const CreateChunk &c, int64_t piece_length, bool v2,
+                      vector<CreateEntry> &entries, vector<uint8_t> &pieces) {
+    size_t pl = static_cast<size_t>(piece_length);
+    size_t first_piece = static_cast<size_t>(c.offset / pl);
+    for (size_t off = 0; off < c.len; off += pl) {
+        sha1_raw(c.buf.data() + off, min(pl, c.len - off), &pieces[(first_piece + off / pl) * 20]);
+    }
+    if (!v2) return;
+
+    const vector<uint8_t> zero(MERKLE_HASH_SIZE, 0);
+    size_t blocks_per_piece = pl / MERKLE_BLOCK_SIZE;
+    uint64_t chunk_end = c.offset + c.len;
+
+    auto it = upper_bound(entries.begin(), entries.end(), c.offset,
+                          [](uint64_t o, const CreateEntry &e) { return o < e.offset; });
+    if (it != entries.begin()) --it;
+
+    for (; it != entries.end() && it->offset < chunk_end; ++it) {
+        CreateEntry &e = *it;
+        if (e.pad || e.length == 0) continue;
+        uint64_t file_end = e.offset + static_cast<uint64_t>(e.length);
+        uint64_t start = max(e.offset, c.offset);
+        uint64_t end = min(file_end, chunk_end);
+        if (start >= end) continue;
+        const uint8_t *base = c.buf.data() + (start - c.offset);
+
+        if (e.length <= piece_length) {
+            // the whole file is in this chunk
+            vector<uint8_t> leaves = merkleHashBlocks(base, static_cast<size_t>(end - start));
+            e.pieces_root = merkleRoot(leaves, merkleNumLeaves(leaves.size() / MERKLE_HASH_SIZE), zero);
+            continue;
+        }
+        for (uint64_t p = start; p < end; p += pl) {
+            size_t n = static_cast<size_t>(min<uint64_t>(pl, end - p));
+            vector<uint8_t> leaves = merkleHashBlocks(base + (p - start), n);
+            vector<uint8_t> h = merkleRoot(leaves, blocks_per_piece, zero);
+            memcpy(&e.piece_layer[((p - e.offset) / pl) * MERKLE_HASH_SIZE], h.data(), MERKLE_HASH_SIZE);
+        }
+    }
+}
+
+// Reader side of the pipeline: fill chunks from the files in stream order
+static void readStream(vector<CreateEntry> &entries, uint64_t total, size_t chunk_size,
+                       ChunkQueue<CreateChunk> &free_q, ChunkQueue<CreateChunk> &work_q) {
+    size_t idx = 0;
+    int64_t in_file = 0;
+    ifstream file;
+
+    for (uint64_t offset = 0; offset < total; offset += chunk_size) {
+        CreateChunk c = free_q.pop();
+        c.offset = offset;
+        c.len = static_cast<size_t>(min<uint64_t>(chunk_size, total - offset));
+
+        size_t filled = 0;
+        while (filled < c.len) {
+            CreateEntry &e = entries[idx];
+            size_t n = static_cast<size_t>(min<int64_t>(e.length - in_file, static_cast<int64_t>(c.len - filled)));
+            if (e.pad) {
+                memset(c.buf.data() + filled, 0, n);
+            } else if (n > 0) {
+                if (!file.is_open()) {
+                    file.open(e.disk_path, ios::binary);
+                    if (!file) throw runtime_error("Cannot open " + e.disk_path.string());
+                }
+                if (!file.read(reinterpret_cast<char *>(c.buf.data() + filled), static_cast<streamsize>(n)))
+                    throw runtime_error("Short read (file changed?): " + e.disk_path.string());
+            }
+            filled += n;
+            in_file += static_cast<int64_t>(n);
+            if (in_file == e.length) {
+                if (file.is_open()) file.close();
+                in_file = 0;
+                ++idx;
+            }
+        }
+        work_q.push(std::move(c));
+    }
+}
+
+static void insertFileTree(BDict &tree, const CreateEntry &e) {
+    BDict *node = &tree;
+    for (auto &part : e.path) {
+        BValue &child = (*node)[part];
+        if (!child.isDict()) child = BValue(BDict());
+        node = &child.dict_val;
+    }
+    BDict leaf;
+    leaf["length"] = BValue(static_cast<long long>(e.length));
+    if (!e.pieces_root.empty())
+        leaf["pieces root"] = BValue(string(e.pieces_root.begin(), e.pieces_root.end()));
+    (*node)[""] = BValue(leaf);
+}
+
+// ------------------------------
+// CreateTorrent implementation
+// ------------------------------
+std::string CreateTorrent(const std::string &path, const CreateOptions &opts) {
+    int64_t pl = opts.piece_length;
+    if (pl < static_cast<int64_t>(MERKLE_BLOCK_SIZE) || (pl & (pl - 1)) != 0)
+        throw runtime_error("Piece length must be a power of two >= 16 KiB");
+
+    fs::path root = fs::absolute(path).lexically_normal();
+    if (!root.has_filename()) root = root.parent_path();
+    if (!fs::exists(root)) throw runtime_error("No such file or directory: " + path);
+    bool single = fs::is_regular_file(root);
+
+    uint64_t total = 0;
+    vector<CreateEntry> entries = layoutStream(collectFiles(root, single), pl, opts.v2, total);
+    if (total == 0) throw runtime_error("Nothing to hash: all files are empty");
+
+    size_t piece_count = static_cast<size_t>((total + pl - 1) / pl);
+    vector<uint8_t> pieces(piece_count * 20);
+    for (auto &e : entries) {
+        if (opts.v2 && !e.pad && e.length > pl)
+            e.piece_layer.resize(static_cast<size_t>((e.length + pl - 1) / pl) * MERKLE_HASH_SIZE);
+    }
+
+    // --- pipeline: this thread reads, workers hash ---
+    unsigned threads = opts.threads ? opts.threads : max(1u, thread::hardware_concurrency());
+    size_t chunk_size = max(static_cast<size_t>(pl), CREATE_CHUNK_SIZE - CREATE_CHUNK_SIZE % static_cast<size_t>(pl));
+    ChunkQueue<CreateChunk> free_q, work_q;
+    for (unsigned i = 0; i < threads + 2; ++i) {
+        CreateChunk c;
+        c.buf.resize(chunk_size);
+        free_q.push(std::move(c));
+    }
+
+    mutex err_m;
+    exception_ptr err;
+    vector<thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&]() {
+            for (;;) {
+                CreateChunk c = work_q.pop();
+                if (c.len == 0) return;  // end of stream
+                try {
+                    hashChunk(c, pl, opts.v2, entries, pieces);
+                } catch (...) {
+                    lock_guard<mutex> lk(err_m);
+                    if (!err) err = current_exception();
+                }
+                free_q.push(std::move(c));
+            }
+        });
+    }
+
+    try {
+        readStream(entries, total, chunk_size, free_q, work_q);
+    } catch (...) {
+        lock_guard<mutex> lk(err_m);
+        if (!err) err = current_exception();
+    }
+    for (unsigned t = 0; t < threads; ++t) work_q.push(CreateChunk());
+    for (auto &w : workers) w.join();
+    if (err) rethrow_exception(err);
+
+    // --- assemble the metainfo ---
+    BDict info;
+    info["name"] = BValue(root.filename().string());
+    info["piece length"] = BValue(static_cast<long long>(pl));
+    info["pieces"] = BValue(string(pieces.begin(), pieces.end()));
+
+    if (single) {
+        info["length"] = BValue(static_cast<long long>(entries[0].length));
+    } else {
+        BList files;
+        for (auto &e : entries) {
+            BDict fd;
+            fd["length"] = BValue(static_cast<long long>(e.length));
+            BList p;
+            for (auto &part : e.path) p.push_back(BValue(part));
+            fd["path"] = BValue(p);
+            if (e.pad) fd["attr"] = BValue("p");
+            files.push_back(BValue(fd));
+        }
+        info["files"] = BValue(files);
+    }
+
+    BDict torrent;
+    if (opts.v2) {
+        const vector<uint8_t> pad = merklePadHash(static_cast<size_t>(pl) / MERKLE_BLOCK_SIZE);
+        BDict tree, layers;
+        for (auto &e : entries) {
+            if (e.pad) continue;
+            if (!e.piece_layer.empty()) {
+                e.pieces_root = merkleRoot(e.piece_layer, merkleNumLeaves(e.piece_layer.size() / MERKLE_HASH_SIZE), pad);
+                layers[string(e.pieces_root.begin(), e.pieces_root.end())] =
+                    BValue(string(e.piece_layer.begin(), e.piece_layer.end()));
+            }
+            insertFileTree(tree, e);
+        }
+        info["meta version"] = BValue(2LL);
+        info["file tree"] = BValue(tree);
+        torrent["piece layers"] = BValue(layers);
+    }
+
+    if (!opts.announce.empty()) torrent["announce"] = BValue(opts.announce);
+    if (!opts.comment.empty()) torrent["comment"] = BValue(opts.comment);
+    torrent["created by"] = BValue(opts.created_by);
+    torrent["creation date"] = BValue(static_cast<long long>(time(nullptr)));
+    torrent["info"] = BValue(info);
+
+    return bencode_value(BValue(torrent));
+}
@@ -0,0 +1,603 @@
+#include "../include/daemon.h"
+#include "../include/magnet_parser.h"
+#include "../include/metrics.h"
+#include "../include/parser.h"
+#include "../include/resume.h"
+#include "../include/storage.h"
+#include "../include/torrent_index.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+std::string DefaultDaemonSocket() {
+    if (const char *env = getenv("PEERSTORM_SOCKET")) return env;
+    if (const char *run = getenv("XDG_RUNTIME_DIR")) return string(run) + "/peerstorm.sock";
+#ifdef _WIN32
+    return "peerstorm.sock";
+#else
+    return "/tmp/peerstorm-" + to_string(getuid()) + ".sock";
+#endif
+}
+
+// -------- FRAMING --------
+static void appendFrame(string &out, const BDict &msg) {
+    string body = bencode_value(BValue(msg));
+    uint32_t n = static_cast<uint32_t>(body.size());
+    char len[4] = {static_cast<char>(n >> 24), static_cast<char>(n >> 16), static_cast<char>(n >> 8),
+                   static_cast<char>(n)};
+    out.append(len, 4);
+    out += body;
+}
+
+// Decode the frame at buf[pos] if it is complete; false if more bytes are
+// needed. Throws on an oversized or malformed frame.
+static bool takeFrame(const string &buf, size_t &pos, BDict &msg) {
+    if (buf.size() - pos < 4) return false;
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(buf.data() + pos);
+    size_t n = (size_t(p[0]) << 24) | (size_t(p[1]) << 16) | (size_t(p[2]) << 8) | size_t(p[3]);
+    if (n > DAEMON_MAX_FRAME) throw runtime_error("frame too large");
+    if (buf.size() - pos - 4 < n) return false;
+
+    size_t at = pos + 4;
+    BValue v = decodeValue(buf, at);
+    if (at != pos + 4 + n || !v.isDict()) throw runtime_error("malformed frame");
+    msg = std::move(v.dict_val);
+    pos = at;
+    return true;
+}
+
+// -------- SESSION --------
+static const string &field(const BDict &d, const char *key) {
+    auto it = d.find(key);
+    if (it == d.end()) throw runtime_error(string("missing \"") + key + "\"");
+    return it->second.asString();
+}
+
+static string optionalField(const BDict &d, const char *key) {
+    auto it = d.find(key);
+    return it == d.end() ? string() : it->second.asString();
+}
+
+static string hashString(const InfoHash &h) {
+    return string(reinterpret_cast<const char *>(h.bytes.data()), h.bytes.size());
+}
+
+class DaemonTorrent {
+public:
+    string save_path;
+    unique_ptr<FileStorage> storage;   // built on first verify; points into the registry's metadata
+    unique_ptr<ResumeData> resume;     // loaded from disk on first verify, then kept current here
+    long long have = -1;               // -1 until verified
+    bool verifying = false;            // a worker owns storage and resume until it finishes
+};
+
+// A verify running on its own thread. The torrent cannot be removed
+// meanwhile, so the metadata, storage and resume data it points to stay put.
+class VerifyJob {
+public:
+    uint64_t conn = 0;                 // connection to answer
+    TorrentHandle handle = INVALID_TORRENT_HANDLE;
+    BDict resp;                        // "id" already set
+    uint64_t start = 0;                // metricNow() when the request arrived
+    VerifySummary sum;
+    string error;
+    bool done = false;                 // guarded by DaemonSession::jobs_m_
+    thread worker;
+};
+
+class DaemonSession {
+public:
+    // `wake` is called from a worker thread whenever a verify finishes.
+    DaemonSession(const DaemonOptions &opts, function<void()> wake)
+        : writer_(opts.resume_dir, chrono::seconds(30)), wake_(std::move(wake)) {}
+    ~DaemonSession() { waitForJobs(); }
+
+    // False when the response comes later from finishedJobs() (verify).
+    bool handle(const BDict &req, uint64_t conn, BDict &resp);
+    // Responses of finished verifies, with the connection each is for
+    vector<pair<uint64_t, BDict>> finishedJobs();
+    bool stopping() const { return stop_; }
+    bool busy() const { return !jobs_.empty(); }
+    void waitForJobs();
+
+private:
+    void add(const BDict &req, BDict &resp);
+    void remove(const BDict &req);
+    void status(const BDict &req, BDict &resp);
+    void verify(const BDict &req, BDict &resp, uint64_t conn, uint64_t start);
+    void stats(const BDict &req, BDict &resp);
+
+    TorrentHandle lookup(const BDict &req) const;
+    BDict describe(TorrentHandle h) const;
+
+    TorrentRegistry registry_;
+    vector<DaemonTorrent> torrents_;   // indexed by handle
+    ResumeWriter writer_;
+    function<void()> wake_;
+    mutex jobs_m_;
+    vector<unique_ptr<VerifyJob>> jobs_;
+    bool stop_ = false;
+};
+
+void DaemonSession::waitForJobs() {
+    for (auto &j : jobs_)
+        if (j->worker.joinable()) j->worker.join();
+}
+
+bool DaemonSession::handle(const BDict &req, uint64_t conn, BDict &resp) {
+    const uint64_t start = metricNow();
+    metricAdd(METRIC_DAEMON_REQUESTS);
+    auto id = req.find("id");
+    if (id != req.end() && id->second.isInt()) resp["id"] = id->second;
+
+    try {
+        const string &op = field(req, "op");
+        if (op == "verify") {
+            verify(req, resp, conn, start);
+            return false;
+        }
+        if (op == "add") add(req, resp);
+        else if (op == "remove") remove(req);
+        else if (op == "status") status(req, resp);
+        else if (op == "stats") stats(req, resp);
+        else if (op == "shutdown") stop_ = true;
+        else throw runtime_error("unknown op \"" + op + "\"");
+        resp["ok"] = BValue(1LL);
+    } catch (const exception &e) {
+        resp["ok"] = BValue(0LL);
+        resp["error"] = BValue(string(e.what()));
+        metricAdd(METRIC_DAEMON_ERRORS);
+    }
+    metricRecord(METRIC_DAEMON_REQUEST_NS, metricNow() - start);
+    return true;
+}
+
+TorrentHandle DaemonSession::lookup(const BDict &req) const {
+    const string &hash = field(req, "info-hash");
+    if (hash.size() != 20) throw runtime_error("info-hash must be 20 bytes");
+    TorrentHandle h = registry_.find(InfoHash(reinterpret_cast<const uint8_t *>(hash.data())));
+    if (h == INVALID_TORRENT_HANDLE) throw runtime_error("unknown torrent");
+    return h;
+}
+
+void DaemonSession::add(const BDict &req, BDict &resp) {
+    TorrentHandle h;
+    bool existed;
+    if (req.count("magnet")) {
+        string link = field(req, "magnet");
+        MagnetData magnet = ParseMagnet(link);
+        existed = registry_.find(InfoHash(magnet.info_hash_bytes)) != INVALID_TORRENT_HANDLE;
+        h = registry_.addMagnet(std::move(magnet));
+    } else {
+        string path = field(req, "path");
+        TorrentMetadata meta = ParseFile(path);
+        h = registry_.find(InfoHash(meta.info_hash));
+        existed = h != INVALID_TORRENT_HANDLE;
+        // Same info hash means the same info dict: keep the loaded copy, and
+        // with it the cached storage map and verification state. Only a
+        // magnet-only entry gets the metadata attached.
+        const TorrentEntry *prev = existed ? registry_.get(h) : nullptr;
+        if (!prev || !prev->meta) {
+            // a hybrid may fold the entry of its v2 hash into this one
+            TorrentHandle h2 = meta.info_hash_v2.empty() ? INVALID_TORRENT_HANDLE
+                                                         : registry_.find(InfoHash(meta.info_hash_v2));
+            if (h2 < torrents_.size() && torrents_[h2].verifying) throw runtime_error("verify in progress");
+            TorrentHandle released;
+            h = registry_.addTorrent(std::move(meta), &released);
+            if (released < torrents_.size()) {
+                // keep the save path given for the folded entry, if this one has none
+                string released_path = torrents_[released].save_path;
+                torrents_[released] = DaemonTorrent();
+                if (h >= torrents_.size()) torrents_.resize(h + 1);
+                if (torrents_[h].save_path.empty()) torrents_[h].save_path = released_path;
+            }
+        }
+    }
+
+    if (h >= torrents_.size()) torrents_.resize(h + 1);
+    string save_path = optionalField(req, "save path");
+    if (!save_path.empty()) torrents_[h].save_path = save_path;
+
+    const TorrentEntry *e = registry_.get(h);
+    resp["info-hash"] = BValue(hashString(e->info_hash));
+    resp["name"] = BValue(e->meta ? e->meta->name : e->magnet->display_name);
+    resp["existed"] = BValue(existed ? 1LL : 0LL);
+}
+
+void DaemonSession::remove(const BDict &req) {
+    TorrentHandle h = lookup(req);
+    if (h < torrents_.size() && torrents_[h].verifying) throw runtime_error("verify in progress");
+    if (h < torrents_.size()) torrents_[h] = DaemonTorrent();
+    registry_.remove(h);
+}
+
+BDict DaemonSession::describe(TorrentHandle h) const {
+    const TorrentEntry *e = registry_.get(h);
+    const DaemonTorrent *t = h < torrents_.size() ? &torrents_[h] : nullptr;
+    BDict d;
+    d["info-hash"] = BValue(hashString(e->info_hash));
+    if (e->meta) {
+        d["name"] = BValue(e->meta->name);
+        d["size"] = BValue(static_cast<long long>(e->meta->total_size));
+        d["pieces"] = BValue(static_cast<long long>(e->meta->piece_count));
+    } else {
+        d["name"] = BValue(e->magnet->display_name);
+        d["size"] = BValue(e->magnet->file_size);
+        d["pieces"] = BValue(-1LL);
+    }
+    d["have"] = BValue(t ? t->have : -1LL);
+    d["save path"] = BValue(t ? t->save_path : string());
+    return d;
+}
+
+void DaemonSession::status(const BDict &req, BDict &resp) {
+    BList list;
+    if (req.count("info-hash")) {
+        list.push_back(BValue(describe(lookup(req))));
+    } else {
+        for (TorrentHandle h = 0; h < torrents_.size(); ++h)
+            if (registry_.get(h)) list.push_back(BValue(describe(h)));
+    }
+    resp["torrents"] = BValue(list);
+}
+
+// Runs on a worker thread, so other clients are served while pieces are
+// rechecked. Requests later on the same connection wait for it, which keeps
+// responses in order.
+void DaemonSession::verify(const BDict &req, BDict &resp, uint64_t conn, uint64_t start) {
+    TorrentHandle h = lookup(req);
+    const TorrentEntry *e = registry_.get(h);
+    if (!e->meta) throw runtime_error("metadata not available yet");
+
+    DaemonTorrent &t = torrents_[h];
+    if (t.verifying) throw runtime_error("verify in progress");
+    string save_path = optionalField(req, "save path");
+    if (!save_path.empty()) t.save_path = save_path;
+    if (t.save_path.empty()) throw runtime_error("no save path");
+    if (!t.storage) t.storage.reset(new FileStorage(*e->meta));
+    if (!t.resume) {
+        t.resume.reset(new ResumeData());
+        LoadResumeFile(writer_.pathFor(e->meta->info_hash), *t.resume);
+    }
+
+
+    unique_ptr<VerifyJob> job(new VerifyJob());
+    job->conn = conn;
+    job->handle = h;
+    job->resp = resp;
+    job->start = start;
+    VerifyJob *j = job.get();
+    const TorrentMetadata *meta = e->meta.get();
+    FileStorage *storage = t.storage.get();
+    ResumeData *rd = t.resume.get();
+    string path = t.save_path;
+    t.verifying = true;
+    lock_guard<mutex> lk(jobs_m_);
+    jobs_.push_back(std::move(job));
+    j->worker = thread([this, j, meta, storage, rd, path]() {
+        VerifySummary sum;
+        string error;
+        try {
+            sum = VerifyWithResume(*meta, *storage, path, *rd, writer_);
+        } catch (const exception &e) {
+            error = e.what();
+        }
+        {
+            lock_guard<mutex> lk(jobs_m_);
+            j->sum = sum;
+            j->error = error;
+            j->done = true;
+        }
+        wake_();
+    });
+}
+
+vector<pair<uint64_t, BDict>> DaemonSession::finishedJobs() {
+    vector<pair<uint64_t, BDict>> out;
+    lock_guard<mutex> lk(jobs_m_);
+    size_t kept = 0;
+    for (size_t i = 0; i < jobs_.size(); ++i) {
+        VerifyJob &j = *jobs_[i];
+        if (!j.done) {
+            jobs_[kept++] = std::move(jobs_[i]);
+            continue;
+        }
+        j.worker.join();
+        DaemonTorrent &t = torrents_[j.handle];
+        t.verifying = false;
+        BDict &resp = j.resp;
+        if (j.error.empty()) {
+            t.have = static_cast<long long>(j.sum.have);
+            resp["have"] = BValue(t.have);
+            resp["pieces"] = BValue(static_cast<long long>(j.sum.pieces));
+            resp["rechecked"] = BValue(static_cast<long long>(j.sum.rechecked));
+            resp["wanted"] = BValue(static_cast<long long>(j.sum.wanted));
+            resp["wanted have"] = BValue(static_cast<long long>(j.sum.wanted_have));
+            resp["resume"] = BValue(j.sum.loaded ? 1LL : 0LL);
+            resp["ok"] = BValue(1LL);
+        } else {
+            resp["ok"] = BValue(0LL);
+            resp["error"] = BValue(j.error);
+            metricAdd(METRIC_DAEMON_ERRORS);
+        }
+        metricRecord(METRIC_DAEMON_REQUEST_NS, metricNow() - j.start);
+        out.emplace_back(j.conn, std::move(resp));
+    }
+    jobs_.resize(kept);
+    return out;
+}
+
+void DaemonSession::stats(const BDict &req, BDict &resp) {
+    string format = optionalField(req, "format");
+    MetricsSnapshot snap = CollectMetrics();
+    if (format.empty() || format == "table") resp["text"] = BValue(FormatMetricsTable(snap));
+    else if (format == "prometheus") resp["text"] = BValue(FormatMetricsPrometheus(snap));
+    else throw runtime_error("unknown stats format \"" + format + "\"");
+}
+
+#ifdef _WIN32
+
+void RunDaemon(const DaemonOptions &) {
+    throw runtime_error("daemon mode needs Unix domain sockets");
+}
+
+DaemonClient::DaemonClient(const std::string &) {
+    throw runtime_error("daemon mode needs Unix domain sockets");
+}
+DaemonClient::~DaemonClient() {}
+void DaemonClient::send(const BDict &) {}
+void DaemonClient::flush() {}
+BDict DaemonClient::receive() { return BDict(); }
+
+#else
+
+// -------- SOCKETS --------
+static sockaddr_un socketAddress(const string &path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw runtime_error("socket path too long: " + path);
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+}
+
+static int connectUnix(const string &path) {
+    sockaddr_un addr = socketAddress(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void setNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+// Bind the socket, replacing a stale file left by a daemon that died, but
+// never one a live daemon is still answering on.
+static int listenUnix(const string &path) {
+    int live = connectUnix(path);
+    if (live >= 0) {
+        close(live);
+        throw runtime_error("a daemon is already listening on " + path);
+    }
+    unlink(path.c_str());
+
+    sockaddr_un addr = socketAddress(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) throw runtime_error(string("socket: ") + strerror(errno));
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        int err = errno;
+        close(fd);
+        throw runtime_error("cannot listen on " + path + ": " + strerror(err));
+    }
+    setNonBlocking(fd);
+    return fd;
+}
+
+// -------- EVENT LOOP --------
+// poll() loop on one thread. Each wakeup drains every readable socket,
+// handles all complete requests in arrival order and appends the responses
+// to that connection's output, which goes out in as few writes as the
+// socket allows. A verify runs on a worker thread; its connection's later
+// requests wait until it answers, and a pipe wakes the loop when it does.
+struct DaemonConn {
+    int fd;
+    uint64_t serial;        // never reused, unlike fds
+    string in;
+    string out;
+    bool closing = false;   // peer hung up or sent garbage; drop once out is written
+    bool waiting = false;   // a verify for this connection is running
+};
+
+static void handleFrames(DaemonConn &c, DaemonSession &session) {
+    size_t pos = 0;
+    try {
+        BDict req;
+        while (!c.waiting && !session.stopping() && takeFrame(c.in, pos, req)) {
+            BDict resp;
+            if (session.handle(req, c.serial, resp)) appendFrame(c.out, resp);
+            else c.waiting = true;
+        }
+    } catch (const exception &e) {
+        BDict resp;
+        resp["ok"] = BValue(0LL);
+        resp["error"] = BValue(string(e.what()));
+        appendFrame(c.out, resp);
+        c.closing = true;
+    }
+    c.in.erase(0, pos);
+}
+
+static void serviceConn(DaemonConn &c, DaemonSession &session) {
+    char buf[64 * 1024];
+    for (;;) {
+        ssize_t r = read(c.fd, buf, sizeof(buf));
+        if (r > 0) { c.in.append(buf, static_cast<size_t>(r)); continue; }
+        if (r == 0) c.closing = true;
+        else if (errno == EINTR) continue;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK) c.closing = true;
+        break;
+    }
+    handleFrames(c, session);
+}
+
+static void writeConn(DaemonConn &c) {
+    size_t done = 0;
+    while (done < c.out.size()) {
+        ssize_t w = write(c.fd, c.out.data() + done, c.out.size() - done);
+        if (w > 0) { done += static_cast<size_t>(w); continue; }
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        c.out.clear();   // peer is gone
+        c.closing = true;
+        return;
+    }
+    c.out.erase(0, done);
+}
+
+void RunDaemon(const DaemonOptions &opts) {
+    string path = opts.socket_path.empty() ? DefaultDaemonSocket() : opts.socket_path;
+    signal(SIGPIPE, SIG_IGN);
+    int listener = listenUnix(path);
+    int wake[2];
+    if (pipe(wake) != 0) {
+        close(listener);
+        throw runtime_error(string("pipe: ") + strerror(errno));
+    }
+    setNonBlocking(wake[0]);
+    setNonBlocking(wake[1]);
+    DaemonSession session(opts, [&wake]() {
+        char b = 0;
+        (void)!write(wake[1], &b, 1);
+    });
+
+    vector<DaemonConn> conns;
+    vector<pollfd> fds;
+    uint64_t next_serial = 0;
+    for (;;) {
+        bool pending = false;
+        for (auto &c : conns) pending |= !c.out.empty();
+        if (session.stopping() && !pending && !session.busy()) break;
+
+        fds.clear();
+        fds.push_back({listener, static_cast<short>(session.stopping() ? 0 : POLLIN), 0});
+        fds.push_back({wake[0], POLLIN, 0});
+        for (auto &c : conns)
+            fds.push_back({c.fd, static_cast<short>((session.stopping() ? 0 : POLLIN) | (c.out.empty() ? 0 : POLLOUT)), 0});
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char buf[64];
+            while (read(wake[0], buf, sizeof(buf)) > 0) {}
+            for (auto &done : session.finishedJobs()) {
+                for (auto &c : conns) {
+                    if (c.serial != done.first) continue;
+                    appendFrame(c.out, done.second);
+                    c.waiting = false;
+                    handleFrames(c, session);   // requests that queued up behind the verify
+                }
+            }
+        }
+        for (size_t i = 0; i < conns.size(); ++i) {
+            DaemonConn &c = conns[i];
+            short ev = fds[i + 2].revents;
+            if (ev & (POLLIN | POLLHUP | POLLERR)) serviceConn(c, session);
+            if (!c.out.empty()) writeConn(c);
+        }
+        if (fds[0].revents & POLLIN) {
+            for (;;) {
+                int fd = accept(listener, nullptr, nullptr);
+                if (fd < 0) break;
+                setNonBlocking(fd);
+                conns.push_back(DaemonConn{fd, next_serial++, string(), string()});
+            }
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < conns.size(); ++i) {
+            if (conns[i].closing && conns[i].out.empty()) {
+                close(conns[i].fd);
+                continue;
+            }
+            if (kept != i) conns[kept] = std::move(conns[i]);
+            ++kept;
+        }
+        conns.erase(conns.begin() + static_cast<ptrdiff_t>(kept), conns.end());
+    }
+
+    session.waitForJobs();   // workers signal through the pipe
+    for (auto &c : conns) close(c.fd);
+    close(listener);
+    close(wake[0]);
+    close(wake[1]);
+    unlink(path.c_str());
+}
+
+// -------- CLIENT --------
+DaemonClient::DaemonClient(const std::string &socket_path) {
+    signal(SIGPIPE, SIG_IGN);
+    fd_ = connectUnix(socket_path);
+    if (fd_ < 0) throw runtime_error("no daemon listening on " + socket_path);
+}
+
+DaemonClient::~DaemonClient() {
+    if (fd_ >= 0) close(fd_);
+}
+
+void DaemonClient::send(const BDict &request) { appendFrame(out_, request); }
+
+void DaemonClient::flush() {
+    size_t done = 0;
+    while (done < out_.size()) {
+        ssize_t w = write(fd_, out_.data() + done, out_.size() - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) throw runtime_error(string("daemon write failed: ") + strerror(errno));
+        done += static_cast<size_t>(w);
+    }
+    out_.clear();
+}
+
+BDict DaemonClient::receive() {
+    flush();
+    BDict msg;
+    while (!takeFrame(in_, in_pos_, msg)) {
+        if (in_pos_ > 0) {
+            in_.erase(0, in_pos_);
+            in_pos_ = 0;
+        }
+        char buf[64 * 1024];
+        ssize_t r = read(fd_, buf, sizeof(buf));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) throw runtime_error("daemon closed the connection");
+        in_.append(buf, static_cast<size_t>(r));
+    }
+    return msg;
+}
+
+#endif
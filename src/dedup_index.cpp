@@ -0,0 +1,315 @@
+#include "../include/dedup_index.h"
+#include "../include/sha1.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#elif !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+
+static const char INDEX_MAGIC[4] = {'P', 'S', 'D', 'I'};
+static const uint32_t INDEX_VERSION = 1;
+
+static void putLE(string &out, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) out += static_cast<char>(v >> (8 * i));
+}
+
+static uint64_t getLE(const string &in, size_t &pos, int bytes) {
+    if (in.size() - pos < static_cast<size_t>(bytes)) throw runtime_error("dedup index is truncated");
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i) v |= static_cast<uint64_t>(static_cast<uint8_t>(in[pos + i])) << (8 * i);
+    pos += static_cast<size_t>(bytes);
+    return v;
+}
+
+static DedupKey keyOf(const string &material) {
+    DedupKey k;
+    sha1_raw(reinterpret_cast<const uint8_t *>(material.data()), material.size(), k.bytes.data());
+    return k;
+}
+
+std::vector<DedupKey> DedupFileKeys(const TorrentMetadata &meta, const FileStorage &storage, size_t file_index) {
+    vector<DedupKey> keys;
+    const FileTable &files = meta.files;
+    if (files.isPad(file_index) || files.length(file_index) <= 0) return keys;
+    uint64_t length = static_cast<uint64_t>(files.length(file_index));
+
+    if (meta.has_v1) {
+        uint64_t pl = static_cast<uint64_t>(meta.piece_length);
+        uint64_t start = storage.fileOffset(file_index);
+        uint64_t first = (start + pl - 1) / pl;        // first piece starting inside the file
+        uint64_t end = (start + length) / pl;          // one past the last piece ending inside it
+        if (end > first && end * 20 <= meta.pieces.size()) {
+            string m = "v1";
+            putLE(m, length, 8);
+            putLE(m, pl, 8);
+            putLE(m, first * pl - start, 8);
+            m.append(reinterpret_cast<const char *>(&meta.pieces[first * 20]), (end - first) * 20);
+            keys.push_back(keyOf(m));
+        }
+    }
+    if (const uint8_t *root = files.piecesRoot(file_index)) {
+        string m = "v2";
+        putLE(m, length, 8);
+        m.append(reinterpret_cast<const char *>(root), 32);
+        keys.push_back(keyOf(m));
+    }
+    return keys;
+}
+
+// ------------------------------
+// DedupIndex
+// ------------------------------
+size_t DedupIndex::KeyHash::operator()(const DedupKey &k) const {
+    size_t h;
+    memcpy(&h, k.bytes.data(), sizeof(h));
+    return h;
+}
+
+DedupIndex::DedupIndex(std::string path) : path_(std::move(path)) {
+    load();
+}
+
+bool DedupIndex::insert(const DedupKey &key, DedupLocation loc) {
+    Shard &s = shardFor(key);
+    unique_lock<shared_mutex> lk(s.m);
+    vector<DedupLocation> &locs = s.map[key];
+    for (auto &l : locs)
+        if (l.info_hash == loc.info_hash && l.file_index == loc.file_index) return false;
+    locs.push_back(std::move(loc));
+    return true;
+}
+
+size_t DedupIndex::addTorrent(const TorrentMetadata &meta, const FileStorage &storage, const std::string &root_dir) {
+    size_t added = 0;
+    for (size_t i = 0; i < meta.files.size(); ++i) {
+        vector<DedupKey> keys = DedupFileKeys(meta, storage, i);
+        if (keys.empty()) continue;
+        // only data that is actually there
+        error_code ec;
+        fs::path path = fs::absolute(FilePathOnDisk(meta, i, root_dir), ec);
+        if (ec || fs::file_size(path, ec) != static_cast<uintmax_t>(meta.files.length(i)) || ec) continue;
+
+        DedupLocation loc;
+        loc.path = path.string();
+        loc.length = static_cast<uint64_t>(meta.files.length(i));
+        copy_n(meta.info_hash.begin(), 20, loc.info_hash.begin());
+        loc.file_index = static_cast<uint32_t>(i);
+        for (auto &k : keys) added += insert(k, loc);
+    }
+    return added;
+}
+
+std::vector<DedupLocation> DedupIndex::find(const DedupKey &key) const {
+    Shard &s = shardFor(key);
+    shared_lock<shared_mutex> lk(s.m);
+    auto it = s.map.find(key);
+    return it == s.map.end() ? vector<DedupLocation>() : it->second;
+}
+
+size_t DedupIndex::size() const {
+    size_t n = 0;
+    for (auto &s : shards_) {
+        shared_lock<shared_mutex> lk(s.m);
+        n += s.map.size();
+    }
+    return n;
+}
+
+void DedupIndex::load() {
+    ifstream file(path_, ios::binary);
+    if (!file) return;
+    string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    if (data.size() < 16 || memcmp(data.data(), INDEX_MAGIC, 4) != 0)
+        throw runtime_error(path_ + " is not a dedup index");
+    size_t pos = 4;
+    if (getLE(data, pos, 4) != INDEX_VERSION) throw runtime_error(path_ + ": unsupported dedup index version");
+    uint64_t count = getLE(data, pos, 8);
+    for (uint64_t e = 0; e < count; ++e) {
+        if (data.size() - pos < 40) throw runtime_error("dedup index is truncated");
+        DedupKey key;
+        DedupLocation loc;
+        memcpy(key.bytes.data(), data.data() + pos, 20);
+        memcpy(loc.info_hash.data(), data.data() + pos + 20, 20);
+        pos += 40;
+        loc.file_index = static_cast<uint32_t>(getLE(data, pos, 4));
+        loc.length = getLE(data, pos, 8);
+        size_t len = static_cast<size_t>(getLE(data, pos, 4));
+        if (data.size() - pos < len) throw runtime_error("dedup index is truncated");
+        loc.path = data.substr(pos, len);
+        pos += len;
+        insert(key, std::move(loc));
+    }
+}
+
+void DedupIndex::save() const {
+    string body;
+    uint64_t count = 0;
+    for (auto &s : shards_) {
+        shared_lock<shared_mutex> lk(s.m);
+        for (auto &kv : s.map) {
+            for (auto &loc : kv.second) {
+                body.append(reinterpret_cast<const char *>(kv.first.bytes.data()), 20);
+                body.append(reinterpret_cast<const char *>(loc.info_hash.data()), 20);
+                putLE(body, loc.file_index, 4);
+                putLE(body, loc.length, 8);
+                putLE(body, loc.path.size(), 4);
+                body += loc.path;
+                ++count;
+            }
+        }
+    }
+    string data(INDEX_MAGIC, 4);
+    putLE(data, INDEX_VERSION, 4);
+    putLE(data, count, 8);
+    data += body;
+
+    // same crash safety as resume files: write aside, sync, rename over
+    string tmp = path_ + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) throw runtime_error("Cannot write " + tmp);
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size() && fflush(f) == 0;
+#ifndef _WIN32
+    ok = ok && fsync(fileno(f)) == 0;
+#endif
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        remove(tmp.c_str());
+        throw runtime_error("Error writing " + tmp);
+    }
+    fs::rename(tmp, path_);
+}
+
+// ------------------------------
+// Bulk import
+// ------------------------------
+DedupImportResult ImportTorrents(DedupIndex &index, const std::vector<std::string> &torrent_paths,
+                                 const std::string &root_dir, unsigned threads) {
+    DedupImportResult res;
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    threads = static_cast<unsigned>(min<size_t>(threads, torrent_paths.size()));
+
+    atomic<size_t> next{0}, torrents{0}, keys{0};
+    mutex errors_m;
+    auto worker = [&]() {
+        for (size_t i = next++; i < torrent_paths.size(); i = next++) {
+            try {
+                string path = torrent_paths[i];
+                TorrentMetadata meta = ParseFile(path);
+                FileStorage storage(meta);
+                keys += index.addTorrent(meta, storage, root_dir);
+                ++torrents;
+            } catch (const exception &e) {
+                lock_guard<mutex> lk(errors_m);
+                res.errors.emplace_back(torrent_paths[i], e.what());
+            }
+        }
+    };
+    vector<thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool) t.join();
+
+    res.torrents = torrents;
+    res.keys = keys;
+    return res;
+}
+
+// ------------------------------
+// Filling a torrent from local data
+// ------------------------------
+// Share the source's blocks (btrfs, XFS, bcachefs and friends). False if the
+// filesystem or platform cannot.
+static bool cloneFile(const string &from, const string &to) {
+#if defined(__linux__) && defined(FICLONE)
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = out >= 0 && ioctl(out, FICLONE, in) == 0;
+    if (out >= 0) close(out);
+    close(in);
+    return ok;
+#else
+    (void)from;
+    (void)to;
+    return false;
+#endif
+}
+
+DedupFillResult FillFromIndex(const DedupIndex &index, const TorrentMetadata &meta, const FileStorage &storage,
+                              PieceStore &store, unsigned threads) {
+    DedupFillResult res;
+    vector<char> check(storage.numPieces(), 0);
+    for (size_t i = 0; i < meta.files.size(); ++i) {
+        if (store.filePriorities()[i] == PRIORITY_SKIP) continue;
+        vector<DedupKey> keys = DedupFileKeys(meta, storage, i);
+        if (keys.empty()) continue;
+        uint64_t length = static_cast<uint64_t>(meta.files.length(i));
+        fs::path target = store.filePath(i);
+        error_code ec;
+        if (fs::file_size(target, ec) == length && !ec) {
+            ++res.files_present;
+            continue;
+        }
+        fs::path target_abs = fs::absolute(target, ec);
+
+        bool filled = false;
+        for (auto &key : keys) {
+            for (auto &loc : index.find(key)) {
+                if (loc.length != length || loc.path == target_abs.string()) continue;
+                if (fs::file_size(loc.path, ec) != length || ec) continue;   // moved or changed since import
+                if (target.has_parent_path()) fs::create_directories(target.parent_path());
+                string tmp = target.string() + ".dedup";
+                if (cloneFile(loc.path, tmp)) {
+                    ++res.files_cloned;
+                } else if (fs::copy_file(loc.path, tmp, fs::copy_options::overwrite_existing, ec)) {
+                    ++res.files_copied;
+                } else {
+                    fs::remove(tmp, ec);
+                    continue;
+                }
+                fs::rename(tmp, target);
+                res.bytes += length;
+                filled = true;
+                break;
+            }
+            if (filled) break;
+        }
+        if (!filled) continue;
+        auto range = storage.filePieceRange(i);
+        for (size_t p = range.first; p < range.second; ++p) check[p] = store.wanted(p);
+    }
+
+    // CheckPieces reads only the files themselves; an edge piece's skipped
+    // bytes live in the part file
+    vector<size_t> pieces, edge;
+    for (size_t p = 0; p < check.size(); ++p)
+        if (check[p]) (store.isEdgePiece(p) ? edge : pieces).push_back(p);
+    vector<bool> ok = CheckPieces(meta, storage, store.rootDir(), pieces, threads);
+    for (size_t k = 0; k < pieces.size(); ++k) {
+        if (ok[k]) res.verified.push_back(pieces[k]);
+        else ++res.failed;
+    }
+    for (size_t p : edge) {
+        if (store.checkPiece(p)) res.verified.push_back(p);
+        else ++res.failed;
+    }
+    sort(res.verified.begin(), res.verified.end());
+    return res;
+}
@@ -0,0 +1,224 @@
+#include "../include/file_table.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+static const size_t ROOT_SIZE = 32;
+
+uint8_t fileFlagsFromAttr(std::string_view attr) {
+    uint8_t flags = 0;
+    for (char c : attr) {
+        if (c == 'p') flags |= FILE_PAD;
+        else if (c == 'x') flags |= FILE_EXECUTABLE;
+        else if (c == 'h') flags |= FILE_HIDDEN;
+        else if (c == 'l') flags |= FILE_SYMLINK;
+    }
+    return flags;
+}
+
+static uint64_t hashComponent(std::string_view s) {
+    const char *p = s.data();
+    size_t n = s.size();
+    uint64_t h = n * 0x9E3779B97F4A7C15ULL;
+    while (n >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h ^= w * 0x87c37b91114253d5ULL;
+        h = ((h << 27) | (h >> 37)) * 0xff51afd7ed558ccdULL;
+        p += 8;
+        n -= 8;
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, n);
+    h ^= w * 0x87c37b91114253d5ULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t pairKey(uint32_t a, uint32_t b) {
+    return (static_cast<uint64_t>(a) << 32) | b;
+}
+
+FileTable::FileTable() {
+    comp_offset_.push_back(0);
+    intern("");                 // component 0: name of the root directory
+    dir_parent_.push_back(ROOT_DIR);
+    dir_name_.push_back(0);
+}
+
+// -------- Interning --------
+uint32_t FileTable::findComponent(std::string_view s) const {
+    buildIndex();
+    for (uint64_t k = hashComponent(s);; ++k) {
+        auto it = comp_index_.find(k);
+        if (it == comp_index_.end()) return NOT_FOUND;
+        if (component(it->second) == s) return it->second;
+    }
+}
+
+uint32_t FileTable::intern(std::string_view s) {
+    buildIndex();
+    uint64_t k = hashComponent(s);
+    for (;; ++k) {
+        auto it = comp_index_.find(k);
+        if (it == comp_index_.end()) break;
+        if (component(it->second) == s) return it->second;
+    }
+    if (pool_.size() + s.size() > 0xFFFFFFFFULL) throw runtime_error("File table string pool exceeds 4 GiB");
+
+    uint32_t id = static_cast<uint32_t>(comp_offset_.size() - 1);
+    pool_.append(s.data(), s.size());
+    comp_offset_.push_back(static_cast<uint32_t>(pool_.size()));
+    comp_index_.emplace(k, id);
+    return id;
+}
+
+void FileTable::buildIndex() const {
+    if (indexed_) return;
+    indexed_ = true;
+    for (uint32_t id = 0; id + 1 < comp_offset_.size(); ++id) {
+        uint64_t k = hashComponent(component(id));
+        while (comp_index_.count(k)) ++k;
+        comp_index_.emplace(k, id);
+    }
+    for (uint32_t d = 1; d < dir_parent_.size(); ++d)
+        dir_index_.emplace(pairKey(dir_parent_[d], dir_name_[d]), d);
+    for (uint32_t f = 0; f < file_dir_.size(); ++f)
+        file_index_.emplace(pairKey(file_dir_[f], file_name_[f]), f);
+}
+
+void FileTable::finalize() {
+    unordered_map<uint64_t, uint32_t>().swap(comp_index_);
+    unordered_map<uint64_t, uint32_t>().swap(dir_index_);
+    unordered_map<uint64_t, uint32_t>().swap(file_index_);
+    indexed_ = false;
+
+    pool_.shrink_to_fit();
+    comp_offset_.shrink_to_fit();
+    dir_parent_.shrink_to_fit();
+    dir_name_.shrink_to_fit();
+    file_dir_.shrink_to_fit();
+    file_name_.shrink_to_fit();
+    lengths_.shrink_to_fit();
+    offsets_.shrink_to_fit();
+    flags_.shrink_to_fit();
+}
+
+// -------- Building --------
+uint32_t FileTable::directory(uint32_t parent, std::string_view name) {
+    uint32_t comp = intern(name);
+    auto it = dir_index_.find(pairKey(parent, comp));
+    if (it != dir_index_.end()) return it->second;
+
+    uint32_t d = static_cast<uint32_t>(dir_parent_.size());
+    dir_parent_.push_back(parent);
+    dir_name_.push_back(comp);
+    dir_index_.emplace(pairKey(parent, comp), d);
+    return d;
+}
+
+size_t FileTable::addFile(uint32_t dir, std::string_view name, int64_t length, uint8_t flags) {
+    uint32_t comp = intern(name);
+    size_t i = lengths_.size();
+    uint64_t offset = i ? offsets_.back() + static_cast<uint64_t>(lengths_.back()) : 0;
+
+    file_dir_.push_back(dir);
+    file_name_.push_back(comp);
+    lengths_.push_back(length);
+    offsets_.push_back(offset);
+    flags_.push_back(flags);
+    if (!root_index_.empty()) root_index_.push_back(NOT_FOUND);
+    file_index_.emplace(pairKey(dir, comp), static_cast<uint32_t>(i));   // first wins on duplicates
+    return i;
+}
+
+void FileTable::setPiecesRoot(size_t i, const uint8_t *root) {
+    if (root_index_.empty()) root_index_.assign(size(), NOT_FOUND);
+    uint32_t r = root_index_.at(i);
+    if (r == NOT_FOUND) {
+        r = static_cast<uint32_t>(layer_size_.size());
+        root_index_[i] = r;
+        roots_.resize(roots_.size() + ROOT_SIZE);
+        layer_offset_.push_back(0);
+        layer_size_.push_back(0);
+    }
+    memcpy(&roots_[r * ROOT_SIZE], root, ROOT_SIZE);
+}
+
+void FileTable::setPieceLayer(size_t i, const uint8_t *layer, size_t bytes) {
+    if (root_index_.empty() || root_index_.at(i) == NOT_FOUND)
+        throw runtime_error("Piece layer for a file without pieces root");
+    uint32_t r = root_index_[i];
+    layer_offset_[r] = layers_.size();
+    layer_size_[r] = static_cast<uint32_t>(bytes);
+    layers_.insert(layers_.end(), layer, layer + bytes);
+}
+
+uint32_t FileTable::findDirectory(uint32_t parent, std::string_view name) const {
+    uint32_t comp = findComponent(name);
+    if (comp == NOT_FOUND) return NOT_FOUND;
+    auto it = dir_index_.find(pairKey(parent, comp));
+    return it == dir_index_.end() ? NOT_FOUND : it->second;
+}
+
+uint32_t FileTable::findFile(uint32_t dir, std::string_view name) const {
+    uint32_t comp = findComponent(name);
+    if (comp == NOT_FOUND) return NOT_FOUND;
+    auto it = file_index_.find(pairKey(dir, comp));
+    return it == file_index_.end() ? NOT_FOUND : it->second;
+}
+
+// -------- Access --------
+std::vector<std::string> FileTable::path(size_t i) const {
+    vector<string> out;
+    for (uint32_t d = file_dir_[i]; d != ROOT_DIR; d = dir_parent_[d])
+        out.emplace_back(component(dir_name_[d]));
+    reverse(out.begin(), out.end());
+    out.emplace_back(name(i));
+    return out;
+}
+
+std::string FileTable::joinedPath(size_t i, char sep) const {
+    string out;
+    for (auto &part : path(i)) {
+        if (!out.empty()) out.push_back(sep);
+        out += part;
+    }
+    return out;
+}
+
+const uint8_t *FileTable::piecesRoot(size_t i) const {
+    if (root_index_.empty() || root_index_[i] == NOT_FOUND) return nullptr;
+    return &roots_[root_index_[i] * ROOT_SIZE];
+}
+
+const uint8_t *FileTable::pieceLayer(size_t i) const {
+    if (root_index_.empty() || root_index_[i] == NOT_FOUND) return nullptr;
+    uint32_t r = root_index_[i];
+    return layer_size_[r] ? &layers_[layer_offset_[r]] : nullptr;
+}
+
+size_t FileTable::pieceLayerSize(size_t i) const {
+    if (root_index_.empty() || root_index_[i] == NOT_FOUND) return 0;
+    return layer_size_[root_index_[i]];
+}
+
+size_t FileTable::memoryUsage() const {
+    size_t n = sizeof(*this) + pool_.capacity();
+    n += comp_offset_.capacity() * sizeof(uint32_t);
+    n += (dir_parent_.capacity() + dir_name_.capacity()) * sizeof(uint32_t);
+    n += (file_dir_.capacity() + file_name_.capacity()) * sizeof(uint32_t);
+    n += lengths_.capacity() * sizeof(int64_t) + offsets_.capacity() * sizeof(uint64_t);
+    n += flags_.capacity();
+    n += root_index_.capacity() * sizeof(uint32_t) + roots_.capacity() + layers_.capacity();
+    n += layer_offset_.capacity() * sizeof(uint64_t) + layer_size_.capacity() * sizeof(uint32_t);
+    // hash map nodes are roughly a key, a value and a next pointer each
+    for (auto *m : {&comp_index_, &dir_index_, &file_index_})
+        n += m->bucket_count() * sizeof(void *) + m->size() * 32;
+    return n;
+}
@@ -0,0 +1,175 @@
+#include "../include/input_source.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// -------- PLATFORM --------
+#ifdef _WIN32
+static int openReadOnly(const string &path) { return _open(path.c_str(), _O_RDONLY | _O_BINARY); }
+static long long readSome(int fd, char *buf, size_t n) {
+    return _read(fd, buf, static_cast<unsigned>(n > 0x40000000 ? 0x40000000 : n));
+}
+static void closeFd(int fd) { _close(fd); }
+static const int STDIN_FD = 0;
+#else
+static int openReadOnly(const string &path) { return ::open(path.c_str(), O_RDONLY | O_CLOEXEC); }
+static long long readSome(int fd, char *buf, size_t n) { return ::read(fd, buf, n); }
+static void closeFd(int fd) { ::close(fd); }
+static const int STDIN_FD = STDIN_FILENO;
+#endif
+
+// Read fd to EOF. `hint` is the expected size (0 when unknown, e.g. a
+// pipe); one spare byte lets a regular file finish without a second
+// buffer resize.
+static void readAll(int fd, size_t hint, string &out) {
+    out.resize(hint ? hint + 1 : 64 * 1024);
+    size_t n = 0;
+    for (;;) {
+        if (n == out.size()) out.resize(out.size() * 2);
+        long long r = readSome(fd, &out[n], out.size() - n);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            throw runtime_error(string("Read failed: ") + strerror(errno));
+        }
+        if (r == 0) break;
+        n += static_cast<size_t>(r);
+    }
+    out.resize(n);
+}
+
+// -------- INPUT SOURCE --------
+InputSource::~InputSource() { release(); }
+
+void InputSource::release() {
+    if (mapped_) {
+#ifdef _WIN32
+        UnmapViewOfFile(data_);
+        CloseHandle(static_cast<HANDLE>(mapping_));
+        mapping_ = nullptr;
+#else
+        munmap(const_cast<char *>(data_), size_);
+#endif
+    }
+    data_ = nullptr;
+    size_ = 0;
+    mapped_ = false;
+    buffer_.clear();
+}
+
+InputSource::InputSource(InputSource &&other) noexcept { *this = std::move(other); }
+
+InputSource &InputSource::operator=(InputSource &&other) noexcept {
+    if (this == &other) return *this;
+    release();
+    mapped_ = other.mapped_;
+    size_ = other.size_;
+#ifdef _WIN32
+    mapping_ = other.mapping_;
+    other.mapping_ = nullptr;
+#endif
+    if (mapped_) {
+        data_ = other.data_;
+    } else {
+        // the buffer may live inline in the string, so re-point after moving
+        buffer_ = std::move(other.buffer_);
+        data_ = buffer_.data();
+    }
+    other.data_ = nullptr;
+    other.size_ = 0;
+    other.mapped_ = false;
+    other.buffer_.clear();
+    return *this;
+}
+
+InputSource InputSource::readFd(int fd) {
+    InputSource src;
+    readAll(fd, 0, src.buffer_);
+    src.data_ = src.buffer_.data();
+    src.size_ = src.buffer_.size();
+    return src;
+}
+
+InputSource InputSource::open(const string &path, InputMode mode) {
+    if (path == "-") {
+#ifdef _WIN32
+        _setmode(STDIN_FD, _O_BINARY);
+#endif
+        return readFd(STDIN_FD);
+    }
+
+    int fd = openReadOnly(path);
+    if (fd < 0) throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+
+#ifdef _WIN32
+    struct _stat64 st;
+    bool ok = _fstat64(fd, &st) == 0;
+    bool regular = ok && (st.st_mode & _S_IFREG);
+#else
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    bool regular = ok && S_ISREG(st.st_mode);
+#endif
+    if (!ok) {
+        int err = errno;
+        closeFd(fd);
+        throw runtime_error("Cannot stat " + path + ": " + strerror(err));
+    }
+    size_t size = regular ? static_cast<size_t>(st.st_size) : 0;
+
+    InputSource src;
+    bool map = regular && size > 0 &&
+               (mode == INPUT_MMAP || (mode == INPUT_AUTO && size >= INPUT_MMAP_THRESHOLD));
+    if (map) {
+#ifdef _WIN32
+        HANDLE h = CreateFileMappingA(reinterpret_cast<HANDLE>(_get_osfhandle(fd)), nullptr, PAGE_READONLY, 0, 0,
+                                      nullptr);
+        void *p = h ? MapViewOfFile(h, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (p) {
+            src.mapping_ = h;
+            src.data_ = static_cast<const char *>(p);
+        } else if (h) {
+            CloseHandle(h);
+        }
+#else
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, size, MADV_SEQUENTIAL);
+            src.data_ = static_cast<const char *>(p);
+        }
+#endif
+        if (src.data_) {
+            src.size_ = size;
+            src.mapped_ = true;
+            closeFd(fd);   // the mapping keeps the file referenced
+            return src;
+        }
+        // mapping failed (e.g. a filesystem without mmap): fall back to reading
+    }
+
+    try {
+        readAll(fd, size, src.buffer_);
+    } catch (...) {
+        closeFd(fd);
+        throw;
+    }
+    closeFd(fd);
+    src.data_ = src.buffer_.data();
+    src.size_ = src.buffer_.size();
+    return src;
+}
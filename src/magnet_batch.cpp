@@ -0,0 +1,279 @@
+#include "../include/magnet_batch.h"
+
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PEERSTORM_MAGNET_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+// PoolString offsets and lengths are 32-bit
+static const size_t MAX_POOL_SIZE = 0xFFFFFFFFULL;
+
+// -------- Scanning helpers --------
+
+// First '%' or '+' in [p, end), or end. 16 bytes per step with SSE2.
+static const char *findEscape(const char *p, const char *end) {
+#ifdef PEERSTORM_MAGNET_SSE2
+    const __m128i pct = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8('+');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, plus)));
+        if (m) {
+#if defined(_MSC_VER)
+            unsigned long i;
+            _BitScanForward(&i, static_cast<unsigned long>(m));
+            return p + i;
+#else
+            return p + __builtin_ctz(static_cast<unsigned>(m));
+#endif
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '%' && *p != '+') ++p;
+    return p;
+}
+
+// Percent-decode [p, end) onto the end of pool. False on a bad escape.
+// Decoded output is never longer than the input, so the pool is grown once
+// and written through a raw pointer.
+static bool decodeInto(const char *p, const char *end, string &pool) {
+    size_t start = pool.size();
+    pool.resize(start + static_cast<size_t>(end - p));
+    char *out = &pool[start];
+
+    while (p < end) {
+        const char *q = findEscape(p, end);
+        memcpy(out, p, static_cast<size_t>(q - p));
+        out += q - p;
+        if (q == end) break;
+        if (*q == '+') {
+            *out++ = ' ';
+            p = q + 1;
+        } else if (end - q > 2) {
+            uint8_t hi = MAGNET_TABLES.hex[static_cast<unsigned char>(q[1])];
+            uint8_t lo = MAGNET_TABLES.hex[static_cast<unsigned char>(q[2])];
+            if ((hi | lo) == 0xFF) return false;
+            *out++ = static_cast<char>((hi << 4) | lo);
+            p = q + 3;
+        } else {
+            // trailing '%' without two digits is kept literally, like urlDecode
+            *out++ = '%';
+            p = q + 1;
+        }
+    }
+    pool.resize(static_cast<size_t>(out - pool.data()));
+    return true;
+}
+
+static bool decodeHash(const char *s, size_t n, InfoHash &out) {
+    if (n == 40) {
+        for (size_t i = 0; i < 20; ++i) {
+            uint8_t hi = MAGNET_TABLES.hex[static_cast<unsigned char>(s[2 * i])];
+            uint8_t lo = MAGNET_TABLES.hex[static_cast<unsigned char>(s[2 * i + 1])];
+            if ((hi | lo) == 0xFF) return false;
+            out.bytes[i] = static_cast<uint8_t>((hi << 4) | lo);
+        }
+        return true;
+    }
+    if (n == 32) {
+        // 8 base32 characters -> 5 bytes
+        for (size_t g = 0; g < 4; ++g) {
+            uint64_t acc = 0;
+            for (size_t i = 0; i < 8; ++i) {
+                uint8_t v = MAGNET_TABLES.base32[static_cast<unsigned char>(s[g * 8 + i])];
+                if (v == 0xFF) return false;
+                acc = (acc << 5) | v;
+            }
+            for (size_t i = 0; i < 5; ++i)
+                out.bytes[g * 5 + i] = static_cast<uint8_t>(acc >> (32 - 8 * i));
+        }
+        return true;
+    }
+    return false;
+}
+
+static uint64_t hashBytes(const char *p, size_t n) {
+    // 8 bytes per step; only used to spot repeated tracker URLs within a batch
+    uint64_t h = n * 0x9E3779B97F4A7C15ULL;
+    while (n >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h ^= w * 0x87c37b91114253d5ULL;
+        h = ((h << 27) | (h >> 37)) * 0xff51afd7ed558ccdULL;
+        p += 8;
+        n -= 8;
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, n);
+    h ^= w * 0x87c37b91114253d5ULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// -------- MagnetBatch --------
+void MagnetBatch::clear() {
+    info_hashes.clear();
+    display_names.clear();
+    file_sizes.clear();
+    tracker_begin.assign(1, 0);
+    trackers.clear();
+    web_seed_begin.assign(1, 0);
+    web_seeds.clear();
+    pool.clear();
+    rejected_lines.clear();
+    interned_.clear();
+}
+
+PoolString MagnetBatch::intern(size_t start) {
+    PoolString s;
+    s.offset = static_cast<uint32_t>(start);
+    s.length = static_cast<uint32_t>(pool.size() - start);
+
+    uint64_t h = hashBytes(pool.data() + start, s.length);
+    auto it = interned_.find(h);
+    if (it == interned_.end()) {
+        interned_.emplace(h, s);
+        line_interned_.push_back(h);
+        return s;
+    }
+    if (view(it->second) == view(s)) {
+        pool.resize(start);
+        return it->second;
+    }
+    return s;   // hash collision: keep a private copy
+}
+
+MagnetData MagnetBatch::toMagnetData(size_t i) const {
+    MagnetData d;
+    d.info_hash_bytes.assign(info_hashes[i].bytes.begin(), info_hashes[i].bytes.end());
+    d.info_hash_hex = toHex(d.info_hash_bytes);
+    d.display_name = string(view(display_names[i]));
+    d.file_size = file_sizes[i];
+    for (uint32_t k = tracker_begin[i]; k < tracker_begin[i + 1]; ++k)
+        d.trackers.emplace_back(view(trackers[k]));
+    for (uint32_t k = web_seed_begin[i]; k < web_seed_begin[i + 1]; ++k)
+        d.web_seeds.emplace_back(view(web_seeds[k]));
+    return d;
+}
+
+// -------- Parser --------
+static bool keyIs(const char *k, size_t n, const char *name) {
+    size_t m = strlen(name);
+    // BEP 9 allows numbered keys such as "tr.1"
+    return (n == m || (n > m && k[m] == '.')) && memcmp(k, name, m) == 0;
+}
+
+bool MagnetBatch::parseLine(const char *p, const char *end) {
+    static const char PREFIX[] = "magnet:?";
+    const size_t prefix_len = sizeof(PREFIX) - 1;
+    if (static_cast<size_t>(end - p) < prefix_len || memcmp(p, PREFIX, prefix_len) != 0) return false;
+    p += prefix_len;
+
+    bool have_hash = false;
+    InfoHash hash;
+    PoolString name;
+    int64_t size = -1;
+
+    while (p < end) {
+        const char *amp = static_cast<const char *>(memchr(p, '&', static_cast<size_t>(end - p)));
+        const char *param_end = amp ? amp : end;
+        const char *eq = static_cast<const char *>(memchr(p, '=', static_cast<size_t>(param_end - p)));
+        if (eq) {
+            const char *k = p;
+            size_t kn = static_cast<size_t>(eq - p);
+            const char *v = eq + 1;
+            size_t start = pool.size();
+
+            if (keyIs(k, kn, "xt")) {
+                if (!decodeInto(v, param_end, pool)) return false;
+                const char *s = pool.data() + start;
+                size_t n = pool.size() - start;
+                if (!have_hash && n > 9 && memcmp(s, "urn:btih:", 9) == 0) {
+                    if (!decodeHash(s + 9, n - 9, hash)) return false;
+                    have_hash = true;
+                }
+                pool.resize(start);
+            } else if (keyIs(k, kn, "dn")) {
+                if (name.length == 0) {
+                    if (!decodeInto(v, param_end, pool)) return false;
+                    name.offset = static_cast<uint32_t>(start);
+                    name.length = static_cast<uint32_t>(pool.size() - start);
+                }
+            } else if (keyIs(k, kn, "tr")) {
+                if (!decodeInto(v, param_end, pool)) return false;
+                trackers.push_back(intern(start));
+            } else if (keyIs(k, kn, "ws")) {
+                if (!decodeInto(v, param_end, pool)) return false;
+                web_seeds.push_back(intern(start));
+            } else if (keyIs(k, kn, "xl")) {
+                int64_t x = 0;
+                const char *d = v;
+                for (; d < param_end && *d >= '0' && *d <= '9'; ++d) {
+                    int digit = *d - '0';
+                    if (x > (numeric_limits<int64_t>::max() - digit) / 10) return false;   // would overflow
+                    x = x * 10 + digit;
+                }
+                if (d == v || d != param_end) return false;
+                size = x;
+            }
+        }
+        p = amp ? amp + 1 : end;
+    }
+    if (!have_hash) return false;
+
+    info_hashes.push_back(hash);
+    display_names.push_back(name);
+    file_sizes.push_back(size);
+    tracker_begin.push_back(static_cast<uint32_t>(trackers.size()));
+    web_seed_begin.push_back(static_cast<uint32_t>(web_seeds.size()));
+    return true;
+}
+
+size_t ParseMagnetBatch(const char *data, size_t len, MagnetBatch &out) {
+    size_t before = out.size();
+    const char *p = data;
+    const char *end = data + len;
+    size_t line = 0;
+
+    while (p < end) {
+        const char *nl = static_cast<const char *>(memchr(p, '\n', static_cast<size_t>(end - p)));
+        const char *line_end = nl ? nl : end;
+        const char *e = line_end;
+        while (e > p && (e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t')) --e;
+        const char *b = p;
+        while (b < e && (*b == ' ' || *b == '\t')) ++b;
+
+        if (b < e) {
+            // decoding never grows a value, so a line adds at most its own length
+            if (out.pool.size() + static_cast<size_t>(e - b) > MAX_POOL_SIZE)
+                throw runtime_error("MagnetBatch pool would exceed 4 GiB, parse the feed in smaller chunks");
+            size_t pool_mark = out.pool.size();
+            size_t tr_mark = out.trackers.size();
+            size_t ws_mark = out.web_seeds.size();
+            out.line_interned_.clear();
+            if (!out.parseLine(b, e)) {
+                // roll back whatever the bad line appended, including URLs it interned
+                for (uint64_t h : out.line_interned_) out.interned_.erase(h);
+                out.pool.resize(pool_mark);
+                out.trackers.resize(tr_mark);
+                out.web_seeds.resize(ws_mark);
+                out.rejected_lines.push_back(line);
+            }
+        }
+        ++line;
+        p = nl ? nl + 1 : end;
+    }
+    return out.size() - before;
+}
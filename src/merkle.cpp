@@ -0,0 +1,218 @@
+#include "../include/merkle.h"
+#include "../include/sha256.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+static void hashPair(const uint8_t *left, const uint8_t *right, uint8_t *out) {
+    uint8_t buf[2 * MERKLE_HASH_SIZE];
+    memcpy(buf, left, MERKLE_HASH_SIZE);
+    memcpy(buf + MERKLE_HASH_SIZE, right, MERKLE_HASH_SIZE);
+    sha256_raw(buf, sizeof(buf), out);
+}
+
+size_t merkleNumLeaves(size_t blocks) {
+    size_t n = 1;
+    while (n < blocks) n <<= 1;
+    return n;
+}
+
+vector<uint8_t> merklePadHash(size_t leaves) {
+    vector<uint8_t> pad(MERKLE_HASH_SIZE, 0);
+    for (; leaves > 1; leaves >>= 1)
+        hashPair(pad.data(), pad.data(), pad.data());
+    return pad;
+}
+
+vector<uint8_t> merkleRoot(const vector<uint8_t> &layer, size_t width, const vector<uint8_t> &pad_in) {
+    size_t n = layer.size() / MERKLE_HASH_SIZE;
+    if (n > width) throw runtime_error("merkleRoot: layer wider than tree");
+
+    vector<uint8_t> cur = layer;
+    vector<uint8_t> pad = pad_in;
+    while (width > 1) {
+        // in place: node i only reads nodes 2i and 2i+1
+        size_t next_n = (n + 1) / 2;
+        for (size_t i = 0; i < next_n; ++i) {
+            const uint8_t *left = &cur[2 * i * MERKLE_HASH_SIZE];
+            const uint8_t *right = (2 * i + 1 < n) ? &cur[(2 * i + 1) * MERKLE_HASH_SIZE] : pad.data();
+            hashPair(left, right, &cur[i * MERKLE_HASH_SIZE]);
+        }
+        hashPair(pad.data(), pad.data(), pad.data());
+        n = next_n;
+        width >>= 1;
+    }
+    if (n == 0) return pad;
+    cur.resize(MERKLE_HASH_SIZE);
+    return cur;
+}
+
+vector<uint8_t> merkleHashBlocks(const uint8_t *data, size_t len) {
+    size_t blocks = (len + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE;
+    vector<uint8_t> leaves(blocks * MERKLE_HASH_SIZE);
+    for (size_t i = 0; i < blocks; ++i) {
+        size_t off = i * MERKLE_BLOCK_SIZE;
+        size_t n = min(MERKLE_BLOCK_SIZE, len - off);
+        sha256_raw(data + off, n, &leaves[i * MERKLE_HASH_SIZE]);
+    }
+    return leaves;
+}
+
+MerkleFileTree merkleBuildFromLeaves(const vector<uint8_t> &leaves, int64_t piece_length) {
+    if (piece_length < static_cast<int64_t>(MERKLE_BLOCK_SIZE) || (piece_length & (piece_length - 1)) != 0)
+        throw runtime_error("v2 piece length must be a power of two >= 16 KiB");
+
+    MerkleFileTree tree;
+    size_t n = leaves.size() / MERKLE_HASH_SIZE;
+    if (n == 0) return tree;
+
+    const vector<uint8_t> zero(MERKLE_HASH_SIZE, 0);
+    size_t blocks_per_piece = static_cast<size_t>(piece_length) / MERKLE_BLOCK_SIZE;
+
+    if (n <= blocks_per_piece) {
+        tree.root = merkleRoot(leaves, merkleNumLeaves(n), zero);
+        return tree;
+    }
+
+    size_t pieces = (n + blocks_per_piece - 1) / blocks_per_piece;
+    tree.piece_layer.resize(pieces * MERKLE_HASH_SIZE);
+    vector<uint8_t> sub;
+    for (size_t p = 0; p < pieces; ++p) {
+        size_t first = p * blocks_per_piece;
+        size_t last = min(n, first + blocks_per_piece);
+        sub.assign(leaves.begin() + first * MERKLE_HASH_SIZE, leaves.begin() + last * MERKLE_HASH_SIZE);
+        vector<uint8_t> h = merkleRoot(sub, blocks_per_piece, zero);
+        memcpy(&tree.piece_layer[p * MERKLE_HASH_SIZE], h.data(), MERKLE_HASH_SIZE);
+    }
+    tree.root = merkleRoot(tree.piece_layer, merkleNumLeaves(pieces), merklePadHash(blocks_per_piece));
+    return tree;
+}
+
+MerkleFileTree merkleBuildFile(const string &path, int64_t piece_length) {
+    ifstream file(path, ios::binary);
+    if (!file) throw runtime_error("Cannot open " + path);
+
+    // read a whole number of blocks at a time so leaves never straddle reads
+    size_t chunk = max(static_cast<size_t>(piece_length), static_cast<size_t>(4 << 20));
+    chunk -= chunk % MERKLE_BLOCK_SIZE;
+    vector<uint8_t> buf(chunk);
+    vector<uint8_t> leaves;
+
+    while (file) {
+        file.read(reinterpret_cast<char *>(buf.data()), static_cast<streamsize>(buf.size()));
+        size_t got = static_cast<size_t>(file.gcount());
+        if (got == 0) break;
+        vector<uint8_t> part = merkleHashBlocks(buf.data(), got);
+        leaves.insert(leaves.end(), part.begin(), part.end());
+    }
+    return merkleBuildFromLeaves(leaves, piece_length);
+}
+
+vector<uint8_t> merkleProof(const vector<uint8_t> &leaves, size_t width, size_t index) {
+    size_t n = leaves.size() / MERKLE_HASH_SIZE;
+    if (index >= n || n > width) throw runtime_error("merkleProof: index out of range");
+
+    vector<uint8_t> proof;
+    vector<uint8_t> cur = leaves;
+    vector<uint8_t> pad(MERKLE_HASH_SIZE, 0);
+    for (; width > 1; width >>= 1) {
+        size_t sibling = index ^ 1;
+        const uint8_t *h = (sibling < n) ? &cur[sibling * MERKLE_HASH_SIZE] : pad.data();
+        proof.insert(proof.end(), h, h + MERKLE_HASH_SIZE);
+
+        size_t next_n = (n + 1) / 2;
+        for (size_t i = 0; i < next_n; ++i) {
+            const uint8_t *right = (2 * i + 1 < n) ? &cur[(2 * i + 1) * MERKLE_HASH_SIZE] : pad.data();
+            hashPair(&cur[2 * i * MERKLE_HASH_SIZE], right, &cur[i * MERKLE_HASH_SIZE]);
+        }
+        hashPair(pad.data(), pad.data(), pad.data());
+        n = next_n;
+        index >>= 1;
+    }
+    return proof;
+}
+
+bool merkleVerifyBlock(const uint8_t *block, size_t len, size_t index,
+                       const vector<uint8_t> &proof, const uint8_t *expected) {
+    if (len == 0 || len > MERKLE_BLOCK_SIZE || proof.size() % MERKLE_HASH_SIZE != 0) return false;
+    uint8_t node[MERKLE_HASH_SIZE];
+    sha256_raw(block, len, node);
+    for (size_t off = 0; off < proof.size(); off += MERKLE_HASH_SIZE) {
+        if (index & 1) hashPair(&proof[off], node, node);
+        else hashPair(node, &proof[off], node);
+        index >>= 1;
+    }
+    return memcmp(node, expected, MERKLE_HASH_SIZE) == 0;
+}
+
+bool merkleVerifyPiece(const uint8_t *data, size_t len, size_t width, const uint8_t *expected) {
+    vector<uint8_t> leaves = merkleHashBlocks(data, len);
+    if (leaves.size() / MERKLE_HASH_SIZE > width) return false;
+    vector<uint8_t> root = merkleRoot(leaves, width, vector<uint8_t>(MERKLE_HASH_SIZE, 0));
+    return memcmp(root.data(), expected, MERKLE_HASH_SIZE) == 0;
+}
+
+// ------------------------------
+// Parallel verification of v2 files on disk
+// ------------------------------
+static void verifyOneFile(const TorrentMetadata &meta, const string &root_dir, MerkleFileResult &res) {
+    const FileTable &files = meta.files;
+    size_t i = res.file_index;
+    const uint8_t *layer = files.pieceLayer(i);
+    size_t layer_size = files.pieceLayerSize(i);
+    string path = FilePathOnDisk(meta, res.file_index, root_dir);
+
+    error_code ec;
+    uintmax_t size = filesystem::file_size(path, ec);
+    if (ec) { res.error = "missing"; return; }
+    if (size != static_cast<uintmax_t>(files.length(i))) { res.error = "size mismatch"; return; }
+
+    MerkleFileTree tree = merkleBuildFile(path, meta.piece_length);
+    if (layer && tree.piece_layer.size() == layer_size) {
+        for (size_t p = 0; p * MERKLE_HASH_SIZE < layer_size; ++p) {
+            if (memcmp(&tree.piece_layer[p * MERKLE_HASH_SIZE], layer + p * MERKLE_HASH_SIZE,
+                       MERKLE_HASH_SIZE) != 0)
+                res.bad_pieces.push_back(p);
+        }
+    }
+    res.ok = memcmp(tree.root.data(), files.piecesRoot(i), MERKLE_HASH_SIZE) == 0;
+    if (!res.ok && res.bad_pieces.empty() && !layer) res.bad_pieces.push_back(0);
+}
+
+vector<MerkleFileResult> verifyFilesV2(const TorrentMetadata &meta, const string &root_dir, unsigned threads) {
+    vector<MerkleFileResult> results;
+    for (size_t i = 0; i < meta.files.size(); ++i) {
+        if (!meta.files.piecesRoot(i)) continue;
+        MerkleFileResult r;
+        r.file_index = i;
+        results.push_back(r);
+    }
+
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    threads = static_cast<unsigned>(min<size_t>(threads, results.size()));
+
+    atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < results.size(); i = next++) {
+            try {
+                verifyOneFile(meta, root_dir, results[i]);
+            } catch (const exception &e) {
+                results[i].ok = false;
+                results[i].error = e.what();
+            }
+        }
+    };
+
+    vector<thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool) t.join();
+    return results;
+}
@@ -0,0 +1,248 @@
+#include "../include/metrics.h"
+
+#include <cmath>
+#include <cstdio>
+#include <mutex>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+// -------- PER-THREAD STORAGE --------
+// Blocks are only ever written by the thread that owns them. When a thread
+// exits its block goes back on a free list, counts intact, for the next new
+// thread: short-lived worker pools do not grow memory, and totals never go
+// backwards.
+struct alignas(64) ThreadHistogram {
+    atomic<uint64_t> count;
+    atomic<uint64_t> sum;
+    atomic<uint64_t> max;
+    atomic<uint64_t> buckets[METRIC_BUCKETS];
+};
+
+struct alignas(64) ThreadMetrics {
+    atomic<uint64_t> counters[METRIC_COUNTER_COUNT];
+    ThreadHistogram histograms[METRIC_HISTOGRAM_COUNT];
+};
+
+// Never destroyed: thread_local destructors may run after static ones.
+struct MetricsRegistry {
+    mutex m;
+    vector<ThreadMetrics *> all;
+    vector<ThreadMetrics *> free;
+};
+
+static MetricsRegistry &registry() {
+    static MetricsRegistry *r = new MetricsRegistry();
+    return *r;
+}
+
+class ThreadSlot {
+public:
+    ThreadMetrics *block = nullptr;
+    ~ThreadSlot() {
+        if (!block) return;
+        MetricsRegistry &r = registry();
+        lock_guard<mutex> lock(r.m);
+        r.free.push_back(block);
+    }
+};
+
+static thread_local ThreadSlot slot;
+
+static ThreadMetrics &localMetrics() {
+    if (slot.block) return *slot.block;
+    MetricsRegistry &r = registry();
+    lock_guard<mutex> lock(r.m);
+    if (!r.free.empty()) {
+        slot.block = r.free.back();
+        r.free.pop_back();
+    } else {
+        slot.block = new ThreadMetrics();   // value-initialized: all zero
+        r.all.push_back(slot.block);
+    }
+    return *slot.block;
+}
+
+// Single writer per block, so a relaxed load + store is enough; no locked
+// read-modify-write.
+static inline void bump(atomic<uint64_t> &a, uint64_t n) {
+    a.store(a.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void metricAdd(MetricCounter c, uint64_t n) {
+    bump(localMetrics().counters[c], n);
+}
+
+void metricRecord(MetricHistogram h, uint64_t value) {
+    ThreadHistogram &t = localMetrics().histograms[h];
+    bump(t.count, 1);
+    bump(t.sum, value);
+    if (value > t.max.load(memory_order_relaxed)) t.max.store(value, memory_order_relaxed);
+    bump(t.buckets[metricBucket(value)], 1);
+}
+
+// -------- BUCKETS --------
+static unsigned highestBit(uint64_t v) {
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanReverse64(&i, v);
+    return static_cast<unsigned>(i);
+#else
+    return 63u - static_cast<unsigned>(__builtin_clzll(v));
+#endif
+}
+
+size_t metricBucket(uint64_t value) {
+    const uint64_t sub = 1u << METRIC_SUB_BITS;
+    if (value < sub) return static_cast<size_t>(value);
+    unsigned msb = highestBit(value);
+    return (static_cast<size_t>(msb - METRIC_SUB_BITS + 1) << METRIC_SUB_BITS) +
+           static_cast<size_t>((value >> (msb - METRIC_SUB_BITS)) & (sub - 1));
+}
+
+uint64_t metricBucketLow(size_t bucket) {
+    const size_t sub = size_t(1) << METRIC_SUB_BITS;
+    if (bucket < sub) return bucket;
+    unsigned msb = static_cast<unsigned>(bucket >> METRIC_SUB_BITS) + METRIC_SUB_BITS - 1;
+    return static_cast<uint64_t>(sub + (bucket & (sub - 1))) << (msb - METRIC_SUB_BITS);
+}
+
+uint64_t metricBucketHigh(size_t bucket) {
+    const size_t sub = size_t(1) << METRIC_SUB_BITS;
+    if (bucket < sub) return bucket;
+    unsigned msb = static_cast<unsigned>(bucket >> METRIC_SUB_BITS) + METRIC_SUB_BITS - 1;
+    return metricBucketLow(bucket) + ((uint64_t(1) << (msb - METRIC_SUB_BITS)) - 1);
+}
+
+uint64_t HistogramSnapshot::percentile(double q) const {
+    if (count == 0) return 0;
+    uint64_t rank = static_cast<uint64_t>(ceil(q * static_cast<double>(count)));
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < buckets.size(); ++b) {
+        seen += buckets[b];
+        if (seen >= rank) return min(metricBucketHigh(b), max);
+    }
+    return max;
+}
+
+// -------- SNAPSHOT --------
+MetricsSnapshot CollectMetrics() {
+    MetricsSnapshot s;
+    MetricsRegistry &r = registry();
+    lock_guard<mutex> lock(r.m);
+    for (ThreadMetrics *t : r.all) {
+        for (size_t c = 0; c < METRIC_COUNTER_COUNT; ++c)
+            s.counters[c] += t->counters[c].load(memory_order_relaxed);
+        for (size_t h = 0; h < METRIC_HISTOGRAM_COUNT; ++h) {
+            const ThreadHistogram &src = t->histograms[h];
+            HistogramSnapshot &dst = s.histograms[h];
+            dst.count += src.count.load(memory_order_relaxed);
+            dst.sum += src.sum.load(memory_order_relaxed);
+            dst.max = std::max(dst.max, src.max.load(memory_order_relaxed));
+            for (size_t b = 0; b < METRIC_BUCKETS; ++b) dst.buckets[b] += src.buckets[b].load(memory_order_relaxed);
+        }
+    }
+    return s;
+}
+
+// -------- NAMES --------
+struct MetricInfo {
+    const char *name;
+    const char *help;
+};
+
+static const MetricInfo COUNTER_INFO[METRIC_COUNTER_COUNT] = {
+    {"peerstorm_bencode_bytes_total", "Bytes of bencode validated or decoded."},
+    {"peerstorm_sha1_bytes_total", "Bytes hashed with SHA-1."},
+    {"peerstorm_sha256_bytes_total", "Bytes hashed with SHA-256."},
+    {"peerstorm_parse_files_total", "Torrent files parsed."},
+    {"peerstorm_parse_errors_total", "Torrent files rejected by the parser."},
+    {"peerstorm_io_read_bytes_total", "Bytes read from disk for piece checks."},
+    {"peerstorm_pieces_checked_total", "Pieces read back and hashed."},
+    {"peerstorm_pieces_hashed_on_receive_total", "Pieces checked from blocks hashed as they arrived."},
+    {"peerstorm_pieces_failed_total", "Pieces that failed their hash check."},
+    {"peerstorm_daemon_requests_total", "Requests handled by the daemon."},
+    {"peerstorm_daemon_errors_total", "Daemon requests that returned an error."},
+};
+
+static const MetricInfo HISTOGRAM_INFO[METRIC_HISTOGRAM_COUNT] = {
+    {"peerstorm_bencode_seconds", "Time per bencode validation or tape build."},
+    {"peerstorm_sha1_seconds", "Time per SHA-1 of at least 4 KiB."},
+    {"peerstorm_sha256_seconds", "Time per SHA-256 of at least 4 KiB."},
+    {"peerstorm_parse_read_seconds", "ParseFile: opening and mapping or reading the file."},
+    {"peerstorm_parse_scan_seconds", "ParseFile: stage-one validation."},
+    {"peerstorm_parse_extract_seconds", "ParseFile: streaming decode into metadata."},
+    {"peerstorm_parse_hash_seconds", "ParseFile: info hash computation."},
+    {"peerstorm_parse_seconds", "ParseFile: everything after the read."},
+    {"peerstorm_io_read_seconds", "Time to read one piece from disk."},
+    {"peerstorm_piece_check_seconds", "Time to read and hash one piece."},
+    {"peerstorm_piece_finish_seconds", "Time to complete the check of a piece hashed on receive."},
+    {"peerstorm_daemon_request_seconds", "Daemon request handling time."},
+};
+
+const char *MetricCounterName(MetricCounter c) { return COUNTER_INFO[c].name; }
+const char *MetricHistogramName(MetricHistogram h) { return HISTOGRAM_INFO[h].name; }
+
+// -------- FORMATTING --------
+static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+std::string FormatMetricsPrometheus(const MetricsSnapshot &s) {
+    string out;
+    char line[256];
+    for (size_t c = 0; c < METRIC_COUNTER_COUNT; ++c) {
+        const MetricInfo &m = COUNTER_INFO[c];
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", m.name, m.help, m.name, m.name,
+                 static_cast<unsigned long long>(s.counters[c]));
+        out += line;
+    }
+    for (size_t h = 0; h < METRIC_HISTOGRAM_COUNT; ++h) {
+        const MetricInfo &m = HISTOGRAM_INFO[h];
+        const HistogramSnapshot &hs = s.histograms[h];
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s summary\n", m.name, m.help, m.name);
+        out += line;
+        for (double q : QUANTILES) {
+            snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %.9g\n", m.name, q, hs.percentile(q) * 1e-9);
+            out += line;
+        }
+        snprintf(line, sizeof(line), "%s_sum %.9g\n%s_count %llu\n", m.name, static_cast<double>(hs.sum) * 1e-9,
+                 m.name, static_cast<unsigned long long>(hs.count));
+        out += line;
+    }
+    return out;
+}
+
+static string formatDuration(uint64_t ns) {
+    char buf[32];
+    if (ns < 1000) snprintf(buf, sizeof(buf), "%lluns", static_cast<unsigned long long>(ns));
+    else if (ns < 1000000) snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, sizeof(buf), "%.1fms", ns / 1e6);
+    else snprintf(buf, sizeof(buf), "%.2fs", ns / 1e9);
+    return buf;
+}
+
+std::string FormatMetricsTable(const MetricsSnapshot &s) {
+    string out;
+    char line[256];
+    for (size_t c = 0; c < METRIC_COUNTER_COUNT; ++c) {
+        // drop the "peerstorm_" prefix for display
+        snprintf(line, sizeof(line), "%-32s %llu\n", COUNTER_INFO[c].name + 10,
+                 static_cast<unsigned long long>(s.counters[c]));
+        out += line;
+    }
+    snprintf(line, sizeof(line), "\n%-32s %10s %9s %9s %9s %9s %9s\n", "timer", "count", "p50", "p90", "p99", "max",
+             "total");
+    out += line;
+    for (size_t h = 0; h < METRIC_HISTOGRAM_COUNT; ++h) {
+        const HistogramSnapshot &hs = s.histograms[h];
+        snprintf(line, sizeof(line), "%-32s %10llu %9s %9s %9s %9s %9s\n", HISTOGRAM_INFO[h].name + 10,
+                 static_cast<unsigned long long>(hs.count), formatDuration(hs.percentile(0.5)).c_str(),
+                 formatDuration(hs.percentile(0.9)).c_str(), formatDuration(hs.percentile(0.99)).c_str(),
+                 formatDuration(hs.max).c_str(), formatDuration(hs.sum).c_str());
+        out += line;
+    }
+    return out;
+}
@@ -0,0 +1,136 @@
+#include "../include/peer_wire.h"
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+static const char PROTOCOL[] = "BitTorrent protocol";
+
+static void putU32(string &out, uint32_t v) {
+    char b[4] = {static_cast<char>(v >> 24), static_cast<char>(v >> 16), static_cast<char>(v >> 8),
+                 static_cast<char>(v)};
+    out.append(b, 4);
+}
+
+static uint32_t getU32(const char *p) {
+    const uint8_t *u = reinterpret_cast<const uint8_t *>(p);
+    return (static_cast<uint32_t>(u[0]) << 24) | (u[1] << 16) | (u[2] << 8) | u[3];
+}
+
+std::string EncodeHandshake(const std::vector<uint8_t> &info_hash, const std::string &peer_id) {
+    if (info_hash.size() < 20 || peer_id.size() != 20) throw runtime_error("handshake needs a 20-byte hash and peer id");
+    string out;
+    out.reserve(PEER_HANDSHAKE_SIZE);
+    out += static_cast<char>(sizeof(PROTOCOL) - 1);
+    out += PROTOCOL;
+    out.append(8, '\0');
+    out.append(reinterpret_cast<const char *>(info_hash.data()), 20);
+    out += peer_id;
+    return out;
+}
+
+bool TakeHandshake(const std::string &buf, size_t &pos, std::vector<uint8_t> &info_hash, std::string &peer_id) {
+    if (buf.size() - pos < PEER_HANDSHAKE_SIZE) return false;
+    const char *p = buf.data() + pos;
+    if (static_cast<uint8_t>(p[0]) != sizeof(PROTOCOL) - 1 || memcmp(p + 1, PROTOCOL, sizeof(PROTOCOL) - 1) != 0)
+        throw runtime_error("peer: not a BitTorrent handshake");
+    info_hash.assign(p + 28, p + 48);
+    peer_id.assign(p + 48, 20);
+    pos += PEER_HANDSHAKE_SIZE;
+    return true;
+}
+
+void AppendMessage(std::string &out, PeerMessageId id) {
+    putU32(out, 1);
+    out += static_cast<char>(id);
+}
+
+void AppendHave(std::string &out, uint32_t piece) {
+    putU32(out, 5);
+    out += static_cast<char>(MSG_HAVE);
+    putU32(out, piece);
+}
+
+void AppendBitfield(std::string &out, const std::vector<bool> &have) {
+    size_t bytes = (have.size() + 7) / 8;
+    putU32(out, static_cast<uint32_t>(1 + bytes));
+    out += static_cast<char>(MSG_BITFIELD);
+    size_t at = out.size();
+    out.append(bytes, '\0');
+    for (size_t i = 0; i < have.size(); ++i)
+        if (have[i]) out[at + i / 8] = static_cast<char>(out[at + i / 8] | (0x80 >> (i % 8)));
+}
+
+void AppendRequest(std::string &out, PeerMessageId id, uint32_t piece, uint32_t begin, uint32_t length) {
+    putU32(out, 13);
+    out += static_cast<char>(id);
+    putU32(out, piece);
+    putU32(out, begin);
+    putU32(out, length);
+}
+
+void AppendPiece(std::string &out, uint32_t piece, uint32_t begin, const uint8_t *data, size_t len) {
+    putU32(out, static_cast<uint32_t>(9 + len));
+    out += static_cast<char>(MSG_PIECE);
+    putU32(out, piece);
+    putU32(out, begin);
+    out.append(reinterpret_cast<const char *>(data), len);
+}
+
+bool TakeMessage(const std::string &buf, size_t &pos, PeerMessage &msg) {
+    for (;;) {
+        if (buf.size() - pos < 4) return false;
+        uint32_t len = getU32(buf.data() + pos);
+        if (len > PEER_MAX_MESSAGE) throw runtime_error("peer: message of " + to_string(len) + " bytes");
+        if (buf.size() - pos - 4 < len) return false;
+        const char *p = buf.data() + pos + 4;
+        pos += 4 + len;
+
+        msg = PeerMessage();
+        if (len == 0) return true;   // keep-alive
+        int id = static_cast<uint8_t>(p[0]);
+        const char *body = p + 1;
+        size_t body_len = len - 1;
+        switch (id) {
+        case MSG_CHOKE:
+        case MSG_UNCHOKE:
+        case MSG_INTERESTED:
+        case MSG_NOT_INTERESTED:
+            if (body_len != 0) throw runtime_error("peer: malformed message");
+            break;
+        case MSG_HAVE:
+            if (body_len != 4) throw runtime_error("peer: malformed have");
+            msg.piece = getU32(body);
+            break;
+        case MSG_BITFIELD:
+            msg.payload = string_view(body, body_len);
+            break;
+        case MSG_REQUEST:
+        case MSG_CANCEL:
+            if (body_len != 12) throw runtime_error("peer: malformed request");
+            msg.piece = getU32(body);
+            msg.begin = getU32(body + 4);
+            msg.length = getU32(body + 8);
+            break;
+        case MSG_PIECE:
+            if (body_len < 8) throw runtime_error("peer: malformed piece");
+            msg.piece = getU32(body);
+            msg.begin = getU32(body + 4);
+            msg.payload = string_view(body + 8, body_len - 8);
+            msg.length = static_cast<uint32_t>(msg.payload.size());
+            break;
+        default:
+            continue;   // extension messages are not supported; skip them
+        }
+        msg.id = static_cast<PeerMessageId>(id);
+        return true;
+    }
+}
+
+std::vector<bool> DecodeBitfield(std::string_view bits, size_t num_pieces) {
+    if (bits.size() != (num_pieces + 7) / 8) throw runtime_error("peer: bitfield has the wrong size");
+    vector<bool> have(num_pieces);
+    for (size_t i = 0; i < num_pieces; ++i) have[i] = (static_cast<uint8_t>(bits[i / 8]) & (0x80 >> (i % 8))) != 0;
+    return have;
+}
@@ -0,0 +1,117 @@
+#include "../include/piece_hasher.h"
+#include "../include/merkle.h"
+#include "../include/metrics.h"
+#include "../include/sha256.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+PieceHasher::PieceHasher(const TorrentMetadata &meta, const FileStorage &storage, PieceStore &store,
+                         size_t memory_budget)
+    : meta_(meta), storage_(storage), store_(store), budget_(memory_budget) {}
+
+void PieceHasher::addBlock(size_t piece, uint32_t begin, const uint8_t *data, size_t len) {
+    int64_t size = storage_.pieceSize(piece);
+    if (static_cast<int64_t>(begin) + static_cast<int64_t>(len) > size) throw runtime_error("Block outside its piece");
+    PartialPiece &pp = pieces_[piece];
+    pp.received += len;
+
+    if (!meta_.has_v1) {
+        // leaves are 16 KiB blocks of the piece; the last may be short
+        if (begin % MERKLE_BLOCK_SIZE != 0 || (len != MERKLE_BLOCK_SIZE && begin + len != static_cast<uint64_t>(size)))
+            throw runtime_error("v2 pieces are hashed in 16 KiB blocks");
+        size_t blocks = (static_cast<size_t>(size) + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE;
+        if (pp.leaves.empty()) pp.leaves.assign(blocks * MERKLE_HASH_SIZE, 0);
+        sha256_raw(data, len, &pp.leaves[begin / MERKLE_BLOCK_SIZE * MERKLE_HASH_SIZE]);
+        return;
+    }
+
+    if (begin == pp.hashed) {
+        pp.sha1.update(data, len);
+        pp.hashed += static_cast<uint32_t>(len);
+        advance(piece, pp);
+    } else if (begin < pp.hashed) {
+        throw runtime_error("Block added twice");
+    } else if (buffered_ + len <= budget_) {
+        pp.ahead[begin].assign(data, data + len);
+        buffered_ += len;
+        peak_buffered_ = max(peak_buffered_, buffered_);
+    } else {
+        pp.on_disk[begin] = static_cast<uint32_t>(len);
+    }
+}
+
+// Consume early blocks that have become contiguous with the hash position
+void PieceHasher::advance(size_t piece, PartialPiece &pp) {
+    for (;;) {
+        auto it = pp.ahead.find(pp.hashed);
+        if (it != pp.ahead.end()) {
+            pp.sha1.update(it->second.data(), it->second.size());
+            pp.hashed += static_cast<uint32_t>(it->second.size());
+            buffered_ -= it->second.size();
+            pp.ahead.erase(it);
+            continue;
+        }
+        auto d = pp.on_disk.find(pp.hashed);
+        if (d == pp.on_disk.end()) return;
+        scratch_.resize(d->second);
+        if (!store_.readBlock(piece, d->first, scratch_.data(), scratch_.size())) {
+            pp.read_failed = true;
+            return;
+        }
+        disk_read_ += d->second;
+        pp.sha1.update(scratch_.data(), scratch_.size());
+        pp.hashed += d->second;
+        pp.on_disk.erase(d);
+    }
+}
+
+bool PieceHasher::finishV2(size_t piece, const PartialPiece &pp) const {
+    vector<FileSlice> slices = storage_.mapPiece(piece);
+    if (slices.size() != 1) return false;
+    size_t fi = slices[0].file_index;
+    size_t width;
+    const uint8_t *expected;
+    if (const uint8_t *layer = meta_.files.pieceLayer(fi)) {
+        width = static_cast<size_t>(meta_.piece_length) / MERKLE_BLOCK_SIZE;
+        expected = layer + static_cast<size_t>(slices[0].offset / meta_.piece_length) * MERKLE_HASH_SIZE;
+    } else {
+        size_t blocks = (static_cast<size_t>(meta_.files.length(fi)) + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE;
+        width = merkleNumLeaves(blocks);
+        expected = meta_.files.piecesRoot(fi);
+    }
+    if (!expected || pp.leaves.size() / MERKLE_HASH_SIZE > width) return false;
+    vector<uint8_t> root = merkleRoot(pp.leaves, width, vector<uint8_t>(MERKLE_HASH_SIZE, 0));
+    return memcmp(root.data(), expected, MERKLE_HASH_SIZE) == 0;
+}
+
+bool PieceHasher::finish(size_t piece) {
+    MetricTimer timer(METRIC_PIECE_FINISH_NS);
+    auto it = pieces_.find(piece);
+    bool ok = false;
+    if (it != pieces_.end()) {
+        PartialPiece &pp = it->second;
+        uint64_t size = static_cast<uint64_t>(storage_.pieceSize(piece));
+        if (pp.received == size && !meta_.has_v1) {
+            ok = finishV2(piece, pp);
+        } else if (pp.received == size && pp.hashed == size && !pp.read_failed) {
+            uint8_t digest[20];
+            pp.sha1.finish(digest);
+            ok = (piece + 1) * 20 <= meta_.pieces.size() && memcmp(digest, &meta_.pieces[piece * 20], 20) == 0;
+        }
+        discard(piece);
+    }
+    metricAdd(METRIC_PIECES_HASHED_ON_RECEIVE);
+    if (!ok) metricAdd(METRIC_PIECES_FAILED);
+    return ok;
+}
+
+void PieceHasher::discard(size_t piece) {
+    auto it = pieces_.find(piece);
+    if (it == pieces_.end()) return;
+    for (auto &b : it->second.ahead) buffered_ -= b.second.size();
+    pieces_.erase(it);
+}
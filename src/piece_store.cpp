@@ -0,0 +1,313 @@
+#include "../include/piece_store.h"
+#include "../include/magnet_parser.h"
+#include "../include/metrics.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// ------------------------------
+// Priorities
+// ------------------------------
+FilePriority ParseFilePriority(const std::string &name) {
+    if (name == "skip") return PRIORITY_SKIP;
+    if (name == "low") return PRIORITY_LOW;
+    if (name == "normal") return PRIORITY_NORMAL;
+    if (name == "high") return PRIORITY_HIGH;
+    throw runtime_error("Unknown priority \"" + name + "\" (expected skip, low, normal or high)");
+}
+
+const char *FilePriorityName(uint8_t priority) {
+    if (priority == PRIORITY_SKIP) return "skip";
+    if (priority <= PRIORITY_LOW) return "low";
+    if (priority < PRIORITY_HIGH) return "normal";
+    return "high";
+}
+
+std::vector<uint8_t> PiecePriorities(const TorrentMetadata &meta, const FileStorage &storage,
+                                     const std::vector<uint8_t> &file_priorities) {
+    vector<uint8_t> out(storage.numPieces(), PRIORITY_SKIP);
+    for (size_t i = 0; i < meta.files.size(); ++i) {
+        if (meta.files.isPad(i)) continue;
+        uint8_t prio = i < file_priorities.size() ? file_priorities[i] : static_cast<uint8_t>(PRIORITY_NORMAL);
+        if (prio == PRIORITY_SKIP) continue;
+        auto range = storage.filePieceRange(i);
+        for (size_t p = range.first; p < range.second; ++p) out[p] = max(out[p], prio);
+    }
+    return out;
+}
+
+// ------------------------------
+// PartFile
+// ------------------------------
+static const char PART_MAGIC[4] = {'P', 'S', 'P', 'F'};
+static const uint32_t PART_VERSION = 1;
+static const uint64_t PART_ALIGN = 4096;
+
+static void putU32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; ++i) p[i] = static_cast<uint8_t>(v >> (8 * i));
+}
+
+static uint32_t getU32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+PartFile::PartFile(std::string path, int64_t piece_length, size_t num_pieces)
+    : path_(std::move(path)), piece_length_(piece_length), slots_(num_pieces, NO_SLOT) {
+    ifstream in(path_, ios::binary);
+    if (!in) return;
+
+    vector<uint8_t> header(16 + 4 * num_pieces);
+    if (!in.read(reinterpret_cast<char *>(header.data()), static_cast<streamsize>(header.size())) ||
+        memcmp(header.data(), PART_MAGIC, 4) != 0 || getU32(&header[4]) != PART_VERSION)
+        throw runtime_error("Not a PeerStorm part file: " + path_);
+    if (getU32(&header[8]) != static_cast<uint32_t>(piece_length) || getU32(&header[12]) != num_pieces)
+        throw runtime_error("Part file belongs to a different torrent: " + path_);
+
+    vector<char> taken;
+    for (size_t p = 0; p < num_pieces; ++p) {
+        uint32_t slot = getU32(&header[16 + 4 * p]);
+        if (slot == NO_SLOT) continue;
+        slots_[p] = slot;
+        ++used_;
+        next_slot_ = max(next_slot_, slot + 1);
+        if (taken.size() <= slot) taken.resize(slot + 1, 0);
+        taken[slot] = 1;
+    }
+    for (uint32_t s = 0; s < next_slot_; ++s)
+        if (!taken[s]) free_.push_back(s);
+}
+
+uint64_t PartFile::headerSize() const {
+    return (16 + 4 * static_cast<uint64_t>(slots_.size()) + PART_ALIGN - 1) / PART_ALIGN * PART_ALIGN;
+}
+
+void PartFile::open() {
+    if (file_.is_open()) return;
+    if (!fs::exists(path_)) {
+        vector<uint8_t> header(static_cast<size_t>(headerSize()), 0xFF);
+        memcpy(header.data(), PART_MAGIC, 4);
+        putU32(&header[4], PART_VERSION);
+        putU32(&header[8], static_cast<uint32_t>(piece_length_));
+        putU32(&header[12], static_cast<uint32_t>(slots_.size()));
+        fs::path parent = fs::path(path_).parent_path();
+        if (!parent.empty()) fs::create_directories(parent);
+        ofstream out(path_, ios::binary);
+        if (!out.write(reinterpret_cast<const char *>(header.data()), static_cast<streamsize>(header.size())))
+            throw runtime_error("Cannot create part file " + path_);
+    }
+    file_.open(path_, ios::binary | ios::in | ios::out);
+    if (!file_) throw runtime_error("Cannot open part file " + path_);
+}
+
+void PartFile::writeSlotEntry(size_t piece) {
+    uint8_t entry[4];
+    putU32(entry, slots_[piece]);
+    file_.seekp(static_cast<streamoff>(16 + 4 * piece));
+    if (!file_.write(reinterpret_cast<const char *>(entry), 4)) throw runtime_error("Error writing " + path_);
+}
+
+void PartFile::write(size_t piece, int64_t offset, const uint8_t *data, size_t len) {
+    open();
+    if (slots_[piece] == NO_SLOT) {
+        if (!free_.empty()) {
+            slots_[piece] = free_.back();
+            free_.pop_back();
+        } else {
+            slots_[piece] = next_slot_++;
+        }
+        ++used_;
+        writeSlotEntry(piece);
+    }
+    file_.seekp(static_cast<streamoff>(headerSize() + static_cast<uint64_t>(slots_[piece]) * piece_length_ + offset));
+    if (!file_.write(reinterpret_cast<const char *>(data), static_cast<streamsize>(len)) || !file_.flush())
+        throw runtime_error("Error writing " + path_);
+}
+
+bool PartFile::read(size_t piece, int64_t offset, uint8_t *data, size_t len) {
+    if (slots_[piece] == NO_SLOT) return false;
+    open();
+    file_.seekg(static_cast<streamoff>(headerSize() + static_cast<uint64_t>(slots_[piece]) * piece_length_ + offset));
+    if (file_.read(reinterpret_cast<char *>(data), static_cast<streamsize>(len))) return true;
+    file_.clear();
+    return false;
+}
+
+void PartFile::release(size_t piece) {
+    if (slots_[piece] == NO_SLOT) return;
+    open();
+    free_.push_back(slots_[piece]);
+    slots_[piece] = NO_SLOT;
+    --used_;
+    writeSlotEntry(piece);
+    file_.flush();
+}
+
+// ------------------------------
+// PieceStore
+// ------------------------------
+PieceStore::PieceStore(const TorrentMetadata &meta, const FileStorage &storage, std::string root_dir)
+    : meta_(meta), storage_(storage), root_dir_(std::move(root_dir)),
+      file_prio_(meta.files.size(), PRIORITY_NORMAL),
+      piece_prio_(storage.numPieces(), PRIORITY_NORMAL),
+      part_((fs::path(root_dir_) / ("." + toHex(meta.info_hash) + ".parts")).string(), meta.piece_length,
+            storage.numPieces()) {
+    // resolved once, so a torrent whose paths leave root_dir fails here, before anything is written
+    paths_.reserve(meta.files.size());
+    for (size_t i = 0; i < meta.files.size(); ++i) paths_.push_back(FilePathOnDisk(meta_, i, root_dir_));
+    piece_prio_ = PiecePriorities(meta_, storage_, file_prio_);
+}
+
+bool PieceStore::skipped(size_t file_index) const {
+    return file_prio_[file_index] == PRIORITY_SKIP && !meta_.files.isPad(file_index);
+}
+
+bool PieceStore::isEdgePiece(size_t piece) const {
+    if (!wanted(piece)) return false;
+    for (auto &s : storage_.mapPiece(piece))
+        if (skipped(s.file_index)) return true;
+    return false;
+}
+
+// Where a slice starts inside its piece
+static int64_t offsetInPiece(const FileStorage &storage, const FileSlice &s, size_t piece, int64_t piece_length) {
+    return static_cast<int64_t>(storage.fileOffset(s.file_index) + static_cast<uint64_t>(s.offset) -
+                                static_cast<uint64_t>(piece) * static_cast<uint64_t>(piece_length));
+}
+
+void PieceStore::setFilePriorities(const std::vector<uint8_t> &priorities) {
+    vector<uint8_t> old = file_prio_;
+    for (size_t i = 0; i < file_prio_.size(); ++i)
+        file_prio_[i] = i < priorities.size() ? priorities[i] : static_cast<uint8_t>(PRIORITY_NORMAL);
+
+    // Files that stop being skipped take their parked bytes back; pieces that
+    // no longer hold any skipped bytes give their slot up.
+    vector<uint8_t> buf;
+    for (size_t i = 0; i < file_prio_.size(); ++i) {
+        if ((old[i] == PRIORITY_SKIP) == (file_prio_[i] == PRIORITY_SKIP) || meta_.files.isPad(i)) continue;
+        auto range = storage_.filePieceRange(i);
+        for (size_t p = range.first; p < range.second; ++p) {
+            if (!part_.hasPiece(p)) continue;
+            bool still_needed = false;
+            for (auto &s : storage_.mapPiece(p)) {
+                if (skipped(s.file_index)) {
+                    still_needed = true;
+                } else if (s.file_index == i) {
+                    buf.resize(static_cast<size_t>(s.length));
+                    if (part_.read(p, offsetInPiece(storage_, s, p, meta_.piece_length), buf.data(), buf.size()))
+                        writeFileRange(i, s.offset, buf.data(), buf.size());
+                }
+            }
+            if (!still_needed) part_.release(p);
+        }
+    }
+    piece_prio_ = PiecePriorities(meta_, storage_, file_prio_);
+}
+
+void PieceStore::writeFileRange(size_t file_index, int64_t offset, const uint8_t *data, size_t len) {
+    const fs::path path = paths_[file_index];
+    fstream f(path, ios::binary | ios::in | ios::out);
+    if (!f) {
+        if (path.has_parent_path()) fs::create_directories(path.parent_path());
+        ofstream(path, ios::binary);
+        f.open(path, ios::binary | ios::in | ios::out);
+        if (!f) throw runtime_error("Cannot open " + path.string() + " for writing");
+    }
+    f.seekp(offset);
+    if (!f.write(reinterpret_cast<const char *>(data), static_cast<streamsize>(len)))
+        throw runtime_error("Error writing " + path.string());
+}
+
+bool PieceStore::readFileRange(size_t file_index, int64_t offset, uint8_t *data, size_t len) const {
+    ifstream f(paths_[file_index], ios::binary);
+    if (!f) return false;
+    f.seekg(offset);
+    return static_cast<bool>(f.read(reinterpret_cast<char *>(data), static_cast<streamsize>(len)));
+}
+
+void PieceStore::writePiece(size_t piece, const uint8_t *data, size_t len) {
+    size_t size = static_cast<size_t>(storage_.pieceSize(piece));
+    if (len < size) throw runtime_error("Piece data too short");
+    writeBlock(piece, 0, data, size);
+}
+
+bool PieceStore::readPiece(size_t piece, std::vector<uint8_t> &buf) {
+    buf.resize(static_cast<size_t>(storage_.pieceSize(piece)));
+    return readBlock(piece, 0, buf.data(), buf.size());
+}
+
+void PieceStore::writeBlock(size_t piece, int64_t offset, const uint8_t *data, size_t len) {
+    int64_t end = offset + static_cast<int64_t>(len);
+    if (offset < 0 || end > storage_.pieceSize(piece)) throw runtime_error("Block outside its piece");
+    for (auto &s : storage_.mapPiece(piece)) {
+        int64_t at = offsetInPiece(storage_, s, piece, meta_.piece_length);
+        int64_t from = max(at, offset), to = min(at + s.length, end);
+        if (from >= to || meta_.files.isPad(s.file_index)) continue;
+        const uint8_t *src = data + (from - offset);
+        size_t n = static_cast<size_t>(to - from);
+        if (skipped(s.file_index)) part_.write(piece, from, src, n);
+        else writeFileRange(s.file_index, s.offset + (from - at), src, n);
+    }
+}
+
+bool PieceStore::readBlock(size_t piece, int64_t offset, uint8_t *data, size_t len) {
+    int64_t end = offset + static_cast<int64_t>(len);
+    if (offset < 0 || end > storage_.pieceSize(piece)) return false;
+    memset(data, 0, len);
+    for (auto &s : storage_.mapPiece(piece)) {
+        int64_t at = offsetInPiece(storage_, s, piece, meta_.piece_length);
+        int64_t from = max(at, offset), to = min(at + s.length, end);
+        if (from >= to || meta_.files.isPad(s.file_index)) continue;
+        uint8_t *dst = data + (from - offset);
+        size_t n = static_cast<size_t>(to - from);
+        // a skipped file may still exist on disk from before it was skipped
+        if (skipped(s.file_index) && part_.read(piece, from, dst, n)) continue;
+        if (!readFileRange(s.file_index, s.offset + (from - at), dst, n)) return false;
+        metricAdd(METRIC_IO_READ_BYTES, n);
+    }
+    return true;
+}
+
+bool PieceStore::checkPiece(size_t piece) {
+    MetricTimer timer(METRIC_PIECE_CHECK_NS);
+    vector<uint8_t> buf;
+    bool ok = readPiece(piece, buf) && PieceMatches(meta_, storage_, piece, buf.data(), buf.size());
+    metricAdd(METRIC_PIECES_CHECKED);
+    if (!ok) metricAdd(METRIC_PIECES_FAILED);
+    return ok;
+}
+
+uint64_t PieceStore::wantedFileBytes() const {
+    uint64_t n = 0;
+    for (size_t i = 0; i < file_prio_.size(); ++i)
+        if (file_prio_[i] != PRIORITY_SKIP && !meta_.files.isPad(i)) n += static_cast<uint64_t>(meta_.files.length(i));
+    return n;
+}
+
+uint64_t PieceStore::wantedPieceBytes() const {
+    uint64_t n = 0;
+    for (size_t p = 0; p < piece_prio_.size(); ++p)
+        if (piece_prio_[p] != PRIORITY_SKIP) n += static_cast<uint64_t>(storage_.pieceSize(p));
+    return n;
+}
+
+size_t PieceStore::edgePieces() const {
+    // only the first and last piece of a skipped file can be shared
+    vector<char> seen(piece_prio_.size(), 0);
+    size_t n = 0;
+    for (size_t i = 0; i < file_prio_.size(); ++i) {
+        if (!skipped(i) || meta_.files.length(i) == 0) continue;
+        auto range = storage_.filePieceRange(i);
+        for (size_t p : {range.first, range.second - 1}) {
+            if (wanted(p) && !seen[p]) {
+                seen[p] = 1;
+                ++n;
+            }
+        }
+    }
+    return n;
+}
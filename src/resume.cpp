@@ -0,0 +1,298 @@
+#include "../include/resume.h"
+#include "../include/bencode.h"
+#include "../include/piece_store.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+
+bool ResumeData::hasPiece(size_t piece) const {
+    size_t byte = piece / 8;
+    return byte < have.size() && (have[byte] & (0x80 >> (piece % 8))) != 0;
+}
+
+void ResumeData::setPiece(size_t piece, bool value) {
+    size_t byte = piece / 8;
+    if (byte >= have.size()) have.resize(byte + 1, 0);
+    if (value) have[byte] |= static_cast<uint8_t>(0x80 >> (piece % 8));
+    else have[byte] &= static_cast<uint8_t>(~(0x80 >> (piece % 8)));
+}
+
+// -------- ENCODE / DECODE --------
+std::string EncodeResume(const ResumeData &rd) {
+    BDict d;
+    d["file-format"] = BValue("PeerStorm resume");
+    d["file-version"] = BValue(1LL);
+    d["info-hash"] = BValue(string(rd.info_hash.begin(), rd.info_hash.end()));
+    d["save path"] = BValue(rd.save_path);
+    d["pieces"] = BValue(string(rd.have.begin(), rd.have.end()));
+
+    BList files;
+    for (auto &f : rd.files) {
+        BList entry;
+        entry.push_back(BValue(static_cast<long long>(f.size)));
+        entry.push_back(BValue(static_cast<long long>(f.mtime)));
+        files.push_back(BValue(entry));
+    }
+    d["files"] = BValue(files);
+
+    BList unfinished;
+    for (auto &kv : rd.unfinished) {
+        BDict u;
+        u["piece"] = BValue(static_cast<long long>(kv.first));
+        u["bitmask"] = BValue(string(kv.second.begin(), kv.second.end()));
+        unfinished.push_back(BValue(u));
+    }
+    d["unfinished"] = BValue(unfinished);
+    if (!rd.file_priorities.empty())
+        d["file priority"] = BValue(string(rd.file_priorities.begin(), rd.file_priorities.end()));
+
+    return bencode_value(BValue(d));
+}
+
+ResumeData DecodeResume(const std::string &data) {
+    size_t pos = 0;
+    BValue root = decodeValue(data, pos);
+    const BDict &d = root.asDict();
+    if (!d.count("file-format") || d.at("file-format").asString() != "PeerStorm resume")
+        throw runtime_error("Not a PeerStorm resume file");
+
+    ResumeData rd;
+    const string &ih = d.at("info-hash").asString();
+    rd.info_hash.assign(ih.begin(), ih.end());
+    if (d.count("save path")) rd.save_path = d.at("save path").asString();
+    const string &have = d.at("pieces").asString();
+    rd.have.assign(have.begin(), have.end());
+
+    if (d.count("files")) {
+        for (auto &entry : d.at("files").asList()) {
+            const BList &l = entry.asList();
+            ResumeFileInfo f;
+            f.size = l.at(0).asInt();
+            f.mtime = l.at(1).asInt();
+            rd.files.push_back(f);
+        }
+    }
+    if (d.count("unfinished")) {
+        for (auto &entry : d.at("unfinished").asList()) {
+            const BDict &u = entry.asDict();
+            const string &mask = u.at("bitmask").asString();
+            rd.unfinished[static_cast<uint32_t>(u.at("piece").asInt())].assign(mask.begin(), mask.end());
+        }
+    }
+    if (d.count("file priority")) {
+        const string &prio = d.at("file priority").asString();
+        rd.file_priorities.assign(prio.begin(), prio.end());
+    }
+    return rd;
+}
+
+// -------- FILE I/O --------
+void WriteResumeFile(const std::string &path, const ResumeData &rd) {
+    string data = EncodeResume(rd);
+    string tmp = path + ".tmp";
+
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) throw runtime_error("Cannot write " + tmp);
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size() && fflush(f) == 0;
+#ifdef _WIN32
+    ok = ok && _commit(_fileno(f)) == 0;
+#else
+    ok = ok && fsync(fileno(f)) == 0;
+#endif
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        remove(tmp.c_str());
+        throw runtime_error("Error writing " + tmp);
+    }
+    fs::rename(tmp, path);
+}
+
+bool LoadResumeFile(const std::string &path, ResumeData &rd) {
+    ifstream file(path, ios::binary);
+    if (!file) return false;
+    string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    try {
+        rd = DecodeResume(data);
+    } catch (const exception &) {
+        return false;   // corrupt resume data is the same as none
+    }
+    return true;
+}
+
+// -------- VALIDATION --------
+std::vector<ResumeFileInfo> SnapshotFiles(const TorrentMetadata &meta, const std::string &root_dir) {
+    vector<ResumeFileInfo> out(meta.files.size());
+    for (size_t i = 0; i < meta.files.size(); ++i) {
+        if (meta.files.isPad(i)) continue;  // pad files never hit the disk
+        error_code ec;
+        fs::path p = FilePathOnDisk(meta, i, root_dir);
+        uintmax_t size = fs::file_size(p, ec);
+        if (ec) continue;
+        auto mtime = fs::last_write_time(p, ec);
+        if (ec) continue;
+        out[i].size = static_cast<int64_t>(size);
+        out[i].mtime = static_cast<int64_t>(mtime.time_since_epoch().count());
+    }
+    return out;
+}
+
+std::vector<size_t> ValidateResume(const TorrentMetadata &meta, const FileStorage &storage,
+                                   const std::string &root_dir, ResumeData &rd) {
+    size_t n = storage.numPieces();
+    vector<size_t> recheck;
+
+    if (rd.info_hash != meta.info_hash || rd.files.empty()) {
+        vector<uint8_t> priorities;
+        if (rd.info_hash == meta.info_hash) priorities.swap(rd.file_priorities);
+        rd = ResumeData();
+        rd.info_hash = meta.info_hash;
+        rd.save_path = root_dir;
+        rd.have.assign((n + 7) / 8, 0);
+        rd.files = SnapshotFiles(meta, root_dir);
+        rd.file_priorities.swap(priorities);
+        for (size_t p = 0; p < n; ++p) recheck.push_back(p);
+        return recheck;
+    }
+
+    rd.have.resize((n + 7) / 8, 0);
+    vector<ResumeFileInfo> current = SnapshotFiles(meta, root_dir);
+    vector<bool> queued(n, false);
+
+    for (size_t i = 0; i < meta.files.size(); ++i) {
+        bool same = i < rd.files.size() && rd.files[i].size == current[i].size &&
+                    rd.files[i].mtime == current[i].mtime;
+        if (same) continue;
+
+        auto range = storage.filePieceRange(i);
+        for (size_t p = range.first; p < range.second; ++p) {
+            rd.unfinished.erase(static_cast<uint32_t>(p));
+            if (!rd.hasPiece(p) || queued[p]) continue;
+            rd.setPiece(p, false);
+            queued[p] = true;
+        }
+    }
+    for (size_t p = 0; p < n; ++p)
+        if (queued[p]) recheck.push_back(p);
+
+    rd.files = current;
+    rd.save_path = root_dir;
+    return recheck;
+}
+
+void SaveFilePriorities(const TorrentMetadata &meta, const std::vector<uint8_t> &priorities, ResumeWriter &writer) {
+    ResumeData rd;
+    LoadResumeFile(writer.pathFor(meta.info_hash), rd);
+    if (rd.info_hash != meta.info_hash) {
+        rd = ResumeData();
+        rd.info_hash = meta.info_hash;
+    }
+    rd.file_priorities = priorities;
+    rd.file_priorities.resize(meta.files.size(), PRIORITY_NORMAL);
+    writer.update(rd);
+}
+
+VerifySummary VerifyWithResume(const TorrentMetadata &meta, const FileStorage &storage,
+                               const std::string &save_path, ResumeWriter &writer) {
+    ResumeData rd;
+    LoadResumeFile(writer.pathFor(meta.info_hash), rd);
+    return VerifyWithResume(meta, storage, save_path, rd, writer);
+}
+
+VerifySummary VerifyWithResume(const TorrentMetadata &meta, const FileStorage &storage,
+                               const std::string &save_path, ResumeData &rd, ResumeWriter &writer) {
+    VerifySummary sum;
+    sum.loaded = !rd.info_hash.empty();
+    vector<size_t> recheck = ValidateResume(meta, storage, save_path, rd);
+
+    // Edge pieces keep the bytes of skipped files in the part file, which
+    // CheckPieces does not read; check those through a PieceStore.
+    vector<size_t> plain, edge;
+    bool any_skipped = find(rd.file_priorities.begin(), rd.file_priorities.end(),
+                            static_cast<uint8_t>(PRIORITY_SKIP)) != rd.file_priorities.end();
+    unique_ptr<PieceStore> store;
+    if (any_skipped) {
+        store.reset(new PieceStore(meta, storage, save_path));
+        store->setFilePriorities(rd.file_priorities);
+    }
+    for (size_t p : recheck) (store && store->isEdgePiece(p) ? edge : plain).push_back(p);
+    vector<bool> ok = CheckPieces(meta, storage, save_path, plain);
+    for (size_t i = 0; i < plain.size(); ++i) rd.setPiece(plain[i], ok[i]);
+    for (size_t p : edge) rd.setPiece(p, store->checkPiece(p));
+
+    sum.rechecked = recheck.size();
+    sum.pieces = storage.numPieces();
+    vector<uint8_t> wanted = PiecePriorities(meta, storage, rd.file_priorities);
+    for (size_t p = 0; p < sum.pieces; ++p) {
+        sum.have += rd.hasPiece(p);
+        if (wanted[p] == PRIORITY_SKIP) continue;
+        ++sum.wanted;
+        sum.wanted_have += rd.hasPiece(p);
+    }
+    writer.update(rd);
+    return sum;
+}
+
+// -------- BATCHED WRITER --------
+ResumeWriter::ResumeWriter(const std::string &dir, std::chrono::milliseconds interval)
+    : dir_(dir), interval_(interval) {
+    fs::create_directories(dir_);
+    thread_ = thread(&ResumeWriter::run, this);
+}
+
+ResumeWriter::~ResumeWriter() {
+    {
+        lock_guard<mutex> lk(m_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+    flush();
+}
+
+std::string ResumeWriter::pathFor(const std::vector<uint8_t> &info_hash) const {
+    return (fs::path(dir_) / (toHex(info_hash) + ".resume")).string();
+}
+
+void ResumeWriter::update(const ResumeData &rd) {
+    lock_guard<mutex> lk(m_);
+    pending_[toHex(rd.info_hash)] = rd;
+}
+
+void ResumeWriter::flush() {
+    map<string, ResumeData> batch;
+    {
+        lock_guard<mutex> lk(m_);
+        batch.swap(pending_);
+    }
+    for (auto &kv : batch) {
+        try {
+            WriteResumeFile(pathFor(kv.second.info_hash), kv.second);
+        } catch (const exception &e) {
+            cerr << "resume: " << e.what() << endl;
+        }
+    }
+}
+
+void ResumeWriter::run() {
+    unique_lock<mutex> lk(m_);
+    while (!stop_) {
+        cv_.wait_for(lk, interval_, [this] { return stop_; });
+        lk.unlock();
+        flush();
+        lk.lock();
+    }
+}
@@ -1,4 +1,6 @@
 #include "../include/sha1.h"
+#include "../include/metrics.h"
+#include <algorithm>
 #include <cstring>
 #include <cstdint>
 #include <vector>
@@ -14,49 +16,26 @@ static uint32_t rol(uint32_t value, unsigned int bits) {
     return (value << bits) | (value >> (32 - bits));
 }
 
-// Internal worker: compute sha1 from bytes in vector<uint8_t>
-static vector<uint8_t> sha1_from_bytes(const vector<uint8_t> &msg_in) {
-    // Initialize hash values
-    uint32_t h0 = 0x67452301;
-    uint32_t h1 = 0xEFCDAB89;
-    uint32_t h2 = 0x98BADCFE;
-    uint32_t h3 = 0x10325476;
-    uint32_t h4 = 0xC3D2E1F0;
-
-    // Make a working copy and pad
-    vector<uint8_t> msg = msg_in;
-    uint64_t originalBitLen = static_cast<uint64_t>(msg.size()) * 8ULL;
-
-    // append 0x80
-    msg.push_back(0x80);
-    // append zeros until length in bytes ≡ 56 (mod 64)
-    while ((msg.size() % 64) != 56) msg.push_back(0x00);
-
-    // append 64-bit big-endian length
-    for (int i = 7; i >= 0; --i) {
-        msg.push_back(static_cast<uint8_t>((originalBitLen >> (i * 8)) & 0xFF));
-    }
-
-    // process in 512-bit (64-byte) chunks
-    for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+// Process `blocks` 64-byte chunks of data into the running state h[5]
+static void sha1_compress(uint32_t h[5], const uint8_t *data, size_t blocks) {
+    for (; blocks > 0; --blocks, data += 64) {
         uint32_t w[80];
         // build message schedule (note explicit cast to uint32_t before shift)
         for (int j = 0; j < 16; ++j) {
-            size_t idx = chunk + j * 4;
-            w[j] = (static_cast<uint32_t>(msg[idx]) << 24)
-                 | (static_cast<uint32_t>(msg[idx + 1]) << 16)
-                 | (static_cast<uint32_t>(msg[idx + 2]) << 8)
-                 | (static_cast<uint32_t>(msg[idx + 3]));
+            w[j] = (static_cast<uint32_t>(data[j * 4]) << 24)
+                 | (static_cast<uint32_t>(data[j * 4 + 1]) << 16)
+                 | (static_cast<uint32_t>(data[j * 4 + 2]) << 8)
+                 | (static_cast<uint32_t>(data[j * 4 + 3]));
         }
         for (int j = 16; j < 80; ++j) {
             w[j] = rol(w[j-3] ^ w[j-8] ^ w[j-14] ^ w[j-16], 1);
         }
 
-        uint32_t a = h0;
-        uint32_t b = h1;
-        uint32_t c = h2;
-        uint32_t d = h3;
-        uint32_t e = h4;
+        uint32_t a = h[0];
+        uint32_t b = h[1];
+        uint32_t c = h[2];
+        uint32_t d = h[3];
+        uint32_t e = h[4];
 
         for (int j = 0; j < 80; ++j) {
             uint32_t f, k;
@@ -82,31 +61,89 @@ static vector<uint8_t> sha1_from_bytes(const vector<uint8_t> &msg_in) {
             a = temp;
         }
 
-        h0 += a;
-        h1 += b;
-        h2 += c;
-        h3 += d;
-        h4 += e;
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
     }
+}
+
+// Pad the last `rem` (< 64) bytes at `tail_data` of a `total`-byte message and
+// write the digest: append 0x80, zeros until length = 56 (mod 64), then the
+// 64-bit big-endian bit length
+static void sha1_finish(uint32_t h[5], const uint8_t *tail_data, size_t rem, uint64_t total, uint8_t *out) {
+    uint8_t tail[128] = {0};
+    if (rem) std::memcpy(tail, tail_data, rem);
+    tail[rem] = 0x80;
+    size_t tail_len = (rem < 56) ? 64 : 128;
+    uint64_t originalBitLen = total * 8ULL;
+    for (int i = 0; i < 8; ++i)
+        tail[tail_len - 1 - i] = static_cast<uint8_t>((originalBitLen >> (i * 8)) & 0xFF);
+    sha1_compress(h, tail, tail_len / 64);
 
-    vector<uint8_t> digest(20);
-    uint32_t tmp[5] = {h0, h1, h2, h3, h4};
     for (int i = 0; i < 5; ++i) {
-        digest[i*4 + 0] = static_cast<uint8_t>((tmp[i] >> 24) & 0xFF);
-        digest[i*4 + 1] = static_cast<uint8_t>((tmp[i] >> 16) & 0xFF);
-        digest[i*4 + 2] = static_cast<uint8_t>((tmp[i] >> 8) & 0xFF);
-        digest[i*4 + 3] = static_cast<uint8_t>((tmp[i]) & 0xFF);
+        out[i*4 + 0] = static_cast<uint8_t>((h[i] >> 24) & 0xFF);
+        out[i*4 + 1] = static_cast<uint8_t>((h[i] >> 16) & 0xFF);
+        out[i*4 + 2] = static_cast<uint8_t>((h[i] >> 8) & 0xFF);
+        out[i*4 + 3] = static_cast<uint8_t>((h[i]) & 0xFF);
     }
-    return digest;
+}
+
+// Internal worker: hash full blocks in place and only copy the padded tail
+void sha1_raw(const uint8_t *data, size_t len, uint8_t *out) {
+    metricAdd(METRIC_SHA1_BYTES, len);
+    const uint64_t start = len >= METRIC_HASH_TIMING_MIN ? metricNow() : 0;
+
+    // Initialize hash values
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+    size_t full = len / 64;
+    if (full) sha1_compress(h, data, full);
+    sha1_finish(h, data + full * 64, len - full * 64, len, out);
+    if (start) metricRecord(METRIC_SHA1_NS, metricNow() - start);
+}
+
+// ------------------------------
+// Incremental hashing
+// ------------------------------
+void Sha1Context::reset() {
+    static const uint32_t init[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    std::memcpy(h_, init, sizeof(h_));
+    len_ = 0;
+}
+
+void Sha1Context::update(const uint8_t *data, size_t len) {
+    metricAdd(METRIC_SHA1_BYTES, len);
+    size_t have = static_cast<size_t>(len_ % 64);
+    len_ += len;
+    if (have) {
+        size_t take = std::min(len, 64 - have);
+        std::memcpy(buf_ + have, data, take);
+        data += take;
+        len -= take;
+        if (have + take < 64) return;
+        sha1_compress(h_, buf_, 1);
+    }
+    size_t full = len / 64;
+    if (full) sha1_compress(h_, data, full);
+    if (len % 64) std::memcpy(buf_, data + full * 64, len % 64);
+}
+
+void Sha1Context::finish(uint8_t *out) {
+    sha1_finish(h_, buf_, static_cast<size_t>(len_ % 64), len_, out);
 }
 
 // Public API: old sha1(std::string) — keep for backwards compatibility
 std::vector<uint8_t> sha1(const std::string &data) {
-    vector<uint8_t> vec(data.begin(), data.end());
-    return sha1_from_bytes(vec);
+    vector<uint8_t> digest(20);
+    sha1_raw(reinterpret_cast<const uint8_t *>(data.data()), data.size(), digest.data());
+    return digest;
 }
 
 // NEW API: hash raw bytes directly
 std::vector<uint8_t> sha1_bytes(const std::vector<uint8_t> &data) {
-    return sha1_from_bytes(data);
+    vector<uint8_t> digest(20);
+    sha1_raw(data.data(), data.size(), digest.data());
+    return digest;
 }
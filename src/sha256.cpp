@@ -0,0 +1,197 @@
+#include "../include/sha256.h"
+#include "../include/metrics.h"
+#include <cstring>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define PEERSTORM_SHA256_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SHANI_TARGET
+#else
+#include <cpuid.h>
+#define SHANI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+#endif
+#endif
+
+using std::uint32_t;
+using std::uint8_t;
+using std::vector;
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t ror(uint32_t value, unsigned int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+// -------- Portable compression function --------
+static void compress_scalar(uint32_t state[8], const uint8_t *data, size_t blocks) {
+    for (; blocks > 0; --blocks, data += 64) {
+        uint32_t w[64];
+        for (int j = 0; j < 16; ++j) {
+            w[j] = (static_cast<uint32_t>(data[j * 4]) << 24)
+                 | (static_cast<uint32_t>(data[j * 4 + 1]) << 16)
+                 | (static_cast<uint32_t>(data[j * 4 + 2]) << 8)
+                 | (static_cast<uint32_t>(data[j * 4 + 3]));
+        }
+        for (int j = 16; j < 64; ++j) {
+            uint32_t s0 = ror(w[j-15], 7) ^ ror(w[j-15], 18) ^ (w[j-15] >> 3);
+            uint32_t s1 = ror(w[j-2], 17) ^ ror(w[j-2], 19) ^ (w[j-2] >> 10);
+            w[j] = w[j-16] + s0 + w[j-7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int j = 0; j < 64; ++j) {
+            uint32_t S1 = ror(e, 6) ^ ror(e, 11) ^ ror(e, 25);
+            uint32_t ch = (e & f) ^ ((~e) & g);
+            uint32_t t1 = h + S1 + ch + K[j] + w[j];
+            uint32_t S0 = ror(a, 2) ^ ror(a, 13) ^ ror(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = S0 + maj;
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#ifdef PEERSTORM_SHA256_X86
+// -------- SHA-NI compression function --------
+// Four rounds per step: sha256rnds2 does two rounds on ABEF/CDGH state and
+// sha256msg1/msg2 extend the message schedule four words at a time.
+SHANI_TARGET
+static void compress_shani(uint32_t state[8], const uint8_t *data, size_t blocks) {
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[0]));
+    __m128i state1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[4]));
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);               // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B);         // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);      // CDGH
+
+    for (; blocks > 0; --blocks, data += 64) {
+        const __m128i abef_save = state0;
+        const __m128i cdgh_save = state1;
+        __m128i w[4];
+
+        for (int i = 0; i < 16; ++i) {
+            __m128i &wi = w[i & 3];
+            if (i < 4) {
+                wi = _mm_shuffle_epi8(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 16)), MASK);
+            } else {
+                // w[i] = msg2(msg1(w[i-4], w[i-3]) + (w[i-1]:w[i-2] >> 32), w[i-1])
+                __m128i t = _mm_sha256msg1_epu32(wi, w[(i - 3) & 3]);
+                t = _mm_add_epi32(t, _mm_alignr_epi8(w[(i - 1) & 3], w[(i - 2) & 3], 4));
+                wi = _mm_sha256msg2_epu32(t, w[(i - 1) & 3]);
+            }
+            __m128i msg = _mm_add_epi32(
+                wi, _mm_loadu_si128(reinterpret_cast<const __m128i *>(&K[i * 4])));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);       // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);    // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);    // ABEF
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), state1);
+}
+
+static bool cpu_has_shani() {
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7) return false;
+    __cpuid(regs, 1);
+    bool sse41 = (regs[2] & (1 << 19)) != 0;
+    bool ssse3 = (regs[2] & (1 << 9)) != 0;
+    __cpuidex(regs, 7, 0);
+    return sse41 && ssse3 && (regs[1] & (1 << 29)) != 0;
+#else
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (__get_cpuid_max(0, nullptr) < 7 || !__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    bool sse41 = (ecx & (1u << 19)) != 0;
+    bool ssse3 = (ecx & (1u << 9)) != 0;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return sse41 && ssse3 && (ebx & (1u << 29)) != 0;
+#endif
+}
+#endif
+
+using compress_fn = void (*)(uint32_t *, const uint8_t *, size_t);
+
+static compress_fn select_compress() {
+#ifdef PEERSTORM_SHA256_X86
+    if (cpu_has_shani()) return compress_shani;
+#endif
+    return compress_scalar;
+}
+
+void sha256_raw(const uint8_t *data, size_t len, uint8_t *out) {
+    static const compress_fn compress = select_compress();
+    metricAdd(METRIC_SHA256_BYTES, len);
+    const uint64_t start = len >= METRIC_HASH_TIMING_MIN ? metricNow() : 0;
+
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    // full blocks straight from the input, no copy
+    size_t full = len / 64;
+    if (full) compress(state, data, full);
+
+    // pad the tail: 0x80, zeros, 64-bit big-endian bit length
+    uint8_t tail[128] = {0};
+    size_t rem = len - full * 64;
+    if (rem) std::memcpy(tail, data + full * 64, rem);
+    tail[rem] = 0x80;
+    size_t tail_len = (rem < 56) ? 64 : 128;
+    uint64_t bit_len = static_cast<uint64_t>(len) * 8ULL;
+    for (int i = 0; i < 8; ++i)
+        tail[tail_len - 1 - i] = static_cast<uint8_t>((bit_len >> (i * 8)) & 0xFF);
+    compress(state, tail, tail_len / 64);
+
+    for (int i = 0; i < 8; ++i) {
+        out[i*4 + 0] = static_cast<uint8_t>((state[i] >> 24) & 0xFF);
+        out[i*4 + 1] = static_cast<uint8_t>((state[i] >> 16) & 0xFF);
+        out[i*4 + 2] = static_cast<uint8_t>((state[i] >> 8) & 0xFF);
+        out[i*4 + 3] = static_cast<uint8_t>((state[i]) & 0xFF);
+    }
+    if (start) metricRecord(METRIC_SHA256_NS, metricNow() - start);
+}
+
+std::vector<uint8_t> sha256(const std::string &data) {
+    vector<uint8_t> digest(32);
+    sha256_raw(reinterpret_cast<const uint8_t *>(data.data()), data.size(), digest.data());
+    return digest;
+}
+
+std::vector<uint8_t> sha256_bytes(const std::vector<uint8_t> &data) {
+    vector<uint8_t> digest(32);
+    sha256_raw(data.data(), data.size(), digest.data());
+    return digest;
+}
@@ -0,0 +1,151 @@
+#include "../include/storage.h"
+#include "../include/merkle.h"
+#include "../include/metrics.h"
+#include "../include/sha1.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+FileStorage::FileStorage(const TorrentMetadata &meta) : meta_(meta) {
+    if (meta.piece_length <= 0) throw runtime_error("Invalid piece length");
+    uint64_t pl = static_cast<uint64_t>(meta.piece_length);
+    uint64_t pos = 0;
+    for (size_t i = 0; i < meta.files.size(); ++i) {
+        offsets_.push_back(pos);
+        pos += static_cast<uint64_t>(meta.files.length(i));
+        if (!meta.has_v1) pos = (pos + pl - 1) / pl * pl;
+    }
+    end_ = pos;
+    num_pieces_ = static_cast<size_t>((end_ + pl - 1) / pl);
+}
+
+int64_t FileStorage::pieceSize(size_t piece) const {
+    vector<FileSlice> slices = mapPiece(piece);
+    int64_t n = 0;
+    for (auto &s : slices) n += s.length;
+    return n;
+}
+
+vector<FileSlice> FileStorage::mapPiece(size_t piece) const {
+    if (piece >= num_pieces_) throw runtime_error("Piece index out of range");
+    uint64_t pl = static_cast<uint64_t>(meta_.piece_length);
+    uint64_t start = piece * pl;
+    uint64_t end = min(end_, start + pl);
+
+    vector<FileSlice> out;
+    size_t i = static_cast<size_t>(upper_bound(offsets_.begin(), offsets_.end(), start) - offsets_.begin());
+    if (i > 0) --i;
+    for (; i < offsets_.size() && offsets_[i] < end; ++i) {
+        uint64_t f_start = offsets_[i];
+        uint64_t f_end = f_start + static_cast<uint64_t>(meta_.files.length(i));
+        uint64_t a = max(start, f_start), b = min(end, f_end);
+        if (a >= b) continue;
+        FileSlice s;
+        s.file_index = i;
+        s.offset = static_cast<int64_t>(a - f_start);
+        s.length = static_cast<int64_t>(b - a);
+        out.push_back(s);
+    }
+    return out;
+}
+
+pair<size_t, size_t> FileStorage::filePieceRange(size_t file_index) const {
+    uint64_t pl = static_cast<uint64_t>(meta_.piece_length);
+    uint64_t start = offsets_.at(file_index);
+    uint64_t len = static_cast<uint64_t>(meta_.files.length(file_index));
+    if (len == 0) return {static_cast<size_t>(start / pl), static_cast<size_t>(start / pl)};
+    return {static_cast<size_t>(start / pl), static_cast<size_t>((start + len + pl - 1) / pl)};
+}
+
+// ------------------------------
+// Piece checking
+// ------------------------------
+static bool readPiece(const TorrentMetadata &meta, const FileStorage &storage, const string &root_dir,
+                      size_t piece, vector<uint8_t> &buf) {
+    MetricTimer timer(METRIC_IO_READ_NS);
+    buf.clear();
+    for (auto &s : storage.mapPiece(piece)) {
+        size_t at = buf.size();
+        buf.resize(at + static_cast<size_t>(s.length));
+        if (meta.files.isPad(s.file_index)) {
+            memset(buf.data() + at, 0, static_cast<size_t>(s.length));
+            continue;
+        }
+        ifstream f(FilePathOnDisk(meta, s.file_index, root_dir), ios::binary);
+        if (!f) return false;
+        f.seekg(s.offset);
+        if (!f.read(reinterpret_cast<char *>(buf.data() + at), static_cast<streamsize>(s.length)))
+            return false;
+        metricAdd(METRIC_IO_READ_BYTES, static_cast<uint64_t>(s.length));
+    }
+    return true;
+}
+
+bool PieceMatches(const TorrentMetadata &meta, const FileStorage &storage, size_t piece, const uint8_t *data,
+                  size_t len) {
+    if (meta.has_v1) {
+        if ((piece + 1) * 20 > meta.pieces.size()) return false;
+        uint8_t digest[20];
+        sha1_raw(data, len, digest);
+        return memcmp(digest, &meta.pieces[piece * 20], 20) == 0;
+    }
+
+    // pure v2: a piece never spans files
+    vector<FileSlice> slices = storage.mapPiece(piece);
+    if (slices.size() != 1) return false;
+    size_t fi = slices[0].file_index;
+    if (const uint8_t *layer = meta.files.pieceLayer(fi)) {
+        size_t k = static_cast<size_t>(slices[0].offset / meta.piece_length);
+        return merkleVerifyPiece(data, len, static_cast<size_t>(meta.piece_length) / MERKLE_BLOCK_SIZE,
+                                 layer + k * MERKLE_HASH_SIZE);
+    }
+    const uint8_t *root = meta.files.piecesRoot(fi);
+    size_t blocks = (static_cast<size_t>(meta.files.length(fi)) + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE;
+    return root && merkleVerifyPiece(data, len, merkleNumLeaves(blocks), root);
+}
+
+static bool verifyPiece(const TorrentMetadata &meta, const FileStorage &storage, const string &root_dir,
+                        size_t piece) {
+    vector<uint8_t> buf;
+    if (!readPiece(meta, storage, root_dir, piece, buf)) return false;
+    return PieceMatches(meta, storage, piece, buf.data(), buf.size());
+}
+
+bool CheckPiece(const TorrentMetadata &meta, const FileStorage &storage, const string &root_dir,
+                size_t piece) {
+    MetricTimer timer(METRIC_PIECE_CHECK_NS);
+    bool ok = verifyPiece(meta, storage, root_dir, piece);
+    metricAdd(METRIC_PIECES_CHECKED);
+    if (!ok) metricAdd(METRIC_PIECES_FAILED);
+    return ok;
+}
+
+vector<bool> CheckPieces(const TorrentMetadata &meta, const FileStorage &storage, const string &root_dir,
+                         const vector<size_t> &pieces, unsigned threads) {
+    vector<char> ok(pieces.size(), 0);
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    threads = static_cast<unsigned>(min<size_t>(threads, pieces.size()));
+
+    atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < pieces.size(); i = next++) {
+            try {
+                ok[i] = CheckPiece(meta, storage, root_dir, pieces[i]);
+            } catch (const exception &) {
+                ok[i] = 0;
+            }
+        }
+    };
+
+    vector<thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool) t.join();
+    return vector<bool>(ok.begin(), ok.end());
+}
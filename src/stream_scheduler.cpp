@@ -0,0 +1,363 @@
+#include "../include/stream_scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <random>
+#include <stdexcept>
+
+using namespace std;
+
+// Throughput is a sum of arrivals decayed with this time constant, which
+// reads as bytes/s once it has settled.
+static const double THROUGHPUT_TAU = 2.0;
+// A duplicate must be expected to arrive at least this much sooner (as a
+// fraction of the time the original still needs) to be worth the bandwidth.
+static const double DUPLICATE_GAIN = 0.25;
+
+StreamScheduler::StreamScheduler(const FileStorage &storage, size_t file_index, double bitrate,
+                                 std::vector<uint8_t> piece_priorities)
+    : storage_(storage), file_index_(file_index), bitrate_(bitrate), prio_(std::move(piece_priorities)),
+      have_(storage.numPieces(), false) {
+    if (bitrate <= 0) throw runtime_error("Stream bitrate must be positive");
+    if (file_index >= storage.metadata().files.size()) throw runtime_error("File index out of range");
+    auto range = storage.filePieceRange(file_index);
+    first_piece_ = range.first;
+    end_piece_ = range.second;
+    file_start_ = storage.fileOffset(file_index);
+    file_length_ = static_cast<uint64_t>(storage.metadata().files.length(file_index));
+}
+
+size_t StreamScheduler::addPeer(const std::vector<bool> *have) {
+    StreamPeer p;
+    p.have = have;
+    peers_.push_back(p);
+    return peers_.size() - 1;
+}
+
+void StreamScheduler::removePeer(size_t peer) {
+    peers_[peer].connected = false;
+    peers_[peer].queued = 0;
+    outstanding_.erase(remove_if(outstanding_.begin(), outstanding_.end(),
+                                 [&](const Outstanding &o) { return o.peer == peer; }),
+                       outstanding_.end());
+}
+
+void StreamScheduler::setReadPosition(uint64_t file_offset) { read_pos_ = min(file_offset, file_length_); }
+
+size_t StreamScheduler::pieceAt(uint64_t file_offset) const {
+    return static_cast<size_t>((file_start_ + file_offset) / static_cast<uint64_t>(storage_.metadata().piece_length));
+}
+
+bool StreamScheduler::requested(size_t piece) const {
+    for (auto &o : outstanding_)
+        if (o.piece == piece) return true;
+    return false;
+}
+
+double StreamScheduler::pieceBytes(size_t piece) const { return static_cast<double>(storage_.pieceSize(piece)); }
+
+double StreamScheduler::timeToDeadline(size_t piece) const {
+    uint64_t start = piece * static_cast<uint64_t>(storage_.metadata().piece_length);
+    if (start <= file_start_ + read_pos_) return 0;
+    return static_cast<double>(start - file_start_ - read_pos_) / bitrate_;
+}
+
+size_t StreamScheduler::windowPieces() const {
+    double bytes = max(throughput_, bitrate_) * STREAM_READAHEAD_SECONDS;
+    size_t n = static_cast<size_t>(ceil(bytes / static_cast<double>(storage_.metadata().piece_length)));
+    return min(max(n, STREAM_MIN_WINDOW), STREAM_MAX_WINDOW);
+}
+
+uint64_t StreamScheduler::bufferedBytes() const {
+    if (read_pos_ >= file_length_) return 0;
+    size_t p = pieceAt(read_pos_);
+    while (p < end_piece_ && have_[p]) ++p;
+    uint64_t end = p * static_cast<uint64_t>(storage_.metadata().piece_length);
+    end = min(end - min(end, file_start_), file_length_);
+    return end > read_pos_ ? end - read_pos_ : 0;
+}
+
+// Re-estimate when each of the peer's queued requests will arrive, in the
+// order they were sent; the first one has been transferring since it was
+// sent or since the previous piece finished. A peer that is taking longer
+// than its rate allows has slowed down, so its rate is capped at what the
+// current piece has achieved at best.
+void StreamScheduler::refreshPeer(size_t peer, double now) {
+    StreamPeer &p = peers_[peer];
+    double t = now;
+    bool first = true;
+    for (auto &o : outstanding_) {
+        if (o.peer != peer) continue;
+        if (first) {
+            double start = max(o.issued, p.last_done);
+            double bytes = pieceBytes(o.piece);
+            if (now > start && start + bytes / p.estimatedRate() < now) p.rate = bytes / (now - start);
+            t = max(now, start + bytes / p.estimatedRate());
+            first = false;
+        } else {
+            t += pieceBytes(o.piece) / p.estimatedRate();
+        }
+        o.expected = t;
+    }
+    p.busy_until = t;
+}
+
+StreamRequest StreamScheduler::assign(size_t piece, size_t peer, bool duplicate, double now) {
+    outstanding_.push_back(Outstanding{piece, peer, now, now, duplicate});
+    ++peers_[peer].queued;
+    refreshPeer(peer, now);
+    StreamRequest r;
+    r.piece = piece;
+    r.peer = peer;
+    r.duplicate = duplicate;
+    return r;
+}
+
+size_t StreamScheduler::bestPeer(size_t piece, double now, size_t exclude, double &finish) const {
+    size_t best = SIZE_MAX;
+    finish = 0;
+    for (size_t i = 0; i < peers_.size(); ++i) {
+        const StreamPeer &p = peers_[i];
+        // a peer that has not delivered yet gets one request to measure it
+        size_t limit = p.rate > 0 ? STREAM_MAX_PEER_QUEUE : 1;
+        if (i == exclude || !p.connected || p.queued >= limit || !p.hasPiece(piece)) continue;
+        double f = max(now, p.busy_until) + pieceBytes(piece) / p.estimatedRate();
+        if (best == SIZE_MAX || f < finish) {
+            best = i;
+            finish = f;
+        }
+    }
+    return best;
+}
+
+std::vector<StreamRequest> StreamScheduler::schedule(double now) {
+    vector<StreamRequest> out;
+    if (read_pos_ >= file_length_ || first_piece_ == end_piece_) return out;
+
+    size_t win_first = pieceAt(read_pos_);
+    size_t win_end = min(end_piece_, win_first + windowPieces());
+    for (size_t peer = 0; peer < peers_.size(); ++peer)
+        if (peers_[peer].queued) refreshPeer(peer, now);
+
+    // 1. late pieces first, since their deadlines are the nearest: expected
+    //    after their deadline, or overdue, and another peer would deliver
+    //    clearly sooner
+    size_t n = outstanding_.size();
+    for (size_t i = 0; i < n; ++i) {
+        Outstanding o = outstanding_[i];
+        if (o.duplicated || o.piece < win_first || o.piece >= win_end) continue;
+        bool sole = true;
+        for (auto &other : outstanding_)
+            if (other.piece == o.piece && other.peer != o.peer) sole = false;
+        if (!sole) continue;
+        bool late = o.expected > now + timeToDeadline(o.piece) || now > o.expected;
+        if (!late) continue;
+        double remaining = max(o.expected - now, pieceBytes(o.piece) / peers_[o.peer].estimatedRate());
+        double finish;
+        size_t peer = bestPeer(o.piece, now, o.peer, finish);
+        if (peer == SIZE_MAX || finish - now > remaining * (1 - DUPLICATE_GAIN)) continue;
+        outstanding_[i].duplicated = true;
+        out.push_back(assign(o.piece, peer, true, now));
+        ++duplicates_;
+    }
+
+    // 2. the rest of the window in deadline order, each to the peer that should
+    //    finish it first
+    for (size_t p = win_first; p < win_end; ++p) {
+        if (!needed(p) || requested(p)) continue;
+        double finish;
+        size_t peer = bestPeer(p, now, SIZE_MAX, finish);
+        if (peer != SIZE_MAX) out.push_back(assign(p, peer, false, now));
+    }
+
+    // 3. idle peers work ahead of the window, in file order, on the first
+    //    piece they can finish before its deadline
+    for (size_t peer = 0; peer < peers_.size(); ++peer) {
+        if (!peers_[peer].connected || peers_[peer].queued > 0) continue;
+        for (size_t p = win_end; p < end_piece_; ++p) {
+            if (!needed(p) || !peers_[peer].hasPiece(p) || requested(p)) continue;
+            if (pieceBytes(p) / peers_[peer].estimatedRate() > timeToDeadline(p)) continue;
+            out.push_back(assign(p, peer, false, now));
+            break;
+        }
+    }
+    return out;
+}
+
+std::vector<size_t> StreamScheduler::pieceReceived(size_t piece, size_t peer, double now) {
+    double bytes = pieceBytes(piece);
+    if (!have_[piece]) {
+        throughput_ = throughput_ * exp(-(now - last_sample_) / THROUGHPUT_TAU) + bytes / THROUGHPUT_TAU;
+        last_sample_ = now;
+    }
+    have_[piece] = true;
+
+    vector<size_t> cancel;
+    StreamPeer &p = peers_[peer];
+    for (size_t i = 0; i < outstanding_.size();) {
+        Outstanding &o = outstanding_[i];
+        if (o.piece != piece) {
+            ++i;
+            continue;
+        }
+        if (o.peer == peer) {
+            double elapsed = now - max(o.issued, p.last_done);
+            if (elapsed > 0) {
+                double sample = bytes / elapsed;
+                p.rate = p.rate > 0 ? 0.6 * p.rate + 0.4 * sample : sample;
+            }
+        } else {
+            cancel.push_back(o.peer);
+        }
+        --peers_[o.peer].queued;
+        outstanding_.erase(outstanding_.begin() + static_cast<ptrdiff_t>(i));
+    }
+    p.last_done = now;
+    refreshPeer(peer, now);
+    for (size_t c : cancel) refreshPeer(c, now);
+    return cancel;
+}
+
+void StreamScheduler::requestFailed(size_t piece, size_t peer, double now) {
+    for (size_t i = 0; i < outstanding_.size(); ++i) {
+        if (outstanding_[i].piece == piece && outstanding_[i].peer == peer) {
+            outstanding_.erase(outstanding_.begin() + static_cast<ptrdiff_t>(i));
+            --peers_[peer].queued;
+            break;
+        }
+    }
+    refreshPeer(peer, now);
+}
+
+// ------------------------------
+// Simulated playback
+// ------------------------------
+class SimJob {
+public:
+    size_t piece;
+    double ready;        // request has reached the peer
+    double remaining;    // bytes still to send
+};
+
+class SimPeer {
+public:
+    double base_rate = 0;
+    double rate = 0;
+    vector<bool> have;
+    deque<SimJob> queue;
+};
+
+StreamSimResult SimulateStreaming(const FileStorage &storage, size_t file_index, const StreamSimOptions &opts) {
+    if (opts.peer_rates.empty()) throw runtime_error("Simulation needs at least one peer");
+    for (double rate : opts.peer_rates)
+        if (!(rate > 0)) throw runtime_error("Peer rates must be positive");
+    const double dt = 0.005;
+    const size_t num_pieces = storage.numPieces();
+    const uint64_t file_length = static_cast<uint64_t>(storage.metadata().files.length(file_index));
+    mt19937 rng(opts.seed);
+    uniform_real_distribution<double> unit(0.0, 1.0);
+
+    StreamScheduler sched(storage, file_index, opts.bitrate);
+    vector<SimPeer> peers(opts.peer_rates.size());
+    size_t fastest = 0;
+    for (size_t i = 0; i < peers.size(); ++i) {
+        peers[i].base_rate = peers[i].rate = opts.peer_rates[i];
+        peers[i].have.assign(num_pieces, true);
+        if (i > 0)
+            for (size_t p = 0; p < num_pieces; ++p) peers[i].have[p] = unit(rng) < opts.availability;
+        if (opts.peer_rates[i] > opts.peer_rates[fastest]) fastest = i;
+    }
+    for (auto &p : peers) sched.addPeer(&p.have);
+
+    StreamSimResult res;
+    vector<char> requested(num_pieces, 0);   // baseline picker only
+    size_t cursor = 0;
+    uint64_t read_pos = 0;
+    bool started = false, stalled = false;
+    double next_jitter = 0;
+    const double startup_bytes = min(opts.startup_seconds * opts.bitrate, static_cast<double>(file_length));
+
+    for (double now = 0; read_pos < file_length; now += dt) {
+        if (now > 3600) throw runtime_error("Simulation did not finish within an hour of simulated time");
+
+        if (now >= next_jitter) {
+            for (size_t i = 0; i < peers.size(); ++i) {
+                peers[i].rate = peers[i].base_rate * (1 + opts.rate_jitter * (2 * unit(rng) - 1));
+                if (i == fastest && opts.stall_at >= 0 && now >= opts.stall_at) peers[i].rate = peers[i].base_rate * 0.02;
+            }
+            next_jitter += 1.0;
+        }
+
+        // peers send their queues in order
+        for (size_t i = 0; i < peers.size(); ++i) {
+            double budget = peers[i].rate * dt;
+            while (budget > 0 && !peers[i].queue.empty() && peers[i].queue.front().ready <= now) {
+                SimJob &job = peers[i].queue.front();
+                double take = min(budget, job.remaining);
+                job.remaining -= take;
+                budget -= take;
+                res.downloaded_bytes += static_cast<uint64_t>(take);
+                if (job.remaining > 0) break;
+
+                size_t piece = job.piece;
+                peers[i].queue.pop_front();
+                if (sched.havePiece(piece)) {
+                    res.wasted_bytes += static_cast<uint64_t>(storage.pieceSize(piece));
+                    continue;
+                }
+                for (size_t c : sched.pieceReceived(piece, i, now)) {
+                    auto &q = peers[c].queue;
+                    for (auto it = q.begin(); it != q.end(); ++it) {
+                        if (it->piece != piece) continue;
+                        res.wasted_bytes += static_cast<uint64_t>(storage.pieceSize(piece) - it->remaining);
+                        q.erase(it);
+                        break;
+                    }
+                }
+            }
+        }
+
+        // consumer
+        uint64_t buffered = sched.bufferedBytes();
+        if (!started) {
+            if (static_cast<double>(buffered) >= startup_bytes) {
+                started = true;
+                res.startup_delay = now;
+            }
+        } else {
+            uint64_t want = static_cast<uint64_t>(opts.bitrate * dt);
+            uint64_t take = min(want, buffered);
+            read_pos += take;
+            if (take < want && read_pos < file_length) {
+                if (!stalled) ++res.stalls;
+                stalled = true;
+                res.stall_seconds += dt;
+            } else {
+                stalled = false;
+            }
+            sched.setReadPosition(read_pos);
+        }
+
+        // requests
+        if (opts.deadline) {
+            for (auto &r : sched.schedule(now)) {
+                peers[r.peer].queue.push_back(SimJob{r.piece, now + opts.latency, static_cast<double>(storage.pieceSize(r.piece))});
+                res.duplicate_requests += r.duplicate;
+            }
+        } else {
+            // baseline: keep two requests per peer, next missing piece in file order
+            auto range = storage.filePieceRange(file_index);
+            while (cursor < range.second && requested[cursor]) ++cursor;
+            for (size_t i = 0; i < peers.size(); ++i) {
+                for (size_t p = max(cursor, range.first); p < range.second && peers[i].queue.size() < 2; ++p) {
+                    if (requested[p] || !peers[i].have[p]) continue;
+                    requested[p] = 1;
+                    peers[i].queue.push_back(SimJob{p, now + opts.latency, static_cast<double>(storage.pieceSize(p))});
+                }
+            }
+        }
+        res.finish_time = now;
+    }
+    return res;
+}
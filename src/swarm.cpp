@@ -0,0 +1,828 @@
+#include "../include/swarm.h"
+#include "../include/bencode.h"
+#include "../include/magnet_parser.h"
+#include "../include/peer_wire.h"
+#include "../include/piece_hasher.h"
+#include "../include/piece_store.h"
+#include "../include/resume.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <random>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <csignal>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifdef _WIN32
+
+LoopbackTracker::LoopbackTracker() {
+    throw runtime_error("the loopback tracker needs POSIX sockets");
+}
+LoopbackTracker::~LoopbackTracker() {}
+std::string LoopbackTracker::announceUrl() const { return string(); }
+void LoopbackTracker::run() {}
+std::string LoopbackTracker::handle(const std::string &) { return string(); }
+
+SwarmResult RunLoopbackSwarm(const TorrentMetadata &, const FileStorage &, const std::string &,
+                             const std::string &, const SwarmOptions &) {
+    throw runtime_error("the loopback swarm needs POSIX sockets");
+}
+
+#else
+
+// Pieces a node keeps in memory for serving
+static const size_t SERVE_CACHE_PIECES = 4;
+// Largest block a node will serve
+static const uint32_t MAX_SERVED_BLOCK = 128 * 1024;
+// TCP payload per segment, the unit of loss
+static const size_t TCP_SEGMENT = 1460;
+// Shortest time to recover a lost segment, for links with no added latency
+static const double MIN_RECOVERY = 0.001;
+
+// -------- SOCKETS --------
+static int listenLoopback(uint16_t &port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) throw runtime_error(string("socket: ") + strerror(errno));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, 128) != 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) != 0) {
+        int err = errno;
+        close(fd);
+        throw runtime_error(string("cannot listen on 127.0.0.1: ") + strerror(err));
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static void setupSocket(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static int connectLoopback(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) throw runtime_error(string("socket: ") + strerror(errno));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        int err = errno;
+        close(fd);
+        throw runtime_error("connect to 127.0.0.1:" + to_string(port) + ": " + strerror(err));
+    }
+    return fd;
+}
+
+// -------- TRACKER --------
+static string urlEncode(const string &s) {
+    static const char hex[] = "0123456789ABCDEF";
+    string out;
+    for (unsigned char ch : s) {
+        if (isalnum(ch) || ch == '-' || ch == '_' || ch == '.' || ch == '~') {
+            out += static_cast<char>(ch);
+        } else {
+            out += '%';
+            out += hex[ch >> 4];
+            out += hex[ch & 15];
+        }
+    }
+    return out;
+}
+
+LoopbackTracker::LoopbackTracker() {
+    listen_fd_ = listenLoopback(port_);
+    if (pipe(wake_) != 0) {
+        close(listen_fd_);
+        throw runtime_error(string("pipe: ") + strerror(errno));
+    }
+    thread_ = thread(&LoopbackTracker::run, this);
+}
+
+LoopbackTracker::~LoopbackTracker() {
+    char b = 0;
+    if (write(wake_[1], &b, 1) < 0) {}
+    thread_.join();
+    close(wake_[0]);
+    close(wake_[1]);
+    close(listen_fd_);
+}
+
+std::string LoopbackTracker::announceUrl() const {
+    return "http://127.0.0.1:" + to_string(port_) + "/announce";
+}
+
+// One request per connection (HTTP/1.0), answered once its headers are in
+void LoopbackTracker::run() {
+    vector<pair<int, string>> conns;
+    vector<pollfd> fds;
+    for (;;) {
+        fds.clear();
+        fds.push_back({wake_[0], POLLIN, 0});
+        fds.push_back({listen_fd_, POLLIN, 0});
+        for (auto &c : conns) fds.push_back({c.first, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[0].revents) break;
+        for (size_t i = 0; i < conns.size(); ++i) {
+            if (!fds[i + 2].revents) continue;
+            char buf[4096];
+            ssize_t r = read(conns[i].first, buf, sizeof(buf));
+            if (r > 0) conns[i].second.append(buf, static_cast<size_t>(r));
+            if (r > 0 && conns[i].second.find("\r\n\r\n") == string::npos) continue;
+            if (r > 0) {
+                string resp = handle(conns[i].second);
+                for (size_t done = 0; done < resp.size();) {
+                    ssize_t w = write(conns[i].first, resp.data() + done, resp.size() - done);
+                    if (w <= 0) break;
+                    done += static_cast<size_t>(w);
+                }
+            }
+            close(conns[i].first);
+            conns[i].first = -1;
+        }
+        conns.erase(remove_if(conns.begin(), conns.end(), [](const pair<int, string> &c) { return c.first < 0; }),
+                    conns.end());
+        if (fds[1].revents & POLLIN) {
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd >= 0) conns.emplace_back(fd, string());
+        }
+    }
+    for (auto &c : conns) close(c.first);
+}
+
+std::string LoopbackTracker::handle(const std::string &request) {
+    BDict resp;
+    try {
+        size_t q = request.find('?');
+        size_t end = request.find(' ', q);
+        if (request.compare(0, 4, "GET ") != 0 || q == string::npos || end == string::npos)
+            throw runtime_error("bad request");
+        map<string, string> params;
+        string query = request.substr(q + 1, end - q - 1);
+        for (size_t pos = 0; pos <= query.size();) {
+            size_t amp = query.find('&', pos);
+            if (amp == string::npos) amp = query.size();
+            string kv = query.substr(pos, amp - pos);
+            size_t eq = kv.find('=');
+            if (eq != string::npos) params[kv.substr(0, eq)] = urlDecode(kv.substr(eq + 1));
+            pos = amp + 1;
+        }
+        const string &info_hash = params["info_hash"];
+        const string &peer_id = params["peer_id"];
+        if (info_hash.size() != 20 || peer_id.size() != 20) throw runtime_error("missing info_hash or peer_id");
+        Peer self;
+        self.peer_id = peer_id;
+        self.port = static_cast<uint16_t>(stoul(params["port"]));
+        self.seed = params.count("left") && stoull(params["left"]) == 0;
+        ++announces_;
+
+        vector<Peer> &swarm = swarms_[info_hash];
+        string peers;
+        for (auto &p : swarm) {
+            if (p.peer_id == peer_id || (self.seed && p.seed)) continue;
+            const char entry[6] = {127, 0, 0, 1, static_cast<char>(p.port >> 8), static_cast<char>(p.port)};
+            peers.append(entry, 6);
+        }
+        auto it = find_if(swarm.begin(), swarm.end(), [&](const Peer &p) { return p.peer_id == peer_id; });
+        if (params["event"] == "stopped") {
+            if (it != swarm.end()) swarm.erase(it);
+        } else if (it != swarm.end()) {
+            *it = self;
+        } else {
+            swarm.push_back(self);
+        }
+        resp["interval"] = BValue(1800LL);
+        resp["peers"] = BValue(peers);
+    } catch (const exception &e) {
+        resp.clear();
+        resp["failure reason"] = BValue(string(e.what()));
+    }
+    string body = bencode_value(BValue(resp));
+    return "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Length: " + to_string(body.size()) + "\r\n\r\n" +
+           body;
+}
+
+// Announce and return the peers' ports (everyone is on 127.0.0.1)
+static vector<uint16_t> announce(uint16_t tracker_port, const vector<uint8_t> &info_hash, const string &peer_id,
+                                 uint16_t port, uint64_t left) {
+    int fd = connectLoopback(tracker_port);
+    string req = "GET /announce?info_hash=" + urlEncode(string(info_hash.begin(), info_hash.begin() + 20)) +
+                 "&peer_id=" + urlEncode(peer_id) + "&port=" + to_string(port) +
+                 "&uploaded=0&downloaded=0&left=" + to_string(left) +
+                 "&compact=1&event=started HTTP/1.0\r\nHost: 127.0.0.1\r\n\r\n";
+    string resp;
+    bool ok = true;
+    for (size_t done = 0; ok && done < req.size();) {
+        ssize_t w = write(fd, req.data() + done, req.size() - done);
+        ok = w > 0;
+        if (ok) done += static_cast<size_t>(w);
+    }
+    char buf[4096];
+    for (ssize_t r; ok && (r = read(fd, buf, sizeof(buf))) > 0;) resp.append(buf, static_cast<size_t>(r));
+    close(fd);
+
+    size_t body = resp.find("\r\n\r\n");
+    if (!ok || body == string::npos) throw runtime_error("tracker: no response");
+    size_t pos = body + 4;
+    BDict d = decodeDict(resp, pos);
+    if (d.count("failure reason")) throw runtime_error("tracker: " + d["failure reason"].str_val);
+    const string &peers = d["peers"].str_val;
+    vector<uint16_t> ports;
+    for (size_t i = 0; i + 6 <= peers.size(); i += 6)
+        ports.push_back(static_cast<uint16_t>((static_cast<uint8_t>(peers[i + 4]) << 8) | static_cast<uint8_t>(peers[i + 5])));
+    return ports;
+}
+
+// -------- NODES --------
+struct SwarmConn {
+    int fd = -1;
+    size_t node = 0;
+    size_t remote = 0;
+    size_t peer = SIZE_MAX;            // index in the node's scheduler (leechers only)
+    bool handshaken = false;
+    bool closed = false;
+    string in;
+    string out;                        // due bytes not yet taken by the socket
+    deque<pair<double, string>> delayed;   // (delivery time, message), in time order
+    bool am_choking = true;
+    bool am_interested = false;
+    bool peer_choking = true;
+    deque<BlockRequest> requests;      // to serve
+    double last_delivery = 0;          // TCP delivers in order, so nothing overtakes this
+    uint64_t useful = 0;
+    size_t max_depth = 0;
+};
+
+struct SwarmNode {
+    bool seeder = false;
+    int listen_fd = -1;
+    uint16_t port = 0;
+    unique_ptr<PieceStore> store;
+    unique_ptr<BlockScheduler> sched;  // leechers
+    vector<bool> have;
+    vector<size_t> conns;
+    vector<size_t> peer_conn;          // scheduler peer -> connection
+    double uplink_free = 0;
+    size_t serve_next = 0;             // round robin over conns
+    bool stalled = false;
+    bool done = false;
+    unique_ptr<PieceHasher> hasher;    // leechers
+    list<pair<size_t, vector<uint8_t>>> cache;   // most recently used first
+    SwarmLeecherStats stats;
+};
+
+class LoopbackSwarm {
+public:
+    LoopbackSwarm(const TorrentMetadata &meta, const FileStorage &storage, const SwarmOptions &opts)
+        : meta_(meta), storage_(storage), opts_(opts), start_(chrono::steady_clock::now()), rng_(opts.seed) {}
+    ~LoopbackSwarm() {
+        for (auto &c : conns_)
+            if (c.fd >= 0) close(c.fd);
+        for (auto &n : nodes_)
+            if (n.listen_fd >= 0) close(n.listen_fd);
+    }
+
+    void addNode(bool seeder, const string &dir);
+    // Fast-resume for a leecher (SwarmOptions::resume)
+    void loadResume(SwarmNode &n);
+    void saveResume(const SwarmNode &n) const;
+    // Announce and connect to every peer the tracker returns
+    void join(size_t node, uint16_t tracker_port);
+    SwarmResult run();
+
+private:
+    double now() const { return chrono::duration<double>(chrono::steady_clock::now() - start_).count(); }
+    string peerId(size_t node) const;
+    void addConn(size_t node, int fd, size_t remote);
+    void acceptPending(size_t node);
+    void send(SwarmConn &c, string msg, double t);
+    void flush(SwarmConn &c, double t);
+    void receive(SwarmConn &c, double t);
+    void handle(SwarmConn &c, const PeerMessage &msg, double t);
+    void blockArrived(SwarmConn &c, const PeerMessage &msg, double t);
+    void serve(SwarmNode &n, double t);
+    void topUp(SwarmNode &n, double t);
+    const vector<uint8_t> *cachedPiece(SwarmNode &n, size_t piece);
+
+    const TorrentMetadata &meta_;
+    const FileStorage &storage_;
+    SwarmOptions opts_;
+    chrono::steady_clock::time_point start_;
+    mt19937 rng_;
+    vector<SwarmNode> nodes_;
+    vector<SwarmConn> conns_;
+};
+
+void LoopbackSwarm::addNode(bool seeder, const string &dir) {
+    SwarmNode n;
+    n.seeder = seeder;
+    n.listen_fd = listenLoopback(n.port);
+    setupSocket(n.listen_fd);
+    n.store.reset(new PieceStore(meta_, storage_, dir));
+    n.have.assign(storage_.numPieces(), seeder);
+    if (!seeder) {
+        BlockSchedulerOptions so = opts_.scheduler;
+        so.seed += static_cast<unsigned>(nodes_.size());
+        n.sched.reset(new BlockScheduler(storage_, n.store->piecePriorities(), so));
+        n.hasher.reset(new PieceHasher(meta_, storage_, *n.store, opts_.hash_memory));
+        if (opts_.resume) loadResume(n);
+        if (opts_.dedup) {
+            DedupFillResult fill = FillFromIndex(*opts_.dedup, meta_, storage_, *n.store);
+            for (size_t p : fill.verified) {
+                n.sched->markHave(p);
+                n.have[p] = true;
+            }
+            n.stats.local_pieces = fill.verified.size();
+        }
+        n.done = n.sched->finished();
+        n.stats.complete = n.done;
+    }
+    nodes_.push_back(std::move(n));
+}
+
+static string resumePath(const TorrentMetadata &meta, const PieceStore &store) {
+    return (filesystem::path(store.rootDir()) / ("." + toHex(meta.info_hash) + ".resume")).string();
+}
+
+void LoopbackSwarm::loadResume(SwarmNode &n) {
+    ResumeData rd;
+    if (!LoadResumeFile(resumePath(meta_, *n.store), rd)) return;
+    // only pieces touching files changed since the save are read back
+    for (size_t p : ValidateResume(meta_, storage_, n.store->rootDir(), rd))
+        if (n.store->wanted(p)) rd.setPiece(p, n.store->checkPiece(p));
+    for (size_t p = 0; p < n.have.size(); ++p) {
+        if (!rd.hasPiece(p)) continue;
+        n.sched->markHave(p);
+        n.have[p] = true;
+        ++n.stats.resumed_pieces;
+    }
+
+    // Blocks of unfinished pieces are on disk already: hand them to the
+    // hasher (which needs their bytes) and mark them received.
+    vector<uint8_t> buf;
+    for (auto &kv : rd.unfinished) {
+        size_t p = kv.first;
+        if (p >= n.have.size() || n.have[p] || !n.store->wanted(p)) continue;
+        vector<uint8_t> mask(kv.second.size(), 0);
+        for (size_t b = 0; b < n.sched->blocksInPiece(p) && b / 8 < mask.size(); ++b) {
+            if (!((kv.second[b / 8] >> (7 - b % 8)) & 1)) continue;
+            buf.resize(n.sched->blockLength(p, b));
+            uint32_t begin = static_cast<uint32_t>(b * PEER_BLOCK_SIZE);
+            if (!n.store->readBlock(p, begin, buf.data(), buf.size())) continue;
+            n.hasher->addBlock(p, begin, buf.data(), buf.size());
+            mask[b / 8] |= static_cast<uint8_t>(0x80 >> (b % 8));
+            ++n.stats.resumed_blocks;
+        }
+        n.sched->restoreBlocks(p, mask);
+        if (!n.sched->pieceComplete(p)) continue;
+        if (n.hasher->finish(p)) {
+            n.sched->pieceVerified(p);
+            n.have[p] = true;
+        } else {
+            n.sched->pieceFailed(p);
+        }
+    }
+}
+
+void LoopbackSwarm::saveResume(const SwarmNode &n) const {
+    ResumeData rd;
+    rd.info_hash = meta_.info_hash;
+    rd.save_path = n.store->rootDir();
+    rd.have.assign((n.have.size() + 7) / 8, 0);
+    for (size_t p = 0; p < n.have.size(); ++p)
+        if (n.have[p]) rd.setPiece(p, true);
+    rd.files = SnapshotFiles(meta_, n.store->rootDir());
+    rd.file_priorities = n.store->filePriorities();
+    for (size_t p : n.sched->partialPieces()) {
+        vector<uint8_t> mask = n.sched->receivedBlocks(p);
+        if (any_of(mask.begin(), mask.end(), [](uint8_t m) { return m != 0; }))
+            rd.unfinished[static_cast<uint32_t>(p)] = std::move(mask);
+    }
+    filesystem::create_directories(n.store->rootDir());
+    WriteResumeFile(resumePath(meta_, *n.store), rd);
+}
+
+string LoopbackSwarm::peerId(size_t node) const {
+    char id[21];
+    // 12 digits fill the 20 bytes exactly
+    snprintf(id, sizeof(id), "-PS0001-%012llu", static_cast<unsigned long long>(node % 1000000000000ULL));
+    return string(id, 20);
+}
+
+void LoopbackSwarm::join(size_t node, uint16_t tracker_port) {
+    SwarmNode &n = nodes_[node];
+    uint64_t left = 0;
+    for (size_t p = 0; p < n.have.size(); ++p)
+        if (!n.have[p]) left += static_cast<uint64_t>(storage_.pieceSize(p));
+    for (uint16_t port : announce(tracker_port, meta_.info_hash, peerId(node), n.port, left)) {
+        size_t remote = 0;
+        while (remote < nodes_.size() && nodes_[remote].port != port) ++remote;
+        if (remote == nodes_.size() || remote == node) continue;
+        int fd = connectLoopback(port);
+        setupSocket(fd);
+        addConn(node, fd, remote);
+        acceptPending(remote);
+    }
+}
+
+void LoopbackSwarm::acceptPending(size_t node) {
+    for (;;) {
+        int fd = accept(nodes_[node].listen_fd, nullptr, nullptr);
+        if (fd < 0) return;
+        setupSocket(fd);
+        addConn(node, fd, SIZE_MAX);   // known once its handshake arrives
+    }
+}
+
+void LoopbackSwarm::addConn(size_t node, int fd, size_t remote) {
+    SwarmConn c;
+    c.fd = fd;
+    c.node = node;
+    c.remote = remote;
+    SwarmNode &n = nodes_[node];
+    if (n.sched) {
+        c.peer = n.sched->addPeer();
+        n.peer_conn.push_back(conns_.size());
+    }
+    n.conns.push_back(conns_.size());
+    conns_.push_back(std::move(c));
+
+    string m = EncodeHandshake(meta_.info_hash, peerId(node));
+    AppendBitfield(m, n.have);
+    send(conns_.back(), std::move(m), now());
+}
+
+// -------- LINK SHAPING --------
+void LoopbackSwarm::send(SwarmConn &c, string msg, double t) {
+    if (c.closed) return;
+    SwarmNode &n = nodes_[c.node];
+    size_t wire = msg.size();
+    double recovery = 0;
+    if (opts_.loss > 0) {
+        int segments = static_cast<int>((msg.size() + TCP_SEGMENT - 1) / TCP_SEGMENT);
+        int lost = binomial_distribution<int>(segments, opts_.loss)(rng_);
+        wire += static_cast<size_t>(lost) * TCP_SEGMENT;
+        recovery = lost * max(2 * opts_.latency, MIN_RECOVERY);
+    }
+    double at = t;
+    if (opts_.bandwidth > 0) {
+        n.uplink_free = max(t, n.uplink_free) + static_cast<double>(wire) / opts_.bandwidth;
+        at = n.uplink_free;
+    }
+    c.last_delivery = max(c.last_delivery, at + opts_.latency + recovery);
+    c.delayed.emplace_back(c.last_delivery, std::move(msg));
+}
+
+void LoopbackSwarm::flush(SwarmConn &c, double t) {
+    if (c.closed) return;
+    while (!c.delayed.empty() && c.delayed.front().first <= t) {
+        c.out += c.delayed.front().second;
+        c.delayed.pop_front();
+    }
+    size_t done = 0;
+    while (done < c.out.size()) {
+        ssize_t w = write(c.fd, c.out.data() + done, c.out.size() - done);
+        if (w > 0) { done += static_cast<size_t>(w); continue; }
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        c.closed = true;
+        break;
+    }
+    c.out.erase(0, done);
+}
+
+// -------- PROTOCOL --------
+void LoopbackSwarm::receive(SwarmConn &c, double t) {
+    char buf[256 * 1024];
+    for (;;) {
+        ssize_t r = read(c.fd, buf, sizeof(buf));
+        if (r > 0) { c.in.append(buf, static_cast<size_t>(r)); continue; }
+        if (r == 0) c.closed = true;
+        else if (errno == EINTR) continue;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK) c.closed = true;
+        break;
+    }
+
+    size_t pos = 0;
+    try {
+        if (!c.handshaken) {
+            vector<uint8_t> info_hash;
+            string peer_id;
+            if (!TakeHandshake(c.in, pos, info_hash, peer_id)) return;
+            if (!equal(info_hash.begin(), info_hash.end(), meta_.info_hash.begin()))
+                throw runtime_error("peer: handshake for another torrent");
+            if (c.remote == SIZE_MAX) c.remote = stoul(peer_id.substr(8));
+            c.handshaken = true;
+        }
+        PeerMessage msg;
+        while (!c.closed && TakeMessage(c.in, pos, msg)) handle(c, msg, t);
+    } catch (const exception &) {
+        c.closed = true;
+    }
+    c.in.erase(0, pos);
+}
+
+void LoopbackSwarm::handle(SwarmConn &c, const PeerMessage &msg, double t) {
+    SwarmNode &n = nodes_[c.node];
+    BlockScheduler *sched = n.sched.get();
+    switch (msg.id) {
+    case MSG_BITFIELD:
+        if (sched) {
+            sched->setBitfield(c.peer, DecodeBitfield(msg.payload, storage_.numPieces()));
+            if (!c.am_interested && !n.done && sched->interesting(c.peer)) {
+                c.am_interested = true;
+                string m;
+                AppendMessage(m, MSG_INTERESTED);
+                send(c, std::move(m), t);
+            }
+        }
+        break;
+    case MSG_HAVE:
+        if (sched && msg.piece < storage_.numPieces()) {
+            sched->peerHas(c.peer, msg.piece);
+            if (!c.am_interested && !n.done && !sched->havePiece(msg.piece)) {
+                c.am_interested = true;
+                string m;
+                AppendMessage(m, MSG_INTERESTED);
+                send(c, std::move(m), t);
+            }
+        }
+        break;
+    case MSG_INTERESTED:
+        // Everyone who asks is unchoked; the swarm measures request
+        // pipelining, not choking.
+        if (c.am_choking) {
+            c.am_choking = false;
+            string m;
+            AppendMessage(m, MSG_UNCHOKE);
+            send(c, std::move(m), t);
+        }
+        break;
+    case MSG_CHOKE:
+        c.peer_choking = true;
+        if (sched) sched->setChoked(c.peer, true);
+        break;
+    case MSG_UNCHOKE:
+        c.peer_choking = false;
+        if (sched) sched->setChoked(c.peer, false);
+        break;
+    case MSG_REQUEST:
+        if (!c.am_choking) c.requests.push_back(BlockRequest{msg.piece, msg.begin, msg.length});
+        break;
+    case MSG_CANCEL: {
+        BlockRequest r{msg.piece, msg.begin, msg.length};
+        auto it = find(c.requests.begin(), c.requests.end(), r);
+        if (it != c.requests.end()) c.requests.erase(it);
+        break;
+    }
+    case MSG_PIECE:
+        if (sched) blockArrived(c, msg, t);
+        break;
+    default:
+        break;
+    }
+}
+
+void LoopbackSwarm::blockArrived(SwarmConn &c, const PeerMessage &msg, double t) {
+    SwarmNode &n = nodes_[c.node];
+    BlockScheduler &sched = *n.sched;
+    BlockRequest block{msg.piece, msg.begin, msg.length};
+    n.stats.bytes += msg.length;
+
+    vector<pair<size_t, BlockRequest>> cancel;
+    if (!sched.blockReceived(c.peer, block, t, cancel)) {
+        n.stats.wasted_bytes += msg.length;
+        return;
+    }
+    c.useful += msg.length;
+    for (auto &x : cancel) {
+        string m;
+        AppendRequest(m, MSG_CANCEL, x.second.piece, x.second.begin, x.second.length);
+        send(conns_[n.peer_conn[x.first]], std::move(m), t);
+    }
+
+    // Blocks go straight to disk; the hasher keeps what it needs to check
+    // the piece without reading it back.
+    n.store->writeBlock(block.piece, block.begin, reinterpret_cast<const uint8_t *>(msg.payload.data()), msg.length);
+    n.hasher->addBlock(block.piece, block.begin, reinterpret_cast<const uint8_t *>(msg.payload.data()), msg.length);
+    if (!sched.pieceComplete(block.piece)) return;
+
+    if (n.hasher->finish(block.piece)) {
+        sched.pieceVerified(block.piece);
+        n.have[block.piece] = true;
+        for (size_t ci : n.conns) {
+            string m;
+            AppendHave(m, block.piece);
+            send(conns_[ci], std::move(m), t);
+        }
+    } else {
+        sched.pieceFailed(block.piece);
+        ++n.stats.hash_failures;
+    }
+
+    if (sched.finished() && !n.done) {
+        n.done = true;
+        n.stats.complete = true;
+        n.stats.seconds = t;
+        for (size_t ci : n.conns) {
+            SwarmConn &o = conns_[ci];
+            if (!o.am_interested) continue;
+            o.am_interested = false;
+            string m;
+            AppendMessage(m, MSG_NOT_INTERESTED);
+            send(o, std::move(m), t);
+        }
+    }
+}
+
+const vector<uint8_t> *LoopbackSwarm::cachedPiece(SwarmNode &n, size_t piece) {
+    for (auto it = n.cache.begin(); it != n.cache.end(); ++it) {
+        if (it->first != piece) continue;
+        n.cache.splice(n.cache.begin(), n.cache, it);
+        return &n.cache.front().second;
+    }
+    vector<uint8_t> data;
+    if (!n.store->readPiece(piece, data)) return nullptr;
+    if (n.cache.size() >= SERVE_CACHE_PIECES) n.cache.pop_back();
+    n.cache.emplace_front(piece, std::move(data));
+    return &n.cache.front().second;
+}
+
+// Turn queued requests into blocks while the uplink is idle, round robin
+// over connections.
+void LoopbackSwarm::serve(SwarmNode &n, double t) {
+    if (n.stalled || n.conns.empty()) return;
+    size_t idle = 0;
+    while ((opts_.bandwidth <= 0 || n.uplink_free <= t) && idle < n.conns.size()) {
+        SwarmConn &c = conns_[n.conns[n.serve_next++ % n.conns.size()]];
+        if (c.requests.empty() || c.closed) {
+            ++idle;
+            continue;
+        }
+        idle = 0;
+        BlockRequest r = c.requests.front();
+        c.requests.pop_front();
+        if (r.piece >= n.have.size() || !n.have[r.piece] || r.length == 0 || r.length > MAX_SERVED_BLOCK ||
+            static_cast<int64_t>(r.begin) + r.length > storage_.pieceSize(r.piece))
+            continue;
+        const vector<uint8_t> *data = cachedPiece(n, r.piece);
+        if (!data) continue;
+        string m;
+        m.reserve(13 + r.length);
+        AppendPiece(m, r.piece, r.begin, data->data() + r.begin, r.length);
+        send(c, std::move(m), t);
+    }
+}
+
+void LoopbackSwarm::topUp(SwarmNode &n, double t) {
+    n.sched->tick(t);
+    for (size_t ci : n.conns) {
+        SwarmConn &c = conns_[ci];
+        if (c.closed || !c.handshaken || c.peer_choking) continue;
+        for (auto &r : n.sched->requestsFor(c.peer, t)) {
+            string m;
+            AppendRequest(m, MSG_REQUEST, r.piece, r.begin, r.length);
+            send(c, std::move(m), t);
+        }
+        c.max_depth = max(c.max_depth, n.sched->outstanding(c.peer));
+    }
+}
+
+// -------- EVENT LOOP --------
+SwarmResult LoopbackSwarm::run() {
+    vector<pollfd> fds;
+    double stall_at = opts_.stalled_seeders ? opts_.stall_at : -1;
+    for (;;) {
+        double t = now();
+        bool all_done = true;
+        for (auto &n : nodes_) all_done &= n.seeder || n.done;
+        if (all_done || t > opts_.timeout) break;
+
+        if (stall_at >= 0 && t >= stall_at) {
+            for (size_t i = 0, s = 0; i < nodes_.size() && s < opts_.stalled_seeders; ++i)
+                if (nodes_[i].seeder) { nodes_[i].stalled = true; ++s; }
+            stall_at = -1;
+        }
+        for (auto &n : nodes_) {
+            serve(n, t);
+            if (n.sched && !n.done) topUp(n, t);
+        }
+        for (auto &c : conns_) flush(c, t);
+
+        // Sleep until the next message is due or an uplink frees up
+        double next = t + 0.02;
+        for (auto &c : conns_)
+            if (!c.delayed.empty()) next = min(next, c.delayed.front().first);
+        for (auto &n : nodes_)
+            if (opts_.bandwidth > 0 && n.uplink_free > t) next = min(next, n.uplink_free);
+        int wait = static_cast<int>(ceil(max(0.0, next - now()) * 1000));
+
+        fds.clear();
+        size_t num_conns = conns_.size();
+        for (auto &c : conns_)
+            fds.push_back({c.fd, static_cast<short>(c.closed ? 0 : POLLIN | (c.out.empty() ? 0 : POLLOUT)), 0});
+        for (auto &n : nodes_) fds.push_back({n.listen_fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), wait) < 0 && errno != EINTR)
+            throw runtime_error(string("poll: ") + strerror(errno));
+        t = now();
+        for (size_t i = 0; i < num_conns; ++i)
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) receive(conns_[i], t);
+        for (size_t i = 0; i < nodes_.size(); ++i)
+            if (fds[num_conns + i].revents & POLLIN) acceptPending(i);
+        for (auto &c : conns_) {
+            if (!c.closed || c.fd < 0) continue;
+            if (nodes_[c.node].sched) nodes_[c.node].sched->removePeer(c.peer);
+            close(c.fd);
+            c.fd = -1;
+        }
+    }
+
+    SwarmResult res;
+    for (auto &n : nodes_) {
+        if (n.seeder) continue;
+        if (opts_.resume) saveResume(n);
+        SwarmLeecherStats s = n.stats;
+        if (!s.complete) s.seconds = now();
+        res.seconds = max(res.seconds, s.seconds);
+        res.bytes += s.bytes - s.wasted_bytes;
+        s.reassigned = n.sched->reassignedBlocks();
+        s.endgame_requests = n.sched->endgameRequests();
+        s.cancels = n.sched->cancelsSent();
+        s.read_back_bytes = n.hasher->diskReadBytes();
+        s.peak_hash_buffer = n.hasher->peakBufferedBytes();
+        for (size_t peer = 0; peer < n.peer_conn.size(); ++peer) {
+            const SwarmConn &c = conns_[n.peer_conn[peer]];
+            SwarmPeerStats p;
+            p.node = c.remote;
+            p.bytes = c.useful;
+            p.rate = n.sched->peerRate(peer);
+            p.rtt = n.sched->peerRtt(peer);
+            p.depth = n.sched->queueDepth(peer);
+            p.max_depth = c.max_depth;
+            p.snubbed = n.sched->snubbed(peer);
+            s.peers.push_back(p);
+        }
+        res.leechers.push_back(std::move(s));
+    }
+    return res;
+}
+
+static double cpuSeconds(const rusage &ru) {
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+SwarmResult RunLoopbackSwarm(const TorrentMetadata &meta, const FileStorage &storage, const std::string &seed_dir,
+                             const std::string &out_dir, const SwarmOptions &opts) {
+    if (opts.seeders == 0 || opts.leechers == 0) throw runtime_error("the swarm needs a seeder and a leecher");
+    signal(SIGPIPE, SIG_IGN);
+    rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+
+    unique_ptr<LoopbackTracker> own_tracker;
+    LoopbackTracker *tracker = opts.tracker;
+    if (!tracker) {
+        own_tracker.reset(new LoopbackTracker());
+        tracker = own_tracker.get();
+    }
+    LoopbackSwarm swarm(meta, storage, opts);
+    for (size_t i = 0; i < opts.seeders; ++i) swarm.addNode(true, seed_dir);
+    for (size_t i = 0; i < opts.leechers; ++i) swarm.addNode(false, out_dir + "/leecher-" + to_string(i));
+    for (size_t i = 0; i < opts.seeders + opts.leechers; ++i) swarm.join(i, tracker->port());
+    SwarmResult res = swarm.run();
+
+    getrusage(RUSAGE_SELF, &after);
+    res.cpu_seconds = cpuSeconds(after) - cpuSeconds(before);
+    res.max_rss_bytes = static_cast<uint64_t>(after.ru_maxrss) * 1024;   // KiB on Linux
+    return res;
+}
+
+#endif
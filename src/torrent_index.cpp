@@ -0,0 +1,384 @@
+#include "../include/torrent_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PEERSTORM_INDEX_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+static const int8_t CTRL_EMPTY = -128;
+static const int8_t CTRL_DELETED = -2;
+static const size_t GROUP = 16;
+
+InfoHash::InfoHash(const uint8_t *p) {
+    memcpy(bytes.data(), p, bytes.size());
+}
+
+InfoHash::InfoHash(const std::vector<uint8_t> &v) {
+    if (v.size() < bytes.size()) throw runtime_error("Info-hash must be at least 20 bytes");
+    memcpy(bytes.data(), v.data(), bytes.size());
+}
+
+// -------- Huge page allocation --------
+static const size_t HUGE_PAGE = 2 << 20;
+
+void *hugePageAlloc(size_t bytes) {
+    if (bytes < HUGE_PAGE) return ::operator new(bytes);
+#ifdef __linux__
+    size_t rounded = (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    void *p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+    madvise(p, rounded, MADV_HUGEPAGE);
+    return p;
+#else
+    return ::operator new(bytes);
+#endif
+}
+
+void hugePageFree(void *p, size_t bytes) {
+    if (bytes < HUGE_PAGE) {
+        ::operator delete(p);
+        return;
+    }
+#ifdef __linux__
+    munmap(p, (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE);
+#else
+    ::operator delete(p);
+#endif
+}
+
+// -------- Group matching --------
+static unsigned lowestBit(uint32_t m) {
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, m);
+    return static_cast<unsigned>(i);
+#else
+    return static_cast<unsigned>(__builtin_ctz(m));
+#endif
+}
+
+// bitmask of the control bytes in the group equal to b
+static uint32_t matchByte(const int8_t *ctrl, int8_t b) {
+#ifdef PEERSTORM_INDEX_SSE2
+    __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(b))));
+#else
+    uint32_t m = 0;
+    for (size_t i = 0; i < GROUP; ++i)
+        if (ctrl[i] == b) m |= 1u << i;
+    return m;
+#endif
+}
+
+// bitmask of the empty or deleted control bytes (both are < -1)
+static uint32_t matchFree(const int8_t *ctrl) {
+#ifdef PEERSTORM_INDEX_SSE2
+    __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmplt_epi8(g, _mm_set1_epi8(-1))));
+#else
+    uint32_t m = 0;
+    for (size_t i = 0; i < GROUP; ++i)
+        if (ctrl[i] < -1) m |= 1u << i;
+    return m;
+#endif
+}
+
+static void prefetch(const void *p) {
+#if defined(_MSC_VER)
+    _mm_prefetch(static_cast<const char *>(p), _MM_HINT_T0);
+#else
+    __builtin_prefetch(p);
+#endif
+}
+
+// -------- InfoHashIndex --------
+// Two preferred slots within a group, from hash bits the group and control
+// byte do not use (they may coincide)
+static size_t homeSlot(uint64_t h, int which) {
+    return static_cast<size_t>(h >> (which ? 56 : 60)) & (GROUP - 1);
+}
+
+// Where to put a key in a group whose free slots are `m`
+static size_t pickSlot(uint32_t m, uint64_t h) {
+    for (int which = 0; which < 2; ++which)
+        if ((m >> homeSlot(h, which)) & 1) return homeSlot(h, which);
+    return lowestBit(m);
+}
+
+InfoHashIndex::InfoHashIndex() {
+    // keys can come from the network, so keep the bucket layout unpredictable
+    random_device rd;
+    seed_ = (static_cast<uint64_t>(rd()) << 32) ^ rd();
+}
+
+uint64_t InfoHashIndex::hashKey(const InfoHash &key) const {
+    uint64_t a, b;
+    uint32_t c;
+    memcpy(&a, key.bytes.data(), 8);
+    memcpy(&b, key.bytes.data() + 8, 8);
+    memcpy(&c, key.bytes.data() + 16, 4);
+    uint64_t h = (a ^ seed_) + b * 0x9E3779B97F4A7C15ULL + c;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+size_t InfoHashIndex::findSlot(const InfoHash &key, uint64_t h) const {
+    size_t cap = ctrl_.size();
+    if (cap == 0) return 0;
+    size_t groups = cap / GROUP;
+    size_t g = probeStart(h);
+    int8_t h2 = static_cast<int8_t>(h & 0x7F);
+
+    // triangular probing visits every group when the group count is a power of two
+    for (size_t i = 0; i < groups; ++i) {
+        const int8_t *ctrl = &ctrl_[g * GROUP];
+        for (uint32_t m = matchByte(ctrl, h2); m != 0; m &= m - 1) {
+            size_t idx = g * GROUP + lowestBit(m);
+            if (memcmp(slots_[idx].key, key.bytes.data(), 20) == 0) return idx;
+        }
+        if (matchByte(ctrl, CTRL_EMPTY)) return cap;
+        g = (g + i + 1) & (groups - 1);
+    }
+    return cap;
+}
+
+// First group probed for a hash. Also requests the key's likely slots so they
+// arrive together with the control bytes instead of after them (a slot can
+// straddle two cache lines). Returns the group so the call is never dropped as
+// side-effect free.
+size_t InfoHashIndex::probeStart(uint64_t h) const {
+    size_t g = static_cast<size_t>(h >> 7) & (ctrl_.size() / GROUP - 1);
+    for (int which = 0; which < 2; ++which) {
+        const Slot *home = &slots_[g * GROUP + homeSlot(h, which)];
+        prefetch(home);
+        prefetch(reinterpret_cast<const char *>(home + 1) - 1);
+    }
+    return g;
+}
+
+uint32_t InfoHashIndex::find(const InfoHash &key) const {
+    size_t idx = findSlot(key, hashKey(key));
+    return idx < ctrl_.size() ? slots_[idx].value : INVALID_TORRENT_HANDLE;
+}
+
+void InfoHashIndex::find(const InfoHash *keys, size_t n, uint32_t *out) const {
+    // keys BATCH_AHEAD positions on have their memory requested while the
+    // current one is resolved, so the cache misses of several keys overlap
+    static const size_t BATCH_AHEAD = 8;
+    if (ctrl_.empty()) {
+        fill(out, out + n, INVALID_TORRENT_HANDLE);
+        return;
+    }
+    uint64_t hashes[BATCH_AHEAD];
+    for (size_t i = 0; i < n + BATCH_AHEAD; ++i) {
+        if (i >= BATCH_AHEAD) {
+            size_t j = i - BATCH_AHEAD;
+            size_t idx = findSlot(keys[j], hashes[j % BATCH_AHEAD]);
+            out[j] = idx < ctrl_.size() ? slots_[idx].value : INVALID_TORRENT_HANDLE;
+        }
+        if (i < n) {
+            uint64_t h = hashKey(keys[i]);
+            hashes[i % BATCH_AHEAD] = h;
+            prefetch(&ctrl_[probeStart(h) * GROUP]);
+        }
+    }
+}
+
+uint32_t InfoHashIndex::insert(const InfoHash &key, uint32_t value, bool *inserted) {
+    uint64_t h = hashKey(key);
+    size_t idx = findSlot(key, h);
+    if (idx < ctrl_.size()) {
+        if (inserted) *inserted = false;
+        return slots_[idx].value;
+    }
+
+    size_t cap = ctrl_.size();
+    if (cap == 0 || (size_ + tombstones_ + 1) * 8 > cap * 7) {
+        // grow when live entries dominate, otherwise just sweep the tombstones
+        rehash(cap == 0 ? GROUP : ((size_ + 1) * 16 > cap * 7 ? cap * 2 : cap));
+        cap = ctrl_.size();
+    }
+
+    size_t groups = cap / GROUP;
+    size_t g = static_cast<size_t>(h >> 7) & (groups - 1);
+    for (size_t i = 0;; ++i) {
+        uint32_t m = matchFree(&ctrl_[g * GROUP]);
+        if (m) {
+            idx = g * GROUP + pickSlot(m, h);
+            break;
+        }
+        g = (g + i + 1) & (groups - 1);
+    }
+
+    if (ctrl_[idx] == CTRL_DELETED) --tombstones_;
+    ctrl_[idx] = static_cast<int8_t>(h & 0x7F);
+    memcpy(slots_[idx].key, key.bytes.data(), 20);
+    slots_[idx].value = value;
+    ++size_;
+    if (inserted) *inserted = true;
+    return value;
+}
+
+bool InfoHashIndex::erase(const InfoHash &key) {
+    size_t idx = findSlot(key, hashKey(key));
+    if (idx >= ctrl_.size()) return false;
+
+    // a group that still has an empty slot never sent a probe onwards, so the
+    // slot can go straight back to empty instead of becoming a tombstone
+    const int8_t *group = &ctrl_[idx / GROUP * GROUP];
+    if (matchByte(group, CTRL_EMPTY)) {
+        ctrl_[idx] = CTRL_EMPTY;
+    } else {
+        ctrl_[idx] = CTRL_DELETED;
+        ++tombstones_;
+    }
+    --size_;
+    return true;
+}
+
+void InfoHashIndex::reserve(size_t n) {
+    size_t cap = max(ctrl_.size(), GROUP);
+    while (n * 8 > cap * 7) cap *= 2;
+    if (cap != ctrl_.size()) rehash(cap);
+}
+
+void InfoHashIndex::rehash(size_t new_capacity) {
+    vector<int8_t, HugePageAllocator<int8_t>> old_ctrl(new_capacity, CTRL_EMPTY);
+    vector<Slot, HugePageAllocator<Slot>> old_slots(new_capacity);
+    old_ctrl.swap(ctrl_);
+    old_slots.swap(slots_);
+    size_ = 0;
+    tombstones_ = 0;
+
+    for (size_t i = 0; i < old_ctrl.size(); ++i) {
+        if (old_ctrl[i] < 0) continue;
+        uint64_t h = hashKey(InfoHash(old_slots[i].key));
+        size_t groups = new_capacity / GROUP;
+        size_t g = static_cast<size_t>(h >> 7) & (groups - 1);
+        size_t idx;
+        for (size_t p = 0;; ++p) {
+            uint32_t m = matchByte(&ctrl_[g * GROUP], CTRL_EMPTY);
+            if (m) {
+                idx = g * GROUP + pickSlot(m, h);
+                break;
+            }
+            g = (g + p + 1) & (groups - 1);
+        }
+        ctrl_[idx] = static_cast<int8_t>(h & 0x7F);
+        slots_[idx] = old_slots[i];
+        ++size_;
+    }
+}
+
+// -------- TorrentRegistry --------
+TorrentHandle TorrentRegistry::allocate(const InfoHash &hash) {
+    TorrentHandle h;
+    if (!free_.empty()) {
+        h = free_.back();
+        free_.pop_back();
+    } else {
+        h = static_cast<TorrentHandle>(entries_.size());
+        entries_.emplace_back();
+    }
+    TorrentEntry &e = entries_[h];
+    e.info_hash = hash;
+    e.in_use = true;
+    index_.insert(hash, h);
+    return h;
+}
+
+TorrentHandle TorrentRegistry::addTorrent(TorrentMetadata meta, TorrentHandle *released) {
+    if (released) *released = INVALID_TORRENT_HANDLE;
+    InfoHash hash(meta.info_hash);
+    TorrentHandle h = index_.find(hash);
+    bool hybrid = meta.has_v1 && !meta.info_hash_v2.empty();
+    InfoHash v2_hash = hybrid ? InfoHash(meta.info_hash_v2) : hash;
+    TorrentHandle h2 = hybrid ? index_.find(v2_hash) : INVALID_TORRENT_HANDLE;
+    if (h == INVALID_TORRENT_HANDLE) {
+        h = h2;
+    } else if (h2 != INVALID_TORRENT_HANDLE && h2 != h) {
+        // the two hashes were added separately, e.g. by two magnet links:
+        // fold the v2 entry into the v1 one
+        if (entries_[h2].magnet) mergeMagnet(entries_[h], std::move(*entries_[h2].magnet));
+        remove(h2);
+        if (released) *released = h2;
+    }
+    if (h == INVALID_TORRENT_HANDLE) h = allocate(hash);
+
+    TorrentEntry &e = entries_[h];
+    e.info_hash = hash;
+    if (hybrid) {
+        index_.insert(hash, h);
+        index_.insert(v2_hash, h);
+    }
+    e.meta.reset(new TorrentMetadata(std::move(meta)));
+    return h;
+}
+
+TorrentHandle TorrentRegistry::addMagnet(MagnetData magnet) {
+    InfoHash hash(magnet.info_hash_bytes);
+    TorrentHandle h = index_.find(hash);
+    if (h == INVALID_TORRENT_HANDLE) h = allocate(hash);
+    mergeMagnet(entries_[h], std::move(magnet));
+    return h;
+}
+
+void TorrentRegistry::mergeMagnet(TorrentEntry &e, MagnetData magnet) {
+    if (!e.magnet) {
+        e.magnet.reset(new MagnetData(std::move(magnet)));
+        return;
+    }
+    // same torrent added twice by magnet: keep the union of trackers and web seeds
+    for (auto &t : magnet.trackers)
+        if (find_if(e.magnet->trackers.begin(), e.magnet->trackers.end(),
+                    [&](const string &x) { return x == t; }) == e.magnet->trackers.end())
+            e.magnet->trackers.push_back(t);
+    for (auto &w : magnet.web_seeds)
+        if (find_if(e.magnet->web_seeds.begin(), e.magnet->web_seeds.end(),
+                    [&](const string &x) { return x == w; }) == e.magnet->web_seeds.end())
+            e.magnet->web_seeds.push_back(w);
+}
+
+TorrentEntry *TorrentRegistry::get(TorrentHandle h) {
+    if (h >= entries_.size() || !entries_[h].in_use) return nullptr;
+    return &entries_[h];
+}
+
+const TorrentEntry *TorrentRegistry::get(TorrentHandle h) const {
+    if (h >= entries_.size() || !entries_[h].in_use) return nullptr;
+    return &entries_[h];
+}
+
+bool TorrentRegistry::remove(TorrentHandle h) {
+    TorrentEntry *e = get(h);
+    if (!e) return false;
+    // every key that may lead here: the entry's own, and both of a hybrid's
+    auto drop = [&](const InfoHash &key) {
+        if (index_.find(key) == h) index_.erase(key);
+    };
+    drop(e->info_hash);
+    if (e->meta) {
+        drop(InfoHash(e->meta->info_hash));
+        if (!e->meta->info_hash_v2.empty()) drop(InfoHash(e->meta->info_hash_v2));
+    }
+    *e = TorrentEntry();
+    free_.push_back(h);
+    return true;
+}